@@ -0,0 +1,372 @@
+// SPDX-License-Identifier: BSD-3-Clause
+#pragma once
+
+#include "kargmap/CborSerializer.hpp"
+#include <cmath>
+#include <cstring>
+
+namespace entazza {
+
+/**
+ * \brief Default handlers for CborEventReader::read().  Derive from it and
+ * declare only the events of interest; calls are resolved at compile time,
+ * so nothing is virtual.  Every event returns true to continue or false to
+ * stop reading.
+ */
+class CborEventHandler {
+public:
+  /// The size passed for indefinite length maps and arrays.
+  static const size_t kIndefinite = ~size_t(0);
+
+  bool onMapStart(size_t /*size*/) { return true; }
+  bool onListStart(size_t /*size*/) { return true; }
+  /// The end of the innermost map or list.
+  bool onEnd() { return true; }
+  bool onKey(k_string_view /*key*/) { return true; }
+  bool onNull() { return true; }
+  bool onBool(bool /*value*/) { return true; }
+  bool onInt(int64_t /*value*/) { return true; }
+  /// Unsigned values too large for onInt.
+  bool onUInt(uint64_t /*value*/) { return true; }
+  bool onFloat(double /*value*/) { return true; }
+  /// Text strings, and byte strings that are not typed arrays.
+  bool onString(k_string_view /*value*/) { return true; }
+  /**
+   * \brief A numeric vector as encoded for std::vector<T>.  data points into
+   * the source buffer and may not be aligned for the element type: read it
+   * with memcpy.
+   */
+  bool onTypedArray(KArgTypes /*type*/, const void * /*data*/,
+                    size_t /*count*/) {
+    return true;
+  }
+  bool onTimestamp(KTimestamp /*value*/) { return true; }
+  bool onDuration(KDuration /*value*/) { return true; }
+};
+
+/**
+ * \brief Reads CBOR as a sequence of events instead of building a KArgMap.
+ *
+ * For consumers that need a few values of each message, or that filter or
+ * transcode it, read() reports each map, key and value to a handler derived
+ * from CborEventHandler.  Keys and strings are views into the source buffer,
+ * and nothing is allocated, so the buffer must outlive their use.  The walk
+ * is not recursive; maps and lists may be nested up to kMaxDepth deep.
+ *
+ * Values are reported as encoded by CborSerializer: integers of any width
+ * through onInt(), vectors of numbers through onTypedArray(), and vectors of
+ * other types as lists.  Tags select how the next item is reported and are
+ * otherwise skipped, including the self-described CBOR tag (55799) before a
+ * top level item and any tag on a map key.
+ */
+class CborEventReader {
+public:
+  enum class Result {
+    done,     ///< a whole top level item was read
+    stopped,  ///< a handler returned false
+    malformed ///< invalid or truncated input
+  };
+
+  static const size_t kMaxDepth = 64;
+
+  CborEventReader(const void *data, size_t size)
+      : m_data((const uint8_t *)data), m_size(size) {}
+
+  /// Report the next top level item, usually a map, to handler.
+  template <typename H> Result read(H &handler) {
+    struct Level {
+      uint64_t remaining; ///< items left in a definite length map or list
+      bool indefinite;
+      bool map;
+      bool key; ///< a map expecting a key
+    };
+    Level levels[kMaxDepth];
+    size_t depth = 0;
+    uint64_t tag = kNoTag;
+    // a tag is followed by the item it applies to, even at the top level
+    do {
+      Head h;
+      if (!next(h)) {
+        return Result::malformed;
+      }
+      bool wantKey = depth && levels[depth - 1].key;
+      if (h.major == kCborTag) {
+        tag = h.value;
+        continue;
+      } else if (h.major == kCborSimple && h.minor == 31) { // break
+        if (!depth || !levels[depth - 1].indefinite ||
+            (levels[depth - 1].map && !wantKey) || tag != kNoTag) {
+          return Result::malformed;
+        }
+        depth--;
+        if (!handler.onEnd()) {
+          return Result::stopped;
+        }
+      } else if (wantKey) {
+        if (h.major != kCborUTF8String && h.major != kCborByteString) {
+          return Result::malformed;
+        }
+        tag = kNoTag; // keys are reported as strings whatever their tag
+        k_string_view key;
+        if (!string(h, key)) {
+          return Result::malformed;
+        }
+        if (!handler.onKey(key)) {
+          return Result::stopped;
+        }
+        levels[depth - 1].key = false;
+        continue;
+      } else if (h.major == kCborArray || h.major == kCborMap) {
+        uint64_t itemTag = tag;
+        tag = kNoTag;
+        bool indefinite = h.minor == 31;
+        if (h.major == kCborMap &&
+            (itemTag == kCborTagTimeExt || itemTag == kCborTagDurationExt)) {
+          Result r = time(h, itemTag == kCborTagTimeExt, handler);
+          if (r != Result::done) {
+            return r;
+          }
+        } else {
+          if (depth == kMaxDepth) {
+            return Result::malformed;
+          }
+          size_t size = indefinite ? CborEventHandler::kIndefinite
+                                   : size_t(h.value);
+          bool go = h.major == kCborMap ? handler.onMapStart(size)
+                                        : handler.onListStart(size);
+          if (!go) {
+            return Result::stopped;
+          }
+          bool map = h.major == kCborMap;
+          levels[depth++] = Level{h.value, indefinite, map, map};
+          if (indefinite || h.value) {
+            continue; // its items follow
+          }
+          depth--;
+          if (!handler.onEnd()) {
+            return Result::stopped;
+          }
+        }
+      } else {
+        uint64_t itemTag = tag;
+        tag = kNoTag;
+        Result r = scalar(h, itemTag, handler);
+        if (r != Result::done) {
+          return r;
+        }
+      }
+      // an item is complete; close the lists and maps it completes
+      while (depth) {
+        Level &l = levels[depth - 1];
+        l.key = l.map;
+        if (l.indefinite || --l.remaining != 0) {
+          break;
+        }
+        depth--;
+        if (!handler.onEnd()) {
+          return Result::stopped;
+        }
+      }
+    } while (depth || tag != kNoTag);
+    return Result::done;
+  }
+
+  /// Bytes read so far; the next read() starts here.
+  size_t offset() const { return m_offset; }
+
+  /// True if the whole buffer has been read.
+  bool atEnd() const { return m_offset == m_size; }
+
+private:
+  static const uint64_t kNoTag = ~uint64_t(0);
+
+  struct Head {
+    uint8_t major;
+    uint8_t minor;
+    uint64_t value;
+  };
+
+  bool next(Head &h) {
+    if (m_offset >= m_size) {
+      return false;
+    }
+    uint8_t initial = m_data[m_offset];
+    h.major = initial >> 5;
+    h.minor = initial & 31;
+    size_t width = 0;
+    if (h.minor >= 24 && h.minor <= 27) {
+      width = size_t(1) << (h.minor - 24);
+    } else if (h.minor >= 28 && h.minor <= 30) {
+      return false;
+    }
+    if (m_size - m_offset < 1 + width) {
+      return false;
+    }
+    h.value = h.minor < 24 ? h.minor : 0;
+    for (size_t i = 1; i <= width; i++) {
+      h.value = (h.value << 8) | m_data[m_offset + i];
+    }
+    m_offset += 1 + width;
+    return true;
+  }
+
+  /// The payload of a string header; text loses trailing NULs as in decode().
+  bool string(const Head &h, k_string_view &s) {
+    if (h.minor == 31 || h.value > m_size - m_offset) {
+      return false;
+    }
+    auto p = (const char *)m_data + m_offset;
+    size_t len = size_t(h.value);
+    m_offset += len;
+    if (h.major == kCborUTF8String) {
+      while (len && p[len - 1] == 0) {
+        len--;
+      }
+    }
+    s = k_string_view(p, len);
+    return true;
+  }
+
+  template <typename H> Result scalar(const Head &h, uint64_t tag, H &handler) {
+    bool go;
+    switch (h.major) {
+    case kCborPosInt:
+      go = h.value <= uint64_t(INT64_MAX) ? handler.onInt(int64_t(h.value))
+                                          : handler.onUInt(h.value);
+      break;
+    case kCborNegInt:
+      if (h.value > uint64_t(INT64_MAX)) {
+        return Result::malformed;
+      }
+      go = handler.onInt(-int64_t(h.value) - 1);
+      break;
+    case kCborByteString:
+    case kCborUTF8String: {
+      k_string_view s;
+      if (!string(h, s)) {
+        return Result::malformed;
+      }
+      KArgTypes type;
+      size_t width;
+      if (h.major == kCborByteString && typedArray(tag, type, width)) {
+        go = handler.onTypedArray(type, s.data(), s.size() / width);
+      } else {
+        go = handler.onString(s);
+      }
+      break;
+    }
+    default: // simple values and floats
+      switch (h.minor) {
+      case 20:
+      case 21:
+        go = handler.onBool(h.minor == 21);
+        break;
+      case 22:
+      case 23:
+        go = handler.onNull();
+        break;
+      case 25:
+        go = handler.onFloat(halfToFloat(uint16_t(h.value)));
+        break;
+      case 26: {
+        uint32_t bits = uint32_t(h.value);
+        float f;
+        std::memcpy(&f, &bits, sizeof(f));
+        go = handler.onFloat(f);
+        break;
+      }
+      case 27: {
+        double d;
+        std::memcpy(&d, &h.value, sizeof(d));
+        go = handler.onFloat(d);
+        break;
+      }
+      default:
+        go = handler.onInt(int64_t(h.value));
+        break;
+      }
+    }
+    return go ? Result::done : Result::stopped;
+  }
+
+  /// A time or duration map of seconds (key 1) and nanoseconds (key -9).
+  template <typename H> Result time(const Head &map, bool timestamp, H &handler) {
+    if (map.minor == 31) {
+      return Result::malformed;
+    }
+    uint64_t secs = 0, nano = 0;
+    for (uint64_t i = 0; i < map.value; i++) {
+      Head key, value;
+      if (!next(key) || !next(value) || value.major != kCborPosInt) {
+        return Result::malformed;
+      }
+      if (key.major == kCborPosInt && key.value == 1) {
+        secs = value.value;
+      } else if (key.major == kCborNegInt && key.value == 8) {
+        nano = value.value;
+      }
+    }
+    auto ns = std::chrono::nanoseconds(secs * uint64_t(1000000000) + nano);
+    bool go = timestamp ? handler.onTimestamp(KTimestamp(ns))
+                        : handler.onDuration(KDuration(ns));
+    return go ? Result::done : Result::stopped;
+  }
+
+  static bool typedArray(uint64_t tag, KArgTypes &type, size_t &width) {
+    switch (tag) {
+    case kCborTagUint8:
+      type = KArgTypes::uint8, width = 1;
+      return true;
+    case kCborTagUint16:
+      type = KArgTypes::uint16, width = 2;
+      return true;
+    case kCborTagUint32:
+      type = KArgTypes::uint32, width = 4;
+      return true;
+    case kCborTagUint64:
+      type = KArgTypes::uint64, width = 8;
+      return true;
+    case kCborTagInt8:
+      type = KArgTypes::int8, width = 1;
+      return true;
+    case kCborTagInt16:
+      type = KArgTypes::int16, width = 2;
+      return true;
+    case kCborTagInt32:
+      type = KArgTypes::int32, width = 4;
+      return true;
+    case kCborTagInt64:
+      type = KArgTypes::int64, width = 8;
+      return true;
+    case kCborTagFloat32:
+      type = KArgTypes::float32, width = 4;
+      return true;
+    case kCborTagFloat64:
+      type = KArgTypes::float64, width = 8;
+      return true;
+    default:
+      return false;
+    }
+  }
+
+  static float halfToFloat(uint16_t half) {
+    int exponent = (half >> 10) & 0x1f;
+    int mantissa = half & 0x3ff;
+    float value;
+    if (exponent == 0) {
+      value = std::ldexp(float(mantissa), -24);
+    } else if (exponent != 31) {
+      value = std::ldexp(float(mantissa + 1024), exponent - 25);
+    } else {
+      value = mantissa ? std::numeric_limits<float>::quiet_NaN()
+                       : std::numeric_limits<float>::infinity();
+    }
+    return half & 0x8000 ? -value : value;
+  }
+
+  const uint8_t *m_data;
+  size_t m_size;
+  size_t m_offset = 0;
+};
+
+} // namespace entazza
@@ -16,15 +16,116 @@ class CborSerializer;
 
 #include "kargmap/KArgMap.hpp"
 #include "microcbor/MicroCbor.hpp"
+#include <algorithm>
+#include <functional>
 #include <memory>
+#include <vector>
 
 namespace entazza {
+
+/**
+ * @brief The '|' separated paths CborSerializer::decode(const CborProjection &)
+ * should build, e.g. "header|seq" or "samples|0|value".  A numeric segment
+ * addresses a list element, as in KArgPath.  Build it once and reuse it.
+ */
+class CborProjection {
+public:
+  CborProjection() {}
+
+  CborProjection(std::initializer_list<k_string_view> paths) {
+    for (auto path : paths) {
+      add(path);
+    }
+  }
+
+  /// Also decode the value at path, with everything below it.
+  CborProjection &add(k_string_view path) {
+    Node *node = &m_root;
+    if (path.empty()) {
+      node->all = true;
+      node->children.clear();
+      return *this;
+    }
+    for (;;) {
+      if (node->all) {
+        return *this; // a path above already takes everything
+      }
+      auto pos = KArgMapInternal::k_path_separator(path);
+      k_string_view segment(path.data(), pos);
+      Node *child = const_cast<Node *>(node->find(segment));
+      if (!child) {
+        node->children.emplace_back();
+        child = &node->children.back();
+        child->key.assign(segment.data(), segment.size());
+        child->isIndex = KArgMapInternal::k_path_is_index(segment);
+        child->index = KArgMapInternal::k_path_index(segment);
+        if (child->isIndex && child->index >= node->listSize) {
+          node->listSize = child->index + 1;
+        }
+      }
+      node = child;
+      if (pos == path.size()) {
+        break;
+      }
+      path = k_string_view(path.data() + pos + 1, path.size() - pos - 1);
+    }
+    node->all = true;
+    node->children.clear();
+    return *this;
+  }
+
+private:
+  friend class CborSerializer;
+
+  struct Node {
+    k_map_string_t key;
+    bool isIndex = false;
+    size_t index = 0;
+    bool all = false;     ///< decode everything below
+    size_t listSize = 0;  ///< one past the largest index among children
+    std::vector<Node> children;
+
+    const Node *find(k_string_view segment) const {
+      for (auto const &child : children) {
+        if (child.key.size() == segment.size() &&
+            std::memcmp(child.key.data(), segment.data(), segment.size()) ==
+                0) {
+          return &child;
+        }
+      }
+      return nullptr;
+    }
+
+    const Node *find(size_t i) const {
+      for (auto const &child : children) {
+        if (child.isIndex && child.index == i) {
+          return &child;
+        }
+      }
+      return nullptr;
+    }
+  };
+
+  Node m_root;
+};
+
 class CborSerializer {
 
   using CborError_t = MicroCbor::Error;
 
 private:
   MicroCbor cbor;
+  KArgArena *m_arena = nullptr; ///< where decode() places maps and lists
+  KArgStringPool *m_strings = nullptr; ///< shares decoded string values
+  uint8_t *m_buf;     ///< the buffer given by the caller
+  uint32_t m_bufLen;
+
+  // State of an encode() into a growable vector or a sink
+  std::vector<uint8_t> *m_out = nullptr; ///< the vector being appended to
+  size_t m_used = 0;                     ///< bytes of *m_out already final
+  const std::function<void(const uint8_t *, size_t)> *m_sink = nullptr;
+  uint8_t *m_current = nullptr;   ///< the buffer passed to the sink next
+  std::vector<uint8_t> m_large;   ///< holds a piece larger than m_buf
 
 public:
   /**
@@ -36,7 +137,11 @@ public:
    */
   CborSerializer(void *buf, const uint32_t maxBufLen,
                  const bool nullTerminate = false)
-      : cbor(buf, maxBufLen, nullTerminate) {}
+      : cbor(buf, maxBufLen, nullTerminate), m_buf((uint8_t *)buf),
+        m_bufLen(maxBufLen) {}
+
+  /// Receives encoded bytes in order, see encode(const KArgMap &, const Sink &).
+  typedef std::function<void(const uint8_t *data, size_t size)> Sink;
 
   /**
    * @brief Encode a KArgMap instance into a CBOR binary array of bytes.
@@ -50,6 +155,86 @@ public:
     return encodeKArgMapImpl(*(argMap.m_map));
   }
 
+  /**
+   * @brief The exact number of bytes encode(argMap) needs, e.g. to reserve
+   * space in a send buffer before encoding.
+   *
+   * This costs exactly one encode pass: the map is walked once by the
+   * encoder itself with no output buffer, so every value is formatted as in
+   * a real encode but nothing is written and no strings or arrays are
+   * copied.  Using the encoder keeps the size in step with MicroCbor's
+   * choice of integer and float widths, which a separate size walk would
+   * have to duplicate.  Like restart(), this discards any encode in
+   * progress.
+   */
+  inline uint32_t encodedSize(const KArgMap &argMap) {
+    cbor.initBuffer((void *)nullptr, 0);
+    cbor.restart();
+    encodeKArgMapImpl(*argMap.m_map);
+    uint32_t size = cbor.bytesNeeded();
+    cbor.initBuffer(m_buf, m_bufLen);
+    cbor.restart();
+    return size;
+  }
+
+  /**
+   * @brief Encode a KArgMap and append it to out, which grows as needed.
+   *
+   * The map is encoded in a single pass: when the space left in out runs
+   * short, out is grown and only the value that did not fit is encoded
+   * again.  The buffer given to the constructor is not used.
+   *
+   * @return CborError_t 0 on success.
+   */
+  inline CborError_t encode(const KArgMap &argMap, std::vector<uint8_t> &out) {
+    m_out = &out;
+    m_used = out.size();
+    nextBuffer(0, 256);
+    encodeMapPieces(nullptr, *argMap.m_map);
+    m_used += cbor.bytesSerialized();
+    out.resize(m_used);
+    return endStream();
+  }
+
+  /**
+   * @brief Encode a KArgMap in pieces, e.g. to a file, socket or ring buffer.
+   *
+   * The buffer given to the constructor is filled with whole values and
+   * passed to sink whenever the next value does not fit, and once more at
+   * the end.  Memory use is therefore bounded by the buffer size regardless
+   * of the size of the map, except that a single value larger than the
+   * buffer (a long string or vector) is encoded in a temporary buffer of its
+   * own size.  Nothing is encoded twice apart from a value that did not fit.
+   *
+   * @return CborError_t 0 on success.
+   */
+  inline CborError_t encode(const KArgMap &argMap, const Sink &sink) {
+    m_sink = &sink;
+    m_current = m_buf;
+    cbor.initBuffer(m_buf, m_bufLen);
+    cbor.restart();
+    encodeMapPieces(nullptr, *argMap.m_map);
+    if (cbor.bytesSerialized()) {
+      sink(m_current, cbor.bytesSerialized());
+    }
+    return endStream();
+  }
+
+  /**
+   * @brief Encode a KArgPersistentMap as a CBOR map, without converting it to
+   * a KArgMap first.  Decode it with decode() and KArgPersistentMap(KArgMap).
+   */
+  inline CborError_t encode(const KArgPersistentMap &argMap) {
+    cbor.startMap();
+    argMap.forEach([this](const k_map_string_t &key, const KArgVariant &val) {
+      if (val.m_type != KArgTypes::null) {
+        encodeArgItem(key.c_str(), val);
+      }
+    });
+    cbor.endMap();
+    return cbor.getResult();
+  }
+
   inline KArgMap decode() {
     auto info = cbor.getNextField();
     // We must be in a map to find anything
@@ -60,6 +245,49 @@ public:
     return value;
   };
 
+  /**
+   * @brief Decode into maps and lists placed in arena (see KArgArena).
+   */
+  inline KArgMap decode(KArgArena &arena) {
+    m_arena = &arena;
+    auto map = decode();
+    m_arena = nullptr;
+    return map.arena() ? map : KArgMap(arena);
+  }
+
+  /**
+   * @brief Decode string values through pool, so repeated strings share
+   * storage (see KArgStringPool).  Pass nullptr to stop.  The pool must
+   * outlive its use by this serializer.
+   */
+  inline void setStringPool(KArgStringPool *pool) { m_strings = pool; }
+
+  /**
+   * @brief Decode, sharing subtrees equal to ones already in store (see
+   * KArgInternStore).  The result is a copy-on-write handle.
+   */
+  inline KArgMap decode(KArgInternStore &store) {
+    return store.intern(decode());
+  }
+
+  /**
+   * @brief Decode only the values at the paths of projection and the maps and
+   * lists leading to them.  Everything else is skipped without being built.
+   * A projected list keeps the positions of its wanted elements: it ends
+   * after the last one and holds null for those skipped before it.
+   */
+  inline KArgMap decode(const CborProjection &projection) {
+    if (projection.m_root.all) {
+      return decode();
+    }
+    auto info = cbor.getNextField();
+    if (info.majorval != entazza::kCborMap) {
+      return KArgMap();
+    }
+    auto value = readProjected(projection.m_root);
+    return value;
+  }
+
   /**
    * @brief Get the result of encoding.
    * If non-zero the output buffer was not large enough.  In
@@ -96,6 +324,8 @@ public:
    * @param maxBufLen The length in bytes of the buffer
    */
   inline void initBuffer(void *buf, const uint32_t maxBufLen) noexcept {
+    m_buf = (uint8_t *)buf;
+    m_bufLen = maxBufLen;
     cbor.initBuffer(buf, maxBufLen);
   }
 
@@ -108,6 +338,8 @@ public:
    * @param maxBufLen The length in bytes of the buffer
    */
   inline void initBuffer(const void *buf, const uint32_t maxBufLen) noexcept {
+    m_buf = nullptr;
+    m_bufLen = 0;
     cbor.initBuffer(buf, maxBufLen);
   }
 
@@ -118,6 +350,98 @@ public:
   inline void restart() noexcept { cbor.restart(); }
 
 private:
+  /**
+   * @brief Encode one piece of a streamed map.  If it does not fit, the
+   * pieces before it are handed on (see nextBuffer) and it is encoded again
+   * into a buffer with room for it.
+   */
+  template <typename F> void piece(F encodePiece) {
+    uint32_t start = cbor.bytesSerialized();
+    encodePiece();
+    if (cbor.getResult() == CborError_t(0)) {
+      return;
+    }
+    nextBuffer(start, cbor.bytesNeeded() - start);
+    encodePiece();
+  }
+
+  /**
+   * @brief Hand on the first done bytes of the current buffer and continue
+   * in a buffer with room for at least need bytes.
+   */
+  void nextBuffer(uint32_t done, size_t need) {
+    if (m_out) {
+      m_used += done;
+      if (m_out->size() - m_used < need) {
+        m_out->resize(std::max(m_used + need, m_out->size() * 2));
+      }
+      cbor.initBuffer(m_out->data() + m_used, uint32_t(m_out->size() - m_used));
+    } else {
+      if (done) {
+        (*m_sink)(m_current, done);
+      }
+      if (need <= m_bufLen) {
+        m_current = m_buf;
+        cbor.initBuffer(m_buf, m_bufLen);
+      } else {
+        m_large.resize(need);
+        m_current = m_large.data();
+        cbor.initBuffer(m_current, uint32_t(need));
+      }
+    }
+    cbor.restart();
+  }
+
+  /// Finish a streamed encode and return to the caller's buffer.
+  CborError_t endStream() {
+    CborError_t result = cbor.getResult();
+    m_out = nullptr;
+    m_sink = nullptr;
+    std::vector<uint8_t>().swap(m_large);
+    cbor.initBuffer(m_buf, m_bufLen);
+    cbor.restart();
+    return result;
+  }
+
+  /// Encode a map as a header piece followed by a piece per value.
+  void encodeMapPieces(const char *name, const k_arg_map_type &argMap) {
+    size_t count = 0;
+    for (auto const &item : argMap) {
+      if (item.second.m_type != KArgTypes::null) {
+        count++;
+      }
+    }
+    piece([&] {
+      cbor.encodeMapKey(name);
+      cbor.encodeHeader(entazza::kCborMap, count);
+    });
+    for (auto const &item : argMap) {
+      if (item.second.m_type != KArgTypes::null) {
+        encodeItemPieces(item.first.c_str(), item.second);
+      }
+    }
+  }
+
+  void encodeListPieces(const char *name, const k_arg_list_type &argList) {
+    piece([&] {
+      cbor.encodeMapKey(name);
+      cbor.encodeHeader(entazza::kCborArray, argList.size());
+    });
+    for (auto const &item : argList) {
+      encodeItemPieces(nullptr, item);
+    }
+  }
+
+  void encodeItemPieces(const char *name, const KArgVariant &val) {
+    if (!val.m_vector && val.m_type == KArgTypes::map) {
+      return encodeMapPieces(name, *val.m_value.map);
+    }
+    if (!val.m_vector && val.m_type == KArgTypes::list) {
+      return encodeListPieces(name, *val.m_value.list);
+    }
+    piece([&] { encodeArgItem(name, val); });
+  }
+
   inline void encodeArgList(const k_arg_list_type &argList) {
     cbor.encodeHeader(entazza::kCborArray, argList.size());
     for (auto const &item : argList) {
@@ -133,7 +457,7 @@ private:
     cbor.encodeTag(entazza::kCborTagHomogeneousArray);
     cbor.encodeHeader(entazza::kCborArray, vec->size());
     for (size_t i = 0; i < vec->size(); ++i) {
-      auto element = (*vec)[i];
+      auto &element = (*vec)[i];
       func(element);
     }
   }
@@ -198,6 +522,9 @@ private:
         cbor.encodeTag(entazza::kCborTagHomogeneousArray);
         cbor.encodeHeader(entazza::kCborArray, length);
         cbor.reserveBytes(length);
+        if (cbor.getResult() != CborError_t(0)) {
+          return; // no room, or only counting (see encodedSize)
+        }
         for (size_t i = 0; i < length; ++i) {
           auto element = (*vec)[i];
           cbor.storeByte(element ? entazza::kCborTrue : entazza::kCborFalse);
@@ -471,6 +798,9 @@ private:
       while (len && cString[len - 1] == 0) {
         len--;
       }
+      if (m_strings) {
+        return m_strings->value(k_string_view(cString, len));
+      }
       std::string s(cString, len);
       return std::move(s);
     }
@@ -536,7 +866,7 @@ private:
       };
     }
     case kCborMap: {
-      KArgMap map;
+      KArgMap map(KArgMapInternal::k_new_map(m_arena));
       auto numItems = cbor.getFieldValue<uint32_t>(value);
       cbor.mDataOffset += value.headerBytes; // skip map length
       while (numItems-- != 0) {
@@ -557,7 +887,7 @@ private:
     case kCborArray: {
       auto numItems = cbor.getFieldValue<uint32_t>(value);
       cbor.mDataOffset += value.headerBytes; // skip list length
-      k_arg_list_ptr result = std::make_shared<k_arg_list_type>();
+      k_arg_list_ptr result = KArgMapInternal::k_new_list(m_arena);
       for (size_t i = 0; i < numItems; i++) {
         auto item = readItem(nullptr);
         result->push_back(item);
@@ -570,5 +900,56 @@ private:
       break;
     }
   }
+
+  /// Like readItem(), building only the paths below node.
+  KArgVariant readProjected(const CborProjection::Node &node) {
+    if (node.all) {
+      return readItem(nullptr);
+    }
+    auto value = cbor.getNextField();
+    bool tagged = value.tag == kCborTagTimeExt ||
+                  value.tag == kCborTagDurationExt ||
+                  value.tag == kCborTagHomogeneousArray;
+    if (tagged ||
+        (value.majorval != kCborMap && value.majorval != kCborArray)) {
+      // the path leads into a value that has no children
+      cbor.skipField(value);
+      return KArgVariant();
+    }
+    auto numItems = cbor.getFieldValue<uint32_t>(value);
+    cbor.mDataOffset += value.headerBytes; // skip map or list length
+    if (value.majorval == kCborMap) {
+      KArgMap map(KArgMapInternal::k_new_map(m_arena));
+      while (numItems-- != 0) {
+        auto key = cbor.getNextField();
+        auto len = cbor.getFieldValue<uint32_t>(key);
+        const auto cKey =
+            (const char *)cbor.mBuf + cbor.mDataOffset + key.headerBytes;
+        cbor.mDataOffset += key.headerBytes + len;
+        auto child = node.find(k_string_view(cKey, len));
+        if (child) {
+          map[std::string(cKey, len)] = readProjected(*child);
+        } else {
+          value = cbor.getNextField();
+          cbor.skipField(value);
+        }
+      }
+      return map;
+    }
+    k_arg_list_ptr result = KArgMapInternal::k_new_list(m_arena);
+    for (size_t i = 0; i < numItems; i++) {
+      auto child = node.find(i);
+      if (child) {
+        result->push_back(readProjected(*child));
+      } else {
+        value = cbor.getNextField();
+        cbor.skipField(value);
+        if (i < node.listSize) {
+          result->push_back(KArgVariant());
+        }
+      }
+    }
+    return result;
+  }
 }; // namespace entazza
 } // namespace entazza
@@ -0,0 +1,423 @@
+// SPDX-License-Identifier: BSD-3-Clause
+#pragma once
+
+#include "kargmap/CborSerializer.hpp"
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace entazza {
+
+/**
+ * \brief Decodes a stream of CBOR maps that arrives in pieces.
+ *
+ * Pass bytes to feed() in chunks of any size, e.g. as they are read from a
+ * socket or pipe.  Each time a top level map is complete it is passed to the
+ * handler, decoded as CborSerializer::decode() would decode it.  The parse
+ * state is kept in this object rather than on the call stack, so a chunk may
+ * end anywhere, even inside a number, and deep nesting cannot overflow the
+ * stack.  Only the bytes of an unfinished string or byte array are buffered.
+ *
+ * Top level items that are not maps are skipped.  Indefinite length maps and
+ * arrays are accepted; indefinite length strings are not.
+ */
+class CborStreamDecoder {
+public:
+  /// Receives each decoded top level map.
+  typedef std::function<void(KArgMap map)> Handler;
+
+  explicit CborStreamDecoder(Handler handler) : m_handler(std::move(handler)) {}
+
+  /**
+   * \brief Decode the next size bytes of the stream.  The handler is called
+   * for every map they complete before feed() returns.
+   * \return false if the stream is malformed.  Further input is ignored until
+   * reset().
+   */
+  bool feed(const void *data, size_t size) {
+    auto p = (const uint8_t *)data;
+    auto end = p + size;
+    while (p != end && !m_failed) {
+      if (m_need) { // the rest of a string or byte array
+        size_t n = std::min(size_t(end - p), m_need);
+        m_payload.append((const char *)p, n);
+        p += n;
+        m_need -= n;
+        if (m_need == 0) {
+          payloadDone();
+        }
+        continue;
+      }
+      m_head[m_headLen++] = *p++;
+      int width = argumentWidth(m_head[0]);
+      if (width < 0) {
+        m_failed = true;
+      } else if (m_headLen == size_t(1 + width)) {
+        m_headLen = 0;
+        header(width);
+      }
+    }
+    return !m_failed;
+  }
+
+  /// True if feed() found malformed input.
+  bool failed() const { return m_failed; }
+
+  /// True if no item is partly decoded, i.e. the stream ended on a boundary.
+  bool idle() const { return m_stack.empty() && !m_headLen && !m_need; }
+
+  /// Drop any partly decoded item and clear a failure.
+  void reset() {
+    m_stack.clear();
+    m_payload.clear();
+    m_headLen = 0;
+    m_need = 0;
+    m_tag = kNoTag;
+    m_failed = false;
+  }
+
+private:
+  static const uint64_t kNoTag = ~uint64_t(0);
+
+  /// A map or array whose items are still arriving.
+  struct Frame {
+    enum Kind { kMap, kList, kVector, kTime, kDuration };
+    Kind kind;
+    bool indefinite;
+    uint64_t remaining; ///< items left, keys and values counted separately
+    KArgMap map;
+    k_arg_list_ptr list;
+    std::vector<KArgVariant> items; ///< elements of a homogeneous array
+    k_map_string_t key;
+    bool haveKey = false;
+    int64_t timeKey = 0;
+    uint64_t secs = 0;
+    uint64_t nano = 0;
+  };
+
+  /// The number of bytes following the initial byte, -1 if reserved.
+  static int argumentWidth(uint8_t initial) {
+    uint8_t minor = initial & 31;
+    if (minor < 24 || minor == 31) {
+      return 0;
+    }
+    return minor <= 27 ? 1 << (minor - 24) : -1;
+  }
+
+  /// Handle a complete item header held in m_head.
+  void header(int width) {
+    uint8_t major = m_head[0] >> 5;
+    uint8_t minor = m_head[0] & 31;
+    uint64_t value = minor < 24 ? minor : 0;
+    for (int i = 1; i <= width; i++) {
+      value = (value << 8) | m_head[i];
+    }
+    size_t headerBytes = 1 + width;
+    uint64_t tag = m_tag;
+    m_tag = kNoTag;
+    m_isInt = false;
+
+    switch (major) {
+    case kCborPosInt: {
+      m_isInt = true;
+      m_int = int64_t(value);
+      // the same types as CborSerializer::decode()
+      switch (headerBytes) {
+      case 1:
+      case 2:
+        return complete(uint8_t(value));
+      case 3:
+        return complete(uint16_t(value));
+      case 5:
+        return complete(uint32_t(value));
+      default:
+        return complete(uint64_t(value));
+      }
+    }
+    case kCborNegInt: {
+      int64_t v = -int64_t(value) - 1;
+      m_isInt = true;
+      m_int = v;
+      switch (headerBytes) {
+      case 1:
+      case 2:
+        return complete(int8_t(v));
+      case 3:
+        return complete(int16_t(v));
+      case 5:
+        return complete(int32_t(v));
+      default:
+        return complete(int64_t(v));
+      }
+    }
+    case kCborByteString:
+    case kCborUTF8String:
+      if (minor == 31) {
+        m_failed = true;
+        return;
+      }
+      m_stringMajor = major;
+      m_stringTag = tag;
+      m_payload.clear();
+      m_payload.reserve(size_t(std::min<uint64_t>(value, 65536)));
+      m_need = size_t(value);
+      if (m_need == 0) {
+        payloadDone();
+      }
+      return;
+    case kCborArray:
+      return open(tag == kCborTagHomogeneousArray ? Frame::kVector
+                                                  : Frame::kList,
+                  minor == 31, value);
+    case kCborMap:
+      return open(tag == kCborTagTimeExt       ? Frame::kTime
+                  : tag == kCborTagDurationExt ? Frame::kDuration
+                                               : Frame::kMap,
+                  minor == 31, value * 2);
+    case kCborTag:
+      m_tag = value;
+      return;
+    default: // simple values and floats
+      switch (minor) {
+      case 20:
+        return complete(false);
+      case 21:
+        return complete(true);
+      case 22:
+      case 23:
+        return complete(KArgVariant());
+      case 24:
+        return complete(uint8_t(value));
+      case 26: {
+        uint32_t bits = uint32_t(value);
+        float f;
+        std::memcpy(&f, &bits, sizeof(f));
+        return complete(f);
+      }
+      case 27: {
+        double d;
+        std::memcpy(&d, &value, sizeof(d));
+        return complete(d);
+      }
+      case 31:
+        return close();
+      default:
+        return complete(uint64_t(0)); // as CborSerializer::decode()
+      }
+    }
+  }
+
+  void open(Frame::Kind kind, bool indefinite, uint64_t items) {
+    m_stack.emplace_back();
+    Frame &f = m_stack.back();
+    f.kind = kind;
+    f.indefinite = indefinite;
+    f.remaining = items;
+    if (kind == Frame::kList) {
+      f.list = KArgMapInternal::k_new_list(nullptr);
+    }
+    if (!indefinite && items == 0) {
+      KArgVariant value;
+      if (finish(value)) {
+        complete(std::move(value));
+      }
+    }
+  }
+
+  /// The break that ends an indefinite length map or array.
+  void close() {
+    if (m_stack.empty() || !m_stack.back().indefinite ||
+        m_stack.back().haveKey) {
+      m_failed = true;
+      return;
+    }
+    KArgVariant value;
+    if (finish(value)) {
+      complete(std::move(value));
+    }
+  }
+
+  void payloadDone() {
+    const void *data = m_payload.data();
+    uint32_t len = uint32_t(m_payload.size());
+    if (m_stringMajor == kCborUTF8String) {
+      // eat trailing nulls if present
+      while (len && m_payload[len - 1] == 0) {
+        len--;
+      }
+      return complete(m_payload.substr(0, len));
+    }
+    switch (m_stringTag) {
+    case kCborTagUint8:
+      return complete(array<uint8_t>(data, len));
+    case kCborTagUint16:
+      return complete(array<uint16_t>(data, len));
+    case kCborTagUint32:
+      return complete(array<uint32_t>(data, len));
+    case kCborTagUint64:
+      return complete(array<uint64_t>(data, len));
+    case kCborTagInt8:
+      return complete(array<int8_t>(data, len));
+    case kCborTagInt16:
+      return complete(array<int16_t>(data, len));
+    case kCborTagInt32:
+      return complete(array<int32_t>(data, len));
+    case kCborTagInt64:
+      return complete(array<int64_t>(data, len));
+    case kCborTagFloat32:
+      return complete(array<float>(data, len));
+    case kCborTagFloat64:
+      return complete(array<double>(data, len));
+    default:
+      return complete(m_payload);
+    }
+  }
+
+  template <class T>
+  static std::shared_ptr<std::vector<T>> array(const void *bytes,
+                                               uint32_t numBytes) {
+    auto value = std::make_shared<std::vector<T>>(numBytes / sizeof(T));
+    std::memcpy(value->data(), bytes, value->size() * sizeof(T));
+    return value;
+  }
+
+  /**
+   * \brief Add a finished item to the open map or array.  Arrays and maps it
+   * completes are added to their parents in turn, and a finished top level
+   * map goes to the handler.
+   */
+  void complete(KArgVariant value) {
+    while (!m_stack.empty()) {
+      Frame &f = m_stack.back();
+      if (!add(f, value)) {
+        m_failed = true;
+        return;
+      }
+      if (f.indefinite || --f.remaining != 0 || !finish(value)) {
+        return;
+      }
+      m_isInt = false;
+    }
+    // a top level item that is not a map is skipped
+  }
+
+  bool add(Frame &f, KArgVariant &value) {
+    switch (f.kind) {
+    case Frame::kMap:
+      if (!f.haveKey) {
+        if (value.m_type != KArgTypes::string || value.m_vector) {
+          return false;
+        }
+        f.key = value.as<std::string>();
+        f.haveKey = true;
+      } else {
+        f.map[f.key] = value;
+        f.haveKey = false;
+      }
+      return true;
+    case Frame::kList:
+      f.list->push_back(value);
+      return true;
+    case Frame::kVector:
+      f.items.push_back(value);
+      return true;
+    default: // time or duration, a map of seconds (1) and nanoseconds (-9)
+      if (!f.haveKey) {
+        f.timeKey = m_isInt ? m_int : 0;
+        f.haveKey = true;
+      } else {
+        if (m_isInt && m_int >= 0) {
+          if (f.timeKey == 1) {
+            f.secs = uint64_t(m_int);
+          } else if (f.timeKey == -9) {
+            f.nano = uint64_t(m_int);
+          }
+        }
+        f.haveKey = false;
+      }
+      return true;
+    }
+  }
+
+  /**
+   * \brief Close the innermost map or array.  Sets value to it and returns
+   * true, or passes a top level map to the handler and returns false.
+   */
+  bool finish(KArgVariant &value) {
+    Frame f = std::move(m_stack.back());
+    m_stack.pop_back();
+    switch (f.kind) {
+    case Frame::kMap:
+      if (m_stack.empty()) {
+        m_handler(f.map);
+        return false;
+      }
+      value = f.map;
+      return true;
+    case Frame::kList:
+      value = f.list;
+      return true;
+    case Frame::kVector:
+      value = typedVector(f.items);
+      return true;
+    case Frame::kTime:
+      value = KTimestamp(
+          std::chrono::nanoseconds(f.secs * uint64_t(1000000000) + f.nano));
+      return true;
+    default:
+      value = KDuration(
+          std::chrono::nanoseconds(f.secs * uint64_t(1000000000) + f.nano));
+      return true;
+    }
+  }
+
+  /// A homogeneous array typed by its first element, as decode() does.
+  static KArgVariant typedVector(const std::vector<KArgVariant> &items) {
+    if (items.empty() || items[0].m_vector) {
+      return KArgVariant();
+    }
+    switch (items[0].m_type) {
+    case KArgTypes::boolean:
+      return typedVector<bool>(items);
+    case KArgTypes::timestamp:
+      return typedVector<KTimestamp>(items);
+    case KArgTypes::duration:
+      return typedVector<KDuration>(items);
+    case KArgTypes::string: {
+      auto v = std::make_shared<std::vector<std::string>>(items.size());
+      for (size_t i = 0; i < items.size(); i++) {
+        (*v)[i] = items[i].as<std::string>();
+      }
+      return v;
+    }
+    default:
+      return KArgVariant();
+    }
+  }
+
+  template <class T>
+  static KArgVariant typedVector(const std::vector<KArgVariant> &items) {
+    auto v = std::make_shared<std::vector<T>>(items.size());
+    for (size_t i = 0; i < items.size(); i++) {
+      (*v)[i] = items[i].as<T>();
+    }
+    return v;
+  }
+
+  Handler m_handler;
+  std::vector<Frame> m_stack; ///< open maps and arrays, innermost last
+  uint8_t m_head[9];          ///< the item header being read
+  size_t m_headLen = 0;
+  std::string m_payload;      ///< the string or byte array being read
+  size_t m_need = 0;          ///< bytes of m_payload still to come
+  uint8_t m_stringMajor = 0;
+  uint64_t m_stringTag = kNoTag;
+  uint64_t m_tag = kNoTag;    ///< the tag of the next item
+  bool m_isInt = false;       ///< the completed item is an integer m_int
+  int64_t m_int = 0;
+  bool m_failed = false;
+};
+
+} // namespace entazza
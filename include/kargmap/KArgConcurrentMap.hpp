@@ -0,0 +1,154 @@
+// SPDX-License-Identifier: BSD-3-Clause
+#pragma once
+
+#include "kargmap/KArgMap.hpp"
+#include <memory>
+#include <mutex>
+
+#ifdef K_SINGLE_THREADED
+#error KArgConcurrentMap.hpp shares maps between threads and cannot be used with K_SINGLE_THREADED
+#endif
+
+namespace entazza {
+
+/**
+ * \brief A KArgMap that many threads can read and write at once.
+ *
+ * Keys are spread over independently locked shards by the hash of their
+ * first path segment, so "sensor|a" and "sensor|b" live in the same shard
+ * and writers of different top level keys rarely contend.  get(), set(),
+ * containsKey() and erase() behave as on a KArgMap, including default
+ * values and the '|' path syntax, and lock a single shard.
+ *
+ * Shards are held in copy-on-write mode (see KArgMap::cowClone).  Maps and
+ * lists returned by get() or snapshot() therefore stay unchanged while other
+ * threads keep writing, because a write copies any container still shared
+ * with them.
+ */
+class KArgConcurrentMap {
+  /// A shard, padded so the locks of two shards never share a cache line.
+  struct Shard {
+    std::mutex mutex;
+    KArgMap map = KArgMap().cowClone();
+    char padding[64];
+  };
+
+public:
+  /// \param shards The number of shards, rounded up to a power of two.
+  explicit KArgConcurrentMap(size_t shards = 16) : m_shift(32) {
+    size_t count = 1;
+    while (count < shards && m_shift > 1) {
+      count <<= 1;
+      m_shift--;
+    }
+    m_count = count;
+    m_shards.reset(new Shard[count]);
+  }
+
+  /// The value of key or path, converted as KArgMap::get does.
+  template <typename T>
+  auto get(const KArgKey &key, T defaultValue) const
+      -> decltype(std::declval<const KArgMap &>().get(key, defaultValue)) {
+    Shard &s = shard(key);
+    std::lock_guard<std::mutex> lock(s.mutex);
+    return static_cast<const KArgMap &>(s.map).get(key, defaultValue);
+  }
+
+  /// Store value under key or path as KArgMap::set does.
+  template <typename T> void set(const KArgKey &key, T &&value) {
+    Shard &s = shard(key);
+    std::lock_guard<std::mutex> lock(s.mutex);
+    s.map.set(key, std::forward<T>(value));
+  }
+
+  /**
+   * \brief Call f(KArgVariant &) on the value of key or path, created as set()
+   * would create it, while holding the shard lock.  Use it for
+   * read-modify-write updates such as counters.  f is not called if the path
+   * cannot be created, e.g. an index into a value that is not a list.  f must
+   * not access this map.
+   */
+  template <typename F> void update(const KArgKey &key, F f) {
+    Shard &s = shard(key);
+    std::lock_guard<std::mutex> lock(s.mutex);
+    if (KArgVariant *item = s.map.setSlot(key)) {
+      f(*item);
+    }
+  }
+
+  bool containsKey(const KArgKey &key) const {
+    Shard &s = shard(key);
+    std::lock_guard<std::mutex> lock(s.mutex);
+    return s.map.containsKey(key);
+  }
+
+  size_t erase(const KArgKey &key) {
+    Shard &s = shard(key);
+    std::lock_guard<std::mutex> lock(s.mutex);
+    return s.map.erase(key);
+  }
+
+  /// The number of top level keys.  Other threads may change it at once.
+  size_t size() const {
+    size_t count = 0;
+    for (size_t i = 0; i < m_count; i++) {
+      std::lock_guard<std::mutex> lock(m_shards[i].mutex);
+      count += m_shards[i].map.size();
+    }
+    return count;
+  }
+
+  bool empty() const { return size() == 0; }
+
+  void clear() {
+    for (size_t i = 0; i < m_count; i++) {
+      std::lock_guard<std::mutex> lock(m_shards[i].mutex);
+      m_shards[i].map.clear();
+    }
+  }
+
+  /**
+   * \brief A plain KArgMap holding the entries of every shard at a single
+   * point in time, e.g. for serialization.  All shards are locked while the
+   * top level entries are copied; nested maps and lists are shared, not
+   * copied.  The result is a copy-on-write handle.
+   */
+  KArgMap snapshot() const {
+    std::unique_ptr<std::unique_lock<std::mutex>[]> locks(
+        new std::unique_lock<std::mutex>[m_count]);
+    size_t total = 0;
+    for (size_t i = 0; i < m_count; i++) {
+      locks[i] = std::unique_lock<std::mutex>(m_shards[i].mutex);
+      total += m_shards[i].map.size();
+    }
+    KArgMap result;
+    result.m_map->reserve(total);
+    for (size_t i = 0; i < m_count; i++) {
+      for (auto const &item : *m_shards[i].map.m_map) {
+        result.m_map->emplace(item.first, item.second);
+      }
+    }
+    return result.cowClone();
+  }
+
+  /// The number of shards.
+  size_t shards() const { return m_count; }
+
+private:
+  /// The shard holding key, chosen by the first path segment.
+  Shard &shard(const KArgKey &key) const {
+    auto view = key.view();
+    uint32_t hash = key.isPath()
+                        ? KArgMapInternal::k_hash(
+                              view.data(), KArgMapInternal::k_path_separator(view))
+                        : key.hash();
+    // use the high bits, the maps inside a shard index by the low ones
+    return m_shards[m_shift == 32 ? 0 : (hash * 0x9E3779B1u) >> m_shift];
+  }
+
+  std::unique_ptr<Shard[]> m_shards;
+  size_t m_count;
+  unsigned m_shift; ///< 32 minus log2 of the shard count
+};
+
+} // namespace entazza
@@ -11,11 +11,13 @@
 #include <cstring> // std::memcpy
 // ReSharper disable once CppUnusedIncludeDirective
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cctype>
 #include <complex>
 #include <cstdlib> // strtoll for gcc
 #include <functional>
+#include <list>
 #include <locale>
 #include <map>
 #include <memory>
@@ -24,6 +26,11 @@
 
 #include <cinttypes> // for PRIdX macros
 
+#if __cplusplus >= 201703L || (defined(_MSVC_LANG) && _MSVC_LANG >= 201703L)
+#include <string_view>
+#define K_STD_STRING_VIEW
+#endif
+
 #if defined(__GNUC__) && !defined(__EXCEPTIONS)
 // Particle Photon does not support exceptions
 #define K_EXCEPTIONS_UNSUPPORTED
@@ -50,6 +57,34 @@
 #else
 #define K_NOEXCEPT noexcept
 #endif
+// Marks a parameter the result refers to, so clang warns about keeping a
+// reference to a temporary.
+#if defined(__has_cpp_attribute)
+#if __has_cpp_attribute(clang::lifetimebound)
+#define K_LIFETIMEBOUND [[clang::lifetimebound]]
+#endif
+#endif
+#ifndef K_LIFETIMEBOUND
+#define K_LIFETIMEBOUND
+#endif
+
+// Define K_FLAT_HASH_MAP to store KArgMap entries in a contiguous open
+// addressing table (see KArgMapInternal::k_flat_hash_map) instead of
+// std::unordered_map.  References to values are invalidated when keys are
+// added or removed.
+#if !defined(K_FLAT_HASH_MAP_LINEAR_MAX)
+// Maps with at most this many keys are searched linearly without hashing.
+#define K_FLAT_HASH_MAP_LINEAR_MAX 8
+#endif
+
+// Strings too long to store inline are immutable and shared between copies
+// with an atomic reference count.  Define K_UNSHARED_STRINGS to give every
+// copy its own heap block instead.
+
+// Define K_SINGLE_THREADED when KArgMap, KArgList and KArgVariant instances
+// are never shared between threads.  Maps, lists and shared strings are then
+// reference counted without atomic operations and maps and lists are held by
+// an intrusive pointer (KArgMapInternal::k_ref_ptr) instead of std::shared_ptr.
 
 // http://stackoverflow.com/questions/3279543/what-is-the-copy-and-swap-idiom
 namespace entazza {
@@ -78,1636 +113,4495 @@ using KDuration = std::chrono::duration<int64_t, std::nano>;
 using KTimestamp =
     std::chrono::time_point<std::chrono::system_clock, KDuration>;
 
-using k_map_string_t = std::string;
-using k_map_float64_t = double;
-using k_arg_map_type = std::unordered_map<k_map_string_t, KArgVariant>;
-using k_arg_list_type = std::vector<KArgVariant>;
-using k_arg_map_ptr = std::shared_ptr<k_arg_map_type>;
-using k_arg_list_ptr = std::shared_ptr<k_arg_list_type>;
-
-namespace KArgMapInternal { // helpers
-void argVariantToString(std::string &s, const KArgVariant &val);
-void argListToString(std::string &s, const k_arg_list_type &val);
-void argMapToString(std::string &s, const k_arg_map_type &val);
-k_arg_list_ptr k_arg_list_clone(const k_arg_list_ptr from);
-k_arg_map_ptr k_arg_map_clone(const k_arg_map_ptr from);
-
-k_arg_map_ptr customArgToString(const KArgVariant &val);
-KArgVariant argMapToCustomType(const std::string typeName, k_arg_map_ptr map);
-
 /**
- * \brief A template to allow header only creation of singleton instances.  The
- * 'trick' is to declare a static variable within a function.  The linker will
- * resolve duplicate references to this static into a single instance. \tparam T
+ * \brief A monotonic buffer to build short lived KArgMap and KArgList trees in.
+ *
+ * Memory is handed out from blocks of doubling size and only returned to the
+ * heap when the arena is destroyed, so a tree of any size is freed with a few
+ * deallocations.  A KArgMap or KArgList constructed with an arena keeps its
+ * entries there, and maps and lists it creates itself (set() creating a
+ * path, deepClone(arena), CborSerializer::decode(arena)) are placed in the
+ * same arena.  Keys longer than std::string's inline buffer, strings longer
+ * than the KArgVariant inline limit and std::vector values still use the
+ * global heap.
+ *
+ * Every KArgMap and KArgList using the arena must be destroyed before it.  An
+ * arena is not thread safe.
  */
-template <class T> class Singleton {
+class KArgArena {
 public:
-  static T &Instance() {
-    static T instance;
-    return instance;
+  explicit KArgArena(size_t initialBlockSize = 1024)
+      : m_blocks(nullptr), m_next(nullptr), m_end(nullptr),
+        m_blockSize(initialBlockSize < 64 ? 64 : initialBlockSize),
+        m_capacity(0) {}
+  KArgArena(const KArgArena &) = delete;
+  KArgArena &operator=(const KArgArena &) = delete;
+
+  ~KArgArena() {
+    while (m_blocks) {
+      auto next = m_blocks->next;
+      ::operator delete(m_blocks);
+      m_blocks = next;
+    }
   }
 
-protected:
-  Singleton() = delete;
-  ~Singleton() = delete;
+  void *allocate(size_t size, size_t alignment) {
+    auto p = align(m_next, alignment);
+    if (!m_next || size > size_t(m_end - p)) {
+      addBlock(size + alignment);
+      p = align(m_next, alignment);
+    }
+    m_next = p + size;
+    return p;
+  }
+
+  /// Bytes obtained from the global heap so far.
+  size_t capacity() const { return m_capacity; }
 
 private:
-  Singleton(Singleton const &) = delete;
-  Singleton &operator=(Singleton const &) = delete;
+  struct Block {
+    Block *next;
+  };
+
+  static char *align(char *p, size_t alignment) {
+    auto offset = reinterpret_cast<uintptr_t>(p) & (alignment - 1);
+    return offset ? p + (alignment - offset) : p;
+  }
+
+  void addBlock(size_t minSize) {
+    while (m_blockSize < minSize + sizeof(Block)) {
+      m_blockSize *= 2;
+    }
+    auto block = static_cast<Block *>(::operator new(m_blockSize));
+    block->next = m_blocks;
+    m_blocks = block;
+    m_next = reinterpret_cast<char *>(block + 1);
+    m_end = reinterpret_cast<char *>(block) + m_blockSize;
+    m_capacity += m_blockSize;
+    m_blockSize *= 2;
+  }
+
+  Block *m_blocks;
+  char *m_next;
+  char *m_end;
+  size_t m_blockSize;
+  size_t m_capacity;
 };
 
-// Usage:
-// typedef Singleton<Foo> FooSingleton;  // creates static instance of Foo
-// FooSingleton::Instance();  // retrieves the static instance.  Note ::
-} // namespace KArgMapInternal
+namespace KArgMapInternal { // helpers
+/**
+ * \brief Allocator of the KArgMap and KArgList containers.  Allocates from a
+ * KArgArena if it has one and from the global heap otherwise, so arena and
+ * heap containers share one type.
+ */
+template <typename T> class k_allocator {
+public:
+  typedef T value_type;
+  typedef std::true_type propagate_on_container_move_assignment;
+  typedef std::true_type propagate_on_container_swap;
+
+  k_allocator(KArgArena *arena = nullptr) K_NOEXCEPT : m_arena(arena) {}
+  template <typename U>
+  k_allocator(const k_allocator<U> &other) K_NOEXCEPT
+      : m_arena(other.arena()) {}
+
+  T *allocate(size_t n) {
+    if (m_arena) {
+      return static_cast<T *>(m_arena->allocate(n * sizeof(T), alignof(T)));
+    }
+    return static_cast<T *>(::operator new(n * sizeof(T)));
+  }
 
-class KListBase { // do not reference iterators here as older compilers need to
-                  // know all about KArgVariant
-  friend class KArgVariant;
-  friend void KArgMapInternal::argVariantToString(std::string &s,
-                                                  const KArgVariant &val);
-  friend class KArgMapSerializer;
+  void deallocate(T *p, size_t) K_NOEXCEPT {
+    if (!m_arena) {
+      ::operator delete(p);
+    }
+  }
 
-protected:
-  k_arg_list_ptr m_list;
-  operator k_arg_list_ptr() const { return m_list; }
+  KArgArena *arena() const K_NOEXCEPT { return m_arena; }
+
+  template <typename U> bool operator==(const k_allocator<U> &other) const {
+    return m_arena == other.arena();
+  }
+  template <typename U> bool operator!=(const k_allocator<U> &other) const {
+    return m_arena != other.arena();
+  }
+
+private:
+  KArgArena *m_arena;
 };
 
-class KMapBase { // do not reference iterators here as older compilers need to
-                 // know all about KArgVariant
-  friend class KArgVariant;
-  friend void KArgMapInternal::argVariantToString(std::string &s,
-                                                  const KArgVariant &val);
-  friend class KArgMapSerializer;
-  friend class KArgUtility;
-  friend k_arg_map_ptr
-  KArgMapInternal::customArgToString(const KArgVariant &val);
+#ifdef K_SINGLE_THREADED
+/// Reference count of shared storage, non-atomic in K_SINGLE_THREADED builds.
+class k_ref_count {
+public:
+  void init() { m_count = 1; }
+  void add() { ++m_count; }
+  /// Drop a reference, true if it was the last one.
+  bool release() { return --m_count == 0; }
+  size_t get() const { return m_count; }
 
-protected:
-  k_arg_map_ptr m_map;
-  operator k_arg_map_ptr() const { return m_map; }
+private:
+  size_t m_count;
 };
 
 /**
- * \brief An enumeration of basic storage types in KArgVariant.
+ * \brief Intrusive, non-atomic reference counted pointer holding a KArgMap or
+ * KArgList container in K_SINGLE_THREADED builds.  The count is stored in
+ * front of the container in a single allocation, which comes from the
+ * container's arena if it has one.  Provides the subset of std::shared_ptr
+ * used by KArgMap.
  */
-enum class KArgTypes : uint8_t {
-  null,      ///< null value
-  boolean,   ///< boolean value
-  int8,      ///< 8 bit int
-  int16,     ///< 16 bit int
-  int32,     ///< 32 bit int
-  int64,     ///< 64 bit int
-  uint8,     ///< 8 bit unsigned int
-  uint16,    ///< 16 bit unsigned int
-  uint32,    ///< 32 bit unsigned int
-  uint64,    ///< 64 bit unsigned int
-  float32,   ///< 32 bit floating point
-  float64,   ///< 64 bit floating point
-  cfloat32,  ///< 32 bit floating point
-  cfloat64,  ///< 64 bit floating point
-  string,    ///< string value
-  map,       ///< map (unordered set of name/value pairs)
-  list,      ///< list (ordered collection of values)
-  timestamp, ///< timestamp representing date/time
-  duration,  ///< A time duration
-  custom,    ///< User defined
-};
-
-namespace KArgMapInternal { // helpers
-template <typename T> struct is_shared_vector : std::false_type {};
+template <typename C> class k_ref_ptr {
+  struct Node {
+    template <typename... Args>
+    explicit Node(Args &&... args) : value(std::forward<Args>(args)...) {
+      refs.init();
+    }
+    k_ref_count refs;
+    C value;
+  };
 
-template <typename T>
-struct is_shared_vector<std::shared_ptr<std::vector<T>>> : std::true_type {};
+public:
+  typedef C element_type;
 
-template <typename T, typename Dummy = void>
-struct is_k_scalar : std::false_type {};
+  k_ref_ptr() K_NOEXCEPT : m_node(nullptr) {}
+  k_ref_ptr(std::nullptr_t) K_NOEXCEPT : m_node(nullptr) {}
+  k_ref_ptr(const k_ref_ptr &other) K_NOEXCEPT : m_node(other.m_node) {
+    if (m_node) {
+      m_node->refs.add();
+    }
+  }
+  k_ref_ptr(k_ref_ptr &&other) K_NOEXCEPT : m_node(other.m_node) {
+    other.m_node = nullptr;
+  }
+  ~k_ref_ptr() { release(); }
 
-template <typename T>
-struct is_k_scalar<
-    T, typename std::enable_if<std::is_arithmetic<T>::value ||
-                               std::is_same<T, std::string>::value ||
-                               std::is_same<T, const char *>::value ||
-                               std::is_same<T, std::complex<float>>::value ||
-                               std::is_same<T, std::complex<double>>::value ||
-                               std::is_same<T, KDuration>::value ||
-                               std::is_same<T, KTimestamp>::value>::type>
-    : std::true_type {};
+  k_ref_ptr &operator=(k_ref_ptr other) K_NOEXCEPT {
+    std::swap(m_node, other.m_node);
+    return *this;
+  }
 
-/// True if the type is one of the basic types supported by KArgMap
-template <typename T, typename Dummy = void>
-struct is_k_base_type : std::false_type {};
+  /// A new container constructed from args, placed in arena if not null.
+  template <typename... Args>
+  static k_ref_ptr make(KArgArena *arena, Args &&... args) {
+    void *p = arena ? arena->allocate(sizeof(Node), alignof(Node))
+                    : ::operator new(sizeof(Node));
+    k_ref_ptr result;
+    result.m_node = new (p) Node(std::forward<Args>(args)...);
+    return result;
+  }
 
-template <> struct is_k_base_type<KArgVariant> : std::false_type {};
+  C *get() const K_NOEXCEPT { return m_node ? &m_node->value : nullptr; }
+  C &operator*() const K_NOEXCEPT { return m_node->value; }
+  C *operator->() const K_NOEXCEPT { return &m_node->value; }
+  explicit operator bool() const K_NOEXCEPT { return m_node != nullptr; }
+  long use_count() const K_NOEXCEPT {
+    return m_node ? long(m_node->refs.get()) : 0;
+  }
+  void reset() K_NOEXCEPT {
+    release();
+    m_node = nullptr;
+  }
 
-template <typename T>
-struct is_k_base_type<
-    T, typename std::enable_if<std::is_arithmetic<T>::value ||
-                               std::is_same<T, std::complex<float>>::value ||
-                               std::is_same<T, std::complex<double>>::value ||
-                               std::is_same<T, std::string>::value ||
-                               std::is_same<T, const char *>::value ||
-                               std::is_base_of<KMapBase, T>::value ||
-                               std::is_base_of<KListBase, T>::value ||
-                               std::is_base_of<KArgCustomTypeBase, T>::value ||
-                               std::is_same<T, k_arg_custom_ptr>::value ||
-                               std::is_same<T, k_arg_list_ptr>::value ||
-                               std::is_same<T, k_arg_map_ptr>::value ||
-                               std::is_same<T, KDuration>::value ||
-                               std::is_same<T, KTimestamp>::value>::type>
-    : std::true_type {};
+  bool operator==(const k_ref_ptr &other) const {
+    return m_node == other.m_node;
+  }
+  bool operator!=(const k_ref_ptr &other) const {
+    return m_node != other.m_node;
+  }
 
-/// True if the type is a shared_ptr<std::vector<T>> where T is one of the
-/// KArgMap base types
-template <typename T, typename Dummy = void>
-struct is_k_shared_vector_type : std::false_type {};
+private:
+  void release() {
+    if (m_node && m_node->refs.release()) {
+      auto arena = m_node->value.get_allocator().arena();
+      m_node->~Node();
+      if (!arena) {
+        ::operator delete(m_node);
+      }
+    }
+  }
 
-template <typename T>
-struct is_k_shared_vector_type<
-    std::shared_ptr<std::vector<T>>,
-    typename std::enable_if<is_k_base_type<T>::value>::type> : std::true_type {
+  Node *m_node;
 };
+#else
+/// Reference count of shared storage, non-atomic in K_SINGLE_THREADED builds.
+class k_ref_count {
+public:
+  void init() { m_count.store(1, std::memory_order_relaxed); }
+  void add() { m_count.fetch_add(1, std::memory_order_relaxed); }
+  /// Drop a reference, true if it was the last one.
+  bool release() {
+    return m_count.fetch_sub(1, std::memory_order_acq_rel) == 1;
+  }
+  size_t get() const { return m_count.load(std::memory_order_relaxed); }
 
-/// True if T is stored as a shard_ptr
-template <typename T, typename Dummy = void>
-struct is_k_shared_ptr_type : std::false_type {};
-
-template <typename T>
-struct is_k_shared_ptr_type<
-    std::shared_ptr<T>, typename std::enable_if<is_k_base_type<T>::value>::type>
-    : std::true_type { // TODO: further restrict to only list/map/custom base
-                       // type
+private:
+  std::atomic<size_t> m_count;
 };
+#endif
 
-/// True if T is one of the types that can be returned from a get or used with
-/// set
-template <typename T, typename Dummy = void>
-struct is_k_type : std::false_type {};
+#ifdef K_SINGLE_THREADED
+/// Deleter keeping a k_ref_ptr alive for as long as a std::shared_ptr to its
+/// container is.
+template <typename T> struct k_ref_ptr_holder {
+  k_ref_ptr<T> ptr;
+  void operator()(T *) const {}
+};
 
+/// The container held by ptr as a std::shared_ptr sharing its ownership.
 template <typename T>
-struct is_k_type<
-    T, typename std::enable_if<is_k_base_type<T>::value ||
-                               is_k_shared_ptr_type<T>::value ||
-                               is_k_shared_vector_type<T>::value>::type>
-    : std::true_type {};
-
-template <typename T, typename Dummy = void> struct k_type_info;
+std::shared_ptr<T> k_shared_container(const k_ref_ptr<T> &ptr) {
+  return std::shared_ptr<T>(ptr.get(), k_ref_ptr_holder<T>{ptr});
+}
+#endif
 
-template <typename T> struct k_base_scalar_storage {
-  typedef T type;
-  typedef T storage_type;
-  static const bool value = true;
-  static const bool is_vector = false;
-  static inline const std::string to_string(T val) {
-    char buf[30];
-    snprintf(buf, sizeof(buf) - 1, KArgMapInternal::k_type_info<T>::format,
-             val);
-    return std::string(buf);
-  };
-};
+/// The number of bits set in x.
+inline unsigned k_popcount(uint32_t x) {
+#if defined(__GNUC__) || defined(__clang__)
+  return unsigned(__builtin_popcount(x));
+#else
+  x = x - ((x >> 1) & 0x55555555u);
+  x = (x & 0x33333333u) + ((x >> 2) & 0x33333333u);
+  return unsigned((((x + (x >> 4)) & 0x0F0F0F0Fu) * 0x01010101u) >> 24);
+#endif
+}
 
-template <typename T> struct k_base_vector_storage {
-  typedef std::shared_ptr<std::vector<T>> type;
-  typedef std::shared_ptr<std::vector<T>> storage_type;
-  static const bool value = true;
-  static const bool is_vector = true;
-};
+/**
+ * \brief 32 bit FNV-1a hash of a key.  Used by k_flat_hash_map.
+ */
+inline uint32_t k_hash(const char *s, size_t len) {
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < len; ++i) {
+    h = (h ^ uint8_t(s[i])) * 16777619u;
+  }
+  return h;
+}
 
-template <typename T> inline const std::string to_string(const T val) {
-  return KArgMapInternal::k_type_info<T>::to_string(val);
+#if __cpp_constexpr >= 201304L
+/**
+ * \brief k_hash usable in constant expressions.
+ */
+constexpr uint32_t k_hash_constexpr(const char *s, size_t len) {
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < len; ++i) {
+    h = (h ^ uint8_t(s[i])) * 16777619u;
+  }
+  return h;
 }
 
-template <> struct k_type_info<bool> : k_base_scalar_storage<bool> {
-  static const KArgTypes type_code = KArgTypes::boolean;
-  constexpr static const char *format = nullptr;
-};
+/**
+ * \brief True if the key contains the '|' path separator.
+ */
+constexpr bool k_is_path(const char *s, size_t len) {
+  for (size_t i = 0; i < len; ++i) {
+    if (s[i] == '|') {
+      return true;
+    }
+  }
+  return false;
+}
+#else
+constexpr uint32_t k_hash_step(uint32_t h, char c) {
+  return (h ^ uint8_t(c)) * 16777619u;
+}
 
-template <> struct k_type_info<int8_t> : k_base_scalar_storage<int8_t> {
-  static const KArgTypes type_code = KArgTypes::int8;
-  constexpr static const char *format = "%" PRId8;
-};
+constexpr uint32_t k_hash_4(uint32_t h, const char *s) {
+  return k_hash_step(k_hash_step(k_hash_step(k_hash_step(h, s[0]), s[1]), s[2]),
+                     s[3]);
+}
 
-template <> struct k_type_info<int16_t> : k_base_scalar_storage<int16_t> {
-  static const KArgTypes type_code = KArgTypes::int16;
-  constexpr static const char *format = "%" PRId16;
-};
+/// k_hash as a C++11 constexpr function, which cannot loop.  Taking eight
+/// characters per call keeps literals of a few thousand characters within
+/// the usual constexpr depth limit of 512.
+constexpr uint32_t k_hash_recursive(const char *s, size_t len, uint32_t h) {
+  return len == 0  ? h
+         : len < 8 ? k_hash_recursive(s + 1, len - 1, k_hash_step(h, *s))
+                   : k_hash_recursive(s + 8, len - 8,
+                                      k_hash_4(k_hash_4(h, s), s + 4));
+}
 
-template <> struct k_type_info<int32_t> : k_base_scalar_storage<int32_t> {
-  static const KArgTypes type_code = KArgTypes::int32;
-  constexpr static const char *format = "%" PRId32;
-};
+#if defined(__has_builtin)
+#if __has_builtin(__builtin_is_constant_evaluated)
+#define K_IS_CONSTANT_EVALUATED() __builtin_is_constant_evaluated()
+#endif
+#endif
 
-template <> struct k_type_info<int64_t> : k_base_scalar_storage<int64_t> {
-  static const KArgTypes type_code = KArgTypes::int64;
-  constexpr static const char *format = "%" PRId64;
-};
-
-template <> struct k_type_info<uint8_t> : k_base_scalar_storage<uint8_t> {
-  static const KArgTypes type_code = KArgTypes::uint8;
-  constexpr static const char *format = "%" PRIu8;
-};
-
-template <> struct k_type_info<uint16_t> : k_base_scalar_storage<uint16_t> {
-  static const KArgTypes type_code = KArgTypes::uint16;
-  constexpr static const char *format = "%" PRIu16;
-};
+/**
+ * \brief k_hash usable in constant expressions.  Where the compiler tells
+ * them apart, other calls use the k_hash loop.
+ */
+constexpr uint32_t k_hash_constexpr(const char *s, size_t len) {
+#ifdef K_IS_CONSTANT_EVALUATED
+  return K_IS_CONSTANT_EVALUATED() ? k_hash_recursive(s, len, 2166136261u)
+                                   : k_hash(s, len);
+#else
+  return k_hash_recursive(s, len, 2166136261u);
+#endif
+}
 
-template <> struct k_type_info<uint32_t> : k_base_scalar_storage<uint32_t> {
-  static const KArgTypes type_code = KArgTypes::uint32;
-  constexpr static const char *format = "%" PRIu32;
-};
+/**
+ * \brief True if the key contains the '|' path separator.  Splits the key in
+ * halves so the recursion is only log2(len) deep.
+ */
+constexpr bool k_is_path(const char *s, size_t len) {
+  return len <= 1 ? len == 1 && *s == '|'
+                  : k_is_path(s, len / 2) ||
+                        k_is_path(s + len / 2, len - len / 2);
+}
+#endif
 
-template <> struct k_type_info<uint64_t> : k_base_scalar_storage<uint64_t> {
-  static const KArgTypes type_code = KArgTypes::uint64;
-  constexpr static const char *format = "%" PRIu64;
-};
+/**
+ * \brief An open addressing hash map with Robin Hood probing.
+ *
+ * Entries are stored densely in a std::vector so iteration is a linear walk of
+ * contiguous memory.  A separate power of two sized bucket array holds the
+ * 32 bit hash and entry index of each key, so probing compares hashes without
+ * touching the entries and growing the table never rehashes a key.  Erasing a
+ * key moves the last entry into the vacated slot.
+ *
+ * Small maps (up to K_FLAT_HASH_MAP_LINEAR_MAX keys) do not build the bucket
+ * array at all.  Keys are found by a linear scan over an inline array of
+ * fingerprints (length, first and last byte) and only fingerprint matches are
+ * compared byte by byte, which is cheaper than hashing a key for a handful of
+ * entries.  The bucket array is built the first time the map grows past the
+ * limit.
+ *
+ * Only the subset of the std::unordered_map interface used by KArgMap is
+ * provided, plus find_hashed() which accepts a key with a precomputed hash.
+ * Keys must not be modified through an iterator.
+ */
+template <typename K, typename V,
+          typename A = std::allocator<std::pair<K, V>>>
+class k_flat_hash_map {
+  struct Bucket;
+  template <typename T>
+  using rebind = typename std::allocator_traits<A>::template rebind_alloc<T>;
 
-template <> struct k_type_info<float> : k_base_scalar_storage<float> {
-  static const KArgTypes type_code = KArgTypes::float32;
-  constexpr static const char *format = "%.8g";
-};
+public:
+  typedef K key_type;
+  typedef V mapped_type;
+  typedef std::pair<K, V> value_type;
+  typedef size_t size_type;
+  typedef A allocator_type;
+  typedef std::vector<value_type, rebind<value_type>> entry_vector;
+  typedef typename entry_vector::iterator iterator;
+  typedef typename entry_vector::const_iterator const_iterator;
+
+  k_flat_hash_map() {}
+
+  explicit k_flat_hash_map(const A &alloc)
+      : m_entries(alloc), m_buckets(alloc) {}
+
+  k_flat_hash_map(std::initializer_list<std::pair<const K, V>> l) {
+    reserve(l.size());
+    insert(l.begin(), l.end());
+  }
 
-template <> struct k_type_info<double> : k_base_scalar_storage<double> {
-  static const KArgTypes type_code = KArgTypes::float64;
-  constexpr static const char *format = "%.15g";
-};
+  iterator begin() K_NOEXCEPT { return m_entries.begin(); }
+  const_iterator begin() const K_NOEXCEPT { return m_entries.begin(); }
+  iterator end() K_NOEXCEPT { return m_entries.end(); }
+  const_iterator end() const K_NOEXCEPT { return m_entries.end(); }
 
-template <>
-struct k_type_info<std::complex<float>>
-    : k_base_scalar_storage<std::complex<float>> {
-  static const KArgTypes type_code = KArgTypes::cfloat32;
-  constexpr static const char *format = "(%.8g,%.8g)";
-  static inline const std::string to_string(std::complex<float> val) {
-    char buf[64];
-    snprintf(buf, sizeof(buf) - 1, format, val.real(), val.imag());
-    return std::string(buf);
-  };
-};
+  size_t size() const K_NOEXCEPT { return m_entries.size(); }
+  bool empty() const K_NOEXCEPT { return m_entries.empty(); }
 
-template <>
-struct k_type_info<std::complex<double>>
-    : k_base_scalar_storage<std::complex<double>> {
-  static const KArgTypes type_code = KArgTypes::cfloat64;
-  constexpr static const char *format = "(%.15g,%.15g)";
-  static inline const std::string to_string(const std::complex<double> val) {
-    char buf[80];
-    snprintf(buf, sizeof(buf) - 1, format, val.real(), val.imag());
-    return std::string(buf);
-  };
-};
+  allocator_type get_allocator() const {
+    return allocator_type(m_entries.get_allocator());
+  }
 
-template <> struct k_type_info<KDuration> : k_base_scalar_storage<KDuration> {
-  static const KArgTypes type_code = KArgTypes::duration;
-  constexpr static const char *format = nullptr;
-  static inline const std::string to_string(const KDuration val) {
-    std::chrono::duration<double, std::nano> ts_ns = val;
-    double secs = ts_ns.count() / 1e9;
-    char buf[30];
-    snprintf(buf, sizeof(buf) - 1, k_type_info<double>::format, secs);
-    return std::string(buf);
+  void clear() {
+    m_entries.clear();
+    m_buckets.clear();
   }
-};
 
-template <> struct k_type_info<KTimestamp> : k_base_scalar_storage<KTimestamp> {
-  static const KArgTypes type_code = KArgTypes::timestamp;
-  constexpr static const char *format = nullptr;
-  static inline const std::string to_string(const KTimestamp val) {
-    return k_type_info<KDuration>::to_string(val.time_since_epoch());
+  void reserve(size_t count) {
+    m_entries.reserve(count);
+    if (count > kLinearMax && bucketsNeeded(count) > m_buckets.size()) {
+      rehash(bucketsNeeded(count));
+    }
   }
-};
 
-template <>
-struct k_type_info<std::string> : k_base_scalar_storage<std::string> {
-  static const KArgTypes type_code = KArgTypes::string;
-  constexpr static const char *format = "%s";
-  static inline const std::string to_string(const std::string s) { return s; }
-};
+  iterator find(const K &key) {
+    auto index = findIndex(key);
+    return index == kEmpty ? end() : begin() + index;
+  }
 
-template <>
-struct k_type_info<const char *> : k_base_scalar_storage<std::string> {
-  static const KArgTypes type_code = KArgTypes::string;
-  constexpr static const char *format = "%s";
-  static inline const std::string to_string(const std::string s) { return s; }
-};
+  const_iterator find(const K &key) const {
+    auto index = findIndex(key);
+    return index == kEmpty ? end() : begin() + index;
+  }
 
-template <>
-struct k_type_info<k_arg_map_ptr> : k_base_scalar_storage<k_arg_map_ptr> {
-  static const KArgTypes type_code = KArgTypes::map;
-  constexpr static const char *format = nullptr;
-};
+  /// Find a key given as any type providing data(), size() and hash(), where
+  /// hash() returns the k_hash of the key bytes.  The hash is only requested
+  /// once the map is too large to be searched linearly.
+  template <typename Q> iterator find_hashed(const Q &key) {
+    auto index = indexed() ? findIndex(key.data(), key.size(), key.hash())
+                           : findLinear(key.data(), key.size());
+    return index == kEmpty ? end() : begin() + index;
+  }
 
-template <>
-struct k_type_info<k_arg_list_ptr> : k_base_scalar_storage<k_arg_list_ptr> {
-  static const KArgTypes type_code = KArgTypes::list;
-  constexpr static const char *format = nullptr;
-};
+  template <typename Q> const_iterator find_hashed(const Q &key) const {
+    return const_cast<k_flat_hash_map *>(this)->find_hashed(key);
+  }
 
-template <typename T>
-struct k_type_info<
-    T, typename std::enable_if<std::is_base_of<KMapBase, T>::value>::type>
-    : k_base_scalar_storage<k_arg_map_ptr> {
-  static const KArgTypes type_code = KArgTypes::map;
-  constexpr static const char *format = nullptr;
-};
+  size_t count(const K &key) const { return findIndex(key) == kEmpty ? 0 : 1; }
 
-template <typename T>
-struct k_type_info<
-    T, typename std::enable_if<std::is_base_of<KListBase, T>::value>::type>
-    : k_base_scalar_storage<k_arg_list_ptr> {
-  static const KArgTypes type_code = KArgTypes::list;
-  constexpr static const char *format = nullptr;
-};
+  V &operator[](const K &key) {
+    auto index = findIndex(key);
+    if (index == kEmpty) {
+      index = append(key, V());
+    }
+    return m_entries[index].second;
+  }
 
-template <typename T>
-struct k_type_info<
-    T, typename std::enable_if<std::is_base_of<KArgCustomTypeBase, T>::value ||
-                               std::is_same<T, k_arg_custom_ptr>::value>::type>
-    : k_base_scalar_storage<std::shared_ptr<T>> {
-  static const KArgTypes type_code = KArgTypes::custom;
-  constexpr static const char *format = nullptr;
-};
+  template <typename Key, typename T>
+  std::pair<iterator, bool> emplace(Key &&key, T &&value) {
+    auto index = findIndex(key);
+    if (index != kEmpty) {
+      return std::make_pair(begin() + index, false);
+    }
+    index = append(std::forward<Key>(key), std::forward<T>(value));
+    return std::make_pair(begin() + index, true);
+  }
 
-template <typename T>
-struct k_type_info<std::shared_ptr<T>, typename std::enable_if<std::is_base_of<
-                                           KArgCustomTypeBase, T>::value>::type>
-    : k_base_scalar_storage<k_arg_custom_ptr> {
-  static const KArgTypes type_code = KArgTypes::custom;
-  constexpr static const char *format = nullptr;
-};
+  template <typename InputIt> void insert(InputIt first, InputIt last) {
+    for (; first != last; ++first) {
+      emplace(first->first, first->second);
+    }
+  }
 
-template <typename T>
-struct k_type_info<std::shared_ptr<std::vector<T>>,
-                   typename std::enable_if<is_k_base_type<T>::value>::type>
-    : k_base_vector_storage<T> {
-  static const KArgTypes type_code = k_type_info<T>::type_code;
-  constexpr static const char *format = k_type_info<T>::format;
-};
+  void insert(std::initializer_list<std::pair<const K, V>> l) {
+    insert(l.begin(), l.end());
+  }
 
-template <typename T>
-struct k_type_info<
-    T, typename std::enable_if<std::is_same<T, unsigned long>::value ||
-                               std::is_same<T, unsigned int>::value>::type> {
-  static_assert(
-      sizeof(T) == -1,
-      "Use of unsupported KArgMap type unsigned long or unsigned int");
-};
+  size_t erase(const K &key) {
+    auto index = findIndex(key);
+    if (index == kEmpty) {
+      return 0;
+    }
+    removeAt(index);
+    return 1;
+  }
 
-} // namespace KArgMapInternal
+  /// Erase the entry at it.  The returned iterator refers to the entry that
+  /// was moved into the vacated position (or end()).
+  iterator erase(const_iterator it) {
+    auto index = size_t(it - m_entries.cbegin());
+    removeAt(index);
+    return begin() + index;
+  }
 
-/**
- * \brief A class to contain a variant stored in a KArgMap or KArgList.  The
- * class contains meta data for the type such as it's fundamental type (e.g.
- * int32_t) and if it is a std::vector or std::complex type.
- */
-class KArgVariant {
-  friend class KArgMapSerializer;
+private:
+  struct Bucket {
+    uint32_t hash;
+    uint32_t index; ///< index into m_entries or kEmpty
+  };
 
-public:
-  /**
-   * \brief A union to hold scalar values or shared_ptr values for object types.
-   * Most of these fields are not directly referenced but can be handy when
-   * debugging.
-   */
-  union argvariant_value {
-    uint8_t ptr[16];
-    k_arg_map_ptr map;
-    k_arg_list_ptr list;
-    k_arg_custom_ptr custom;
-    k_map_string_t string;
-    KTimestamp timestamp;
-    KDuration duration;
-    bool boolean;
-    int8_t int8;
-    int16_t int16;
-    int32_t int32;
-    int64_t int64;
-    uint8_t uint8;
-    uint16_t uint16;
-    uint32_t uint32;
-    uint64_t uint64;
-    float float32;
-    std::complex<float> cfloat32;
-    std::complex<double> cfloat64;
-    k_map_float64_t float64;
+  static const uint32_t kEmpty = 0xffffffffu;
+  static const size_t kInitialCapacity = 8;
+  static const size_t kLinearMax = K_FLAT_HASH_MAP_LINEAR_MAX;
 
-    /// default constructor (for null values)
-    argvariant_value() {}
+  entry_vector m_entries;
+  std::vector<Bucket, rebind<Bucket>> m_buckets;
+  /// fingerprint of each key while the map is small enough to be unindexed
+  uint32_t m_fingerprints[kLinearMax ? kLinearMax : 1];
 
-    ~argvariant_value() {}
-  };
+  static uint32_t hash(const K &key) { return k_hash(key.data(), key.size()); }
 
-  /// the type of the current element
-  KArgTypes m_type = KArgTypes::null;
+  static uint32_t fingerprint(const char *s, size_t len) {
+    return len == 0 ? 0
+                    : (uint32_t(len) << 16) ^ (uint32_t(uint8_t(s[0])) << 8) ^
+                          uint8_t(s[len - 1]);
+  }
 
-  /// the value of the current element
-  argvariant_value m_value;
+  static size_t bucketsNeeded(size_t count) {
+    // keep the load factor at or below 3/4
+    size_t n = 8;
+    while (n * 3 < count * 4) {
+      n <<= 1;
+    }
+    return n;
+  }
 
-  /// True if the value is a std::vector
-  bool m_vector = false;
+  size_t mask() const { return m_buckets.size() - 1; }
 
-public:
-  ~KArgVariant() { reset(); }
+  size_t distance(size_t pos, uint32_t h) const {
+    return (pos - (h & mask())) & mask();
+  }
 
-  KArgVariant(const KArgVariant &ref) {
-    // Because m_value has non-trivial elements (std::shared_ptr) we cannot use
-    // a plain assignment
-    //              m_value = ref.m_value;
+  bool indexed() const { return !m_buckets.empty(); }
 
-    // First clean up any allocated objects we're replacing
-    reset();
-    if (ref.m_type != KArgTypes::null && ref.m_vector) {
-      // Vector types are stored as a shared_ptr created with inplace new.
-      // Cast it into a shared_ptr<std::vector> and new inplace into dest.
-      auto vec = *reinterpret_cast<std::shared_ptr<std::vector<int8_t>> *>(
-          &const_cast<KArgVariant &>(ref).m_value);
-      new (&m_value) std::shared_ptr<std::vector<int8_t>>{vec};
-    } else {
-      switch (ref.m_type) {
-      case KArgTypes::map: {
-        // http://stackoverflow.com/questions/24713833/using-a-union-with-unique-ptr
-        new (&m_value) k_arg_map_ptr{ref.m_value.map};
-        break;
-      }
+  static bool equals(const K &k, const char *data, size_t len) {
+    return k.size() == len && std::memcmp(k.data(), data, len) == 0;
+  }
 
-      case KArgTypes::list: {
-        new (&m_value) k_arg_list_ptr{ref.m_value.list};
-        break;
+  size_t findLinear(const char *data, size_t len) const {
+    const auto fp = fingerprint(data, len);
+    for (size_t i = 0; i < m_entries.size(); ++i) {
+      if (m_fingerprints[i] == fp && equals(m_entries[i].first, data, len)) {
+        return i;
       }
+    }
+    return kEmpty;
+  }
 
-#ifndef K_CUSTOM_TYPES_UNSUPPORTED
-      case KArgTypes::custom: {
-        new (&m_value) k_arg_custom_ptr{ref.m_value.custom};
-        break;
-      }
-#endif
-      case KArgTypes::string: {
-        new (&m_value) std::string(ref.m_value.string);
-        break;
+  size_t findBucket(const char *data, size_t len, uint32_t h) const {
+    size_t pos = h & mask();
+    for (size_t dist = 0;; ++dist) {
+      const Bucket &b = m_buckets[pos];
+      if (b.index == kEmpty || dist > distance(pos, b.hash)) {
+        return kEmpty;
       }
-
-      default:
-        std::memcpy(&m_value, &ref.m_value, sizeof(ref.m_value));
-        break;
+      if (b.hash == h && equals(m_entries[b.index].first, data, len)) {
+        return pos;
       }
+      pos = (pos + 1) & mask();
     }
-    m_type = ref.m_type;
-    m_vector = ref.m_vector;
   }
 
-  bool isVector() const { return m_vector; }
-  bool isMap() const { return m_type == KArgTypes::map; }
-  bool isList() const { return m_type == KArgTypes::list; }
-  bool isScalar() const { return !isVector() && !isMap() && !isList(); }
-  bool isCustom() const { return m_type == KArgTypes::custom; }
+  size_t findBucket(const K &key) const {
+    return findBucket(key.data(), key.size(), hash(key));
+  }
 
-private:
-  template <typename T> size_t getVecSize() const {
-    const auto &vec =
-        *reinterpret_cast<const std::shared_ptr<std::vector<T>> *>(
-            &m_value.ptr);
-    return vec->size();
+  size_t findIndex(const char *data, size_t len, uint32_t h) const {
+    auto pos = findBucket(data, len, h);
+    return pos == kEmpty ? kEmpty : m_buckets[pos].index;
   }
 
-public:
-  size_t size() const {
-    if (isVector()) {
-      switch (m_type) {
-      case KArgTypes::boolean:
-        return getVecSize<bool>();
-      case KArgTypes::int8:
-        return getVecSize<int8_t>();
-      case KArgTypes::int16:
-        return getVecSize<int16_t>();
-      case KArgTypes::int32:
-        return getVecSize<int32_t>();
-      case KArgTypes::int64:
-        return getVecSize<int64_t>();
-      case KArgTypes::uint8:
-        return getVecSize<uint8_t>();
-      case KArgTypes::uint16:
-        return getVecSize<uint16_t>();
-      case KArgTypes::uint32:
-        return getVecSize<uint32_t>();
-      case KArgTypes::uint64:
-        return getVecSize<uint64_t>();
-      case KArgTypes::float32:
-        return getVecSize<float>();
-      case KArgTypes::float64:
-        return getVecSize<double>();
-      case KArgTypes::cfloat32:
-        return getVecSize<std::complex<float>>();
-      case KArgTypes::cfloat64:
-        return getVecSize<std::complex<double>>();
-      case KArgTypes::timestamp:
-        return getVecSize<KTimestamp>();
-      case KArgTypes::duration:
-        return getVecSize<KDuration>();
-      case KArgTypes::string:
-        return getVecSize<std::string>();
-      default:
-        return 0;
-      }
-    } else if (isList()) {
-      return m_value.list->size();
+  size_t findIndex(const K &key) const {
+    if (!indexed()) {
+      return findLinear(key.data(), key.size());
     }
-    return 0;
+    return findIndex(key.data(), key.size(), hash(key));
   }
-  KArgTypes getType() const { return m_type; }
 
-  KArgVariant &operator=(KArgVariant other) K_NOEXCEPT {
-    // Strings are not blittable on all platforms.  Detect here.
-    if ((m_vector || m_type != KArgTypes::string) &&
-        (other.m_vector || other.m_type != KArgTypes::string)) {
-      // * blittable types
-      std::swap(m_type, other.m_type);
-      std::swap(m_vector, other.m_vector);
-      uint8_t temp[sizeof(m_value)];
-      std::memcpy(temp, &m_value, sizeof(m_value));
-      std::memcpy(&m_value, &other.m_value, sizeof(m_value));
-      std::memcpy(&other.m_value, temp, sizeof(m_value));
-      return *this;
+  template <typename Key, typename T> size_t append(Key &&key, T &&value) {
+    auto count = m_entries.size() + 1;
+    if (count > kLinearMax && bucketsNeeded(count) > m_buckets.size()) {
+      rehash(bucketsNeeded(count));
     }
-
-    // This is ugly.  consider just using a pool with custom string we know is
-    // blittable At this point we know one of the items is a plain string so
-    // special handling needed
-    if (m_type == KArgTypes::string && other.m_type == KArgTypes::string) {
-      // Both are strings, use swap
-      std::swap(m_value.string, other.m_value.string);
-      return *this;
-    } else if (!other.m_vector && other.m_type == KArgTypes::string) {
-      std::string s = std::move(other.m_value.string);
-      std::memcpy(&other.m_value, &m_value, sizeof(m_value));
-      new (&m_value) std::string(s);
-    } else if (!m_vector && m_type == KArgTypes::string) {
-      std::string s = std::move(m_value.string);
-      std::memcpy(&m_value, &other.m_value, sizeof(m_value));
-      new (&other.m_value) std::string(s);
+    if (m_entries.empty()) {
+      // skip the 1, 2, 4 growth steps, most maps hold a handful of keys
+      m_entries.reserve(kInitialCapacity);
     }
-    std::swap(m_type, other.m_type);
-    std::swap(m_vector, other.m_vector);
+    m_entries.emplace_back(std::forward<Key>(key), std::forward<T>(value));
+    auto index = m_entries.size() - 1;
+    const K &k = m_entries[index].first;
+    if (indexed()) {
+      place(Bucket{hash(k), uint32_t(index)});
+    } else {
+      m_fingerprints[index] = fingerprint(k.data(), k.size());
+    }
+    return index;
+  }
 
-    return *this;
+  void place(Bucket b) {
+    size_t pos = b.hash & mask();
+    for (size_t dist = 0;; ++dist) {
+      Bucket &cur = m_buckets[pos];
+      if (cur.index == kEmpty) {
+        cur = b;
+        return;
+      }
+      auto curDist = distance(pos, cur.hash);
+      if (curDist < dist) {
+        // Robin Hood: the resident is closer to home, displace it
+        std::swap(cur, b);
+        dist = curDist;
+      }
+      pos = (pos + 1) & mask();
+    }
   }
 
-  template <typename T>
-  typename std::enable_if<KArgMapInternal::k_type_info<T>::value,
-                          KArgVariant &>::type
-  operator=(T value) K_NOEXCEPT {
-    reset();
-    m_type = KArgMapInternal::k_type_info<T>::type_code;
-    m_vector = KArgMapInternal::k_type_info<T>::is_vector;
-    new (&m_value)
-        typename KArgMapInternal::k_type_info<T>::storage_type(value);
-    return *this;
+  void rehash(size_t count) {
+    std::vector<Bucket, rebind<Bucket>> old(count, Bucket{0, kEmpty},
+                                             m_buckets.get_allocator());
+    old.swap(m_buckets);
+    if (old.empty()) {
+      // leaving linear mode, hash every key once
+      for (size_t i = 0; i < m_entries.size(); ++i) {
+        place(Bucket{hash(m_entries[i].first), uint32_t(i)});
+      }
+      return;
+    }
+    for (auto &b : old) {
+      if (b.index != kEmpty) {
+        place(b);
+      }
+    }
   }
 
-  KArgVariant() : m_type(KArgTypes::null), m_vector(false) {}
+  void removeAt(size_t index) {
+    auto last = m_entries.size() - 1;
+    if (indexed()) {
+      auto pos = findBucket(m_entries[index].first);
+      // backward shift deletion keeps probe sequences intact without
+      // tombstones
+      size_t next = (pos + 1) & mask();
+      while (m_buckets[next].index != kEmpty &&
+             distance(next, m_buckets[next].hash) != 0) {
+        m_buckets[pos] = m_buckets[next];
+        pos = next;
+        next = (next + 1) & mask();
+      }
+      m_buckets[pos].index = kEmpty;
 
-  template <typename T,
-            typename std::enable_if<KArgMapInternal::is_k_type<T>::value>::type
-                * = nullptr>
-  KArgVariant(T value)
-      : m_type(KArgMapInternal::k_type_info<T>::type_code),
-        m_vector(KArgMapInternal::k_type_info<T>::is_vector) {
-    new (&m_value)
-        typename KArgMapInternal::k_type_info<T>::storage_type(value);
+      if (index != last) {
+        auto &moved = m_entries[last];
+        auto movedPos = findBucket(moved.first);
+        m_buckets[movedPos].index = uint32_t(index);
+      }
+    } else {
+      m_fingerprints[index] = m_fingerprints[last];
+    }
+    if (index != last) {
+      m_entries[index].first = std::move(m_entries[last].first);
+      m_entries[index].second = std::move(m_entries[last].second);
+    }
+    m_entries.pop_back();
+  }
+};
+/**
+ * \brief String storage for KArgVariant.
+ *
+ * Sixteen bytes holding either up to kInlineMax characters inline or a
+ * pointer to a heap block with the length and characters.  The last byte
+ * tells the forms apart: inline it is kInlineMax minus the length, which makes
+ * it the terminating 0 of a full inline string, and for the heap form it is
+ * kHeap.  Neither form points into itself, so the string can be relocated
+ * with memcpy.  The contents are converted to and from std::string at the
+ * KArgVariant get/set boundary.
+ *
+ * The characters are never modified after construction, so copies share the
+ * heap block and only bump its reference count (see K_UNSHARED_STRINGS).
+ * A long std::string is copied into a new block even when it is moved in,
+ * since its buffer cannot carry the count.
+ */
+class k_arg_string {
+public:
+  static const size_t kInlineMax = 15;
+
+  k_arg_string() { init(nullptr, 0); }
+  k_arg_string(const char *s, size_t len) { init(s, len); }
+  k_arg_string(const char *s) { init(s, std::strlen(s)); }
+  k_arg_string(const std::string &s) { init(s.data(), s.size()); }
+  k_arg_string(const k_arg_string &other) {
+#ifdef K_UNSHARED_STRINGS
+    if (other.isHeap()) {
+      init(other.data(), other.size());
+      return;
+    }
+#else
+    if (other.isHeap()) {
+      other.rep()->refs.add();
+    }
+#endif
+    std::memcpy(m_bytes, other.m_bytes, sizeof(m_bytes));
+  }
+  k_arg_string(k_arg_string &&other) K_NOEXCEPT {
+    std::memcpy(m_bytes, other.m_bytes, sizeof(m_bytes));
+    other.init(nullptr, 0);
+  }
+  ~k_arg_string() {
+    if (isHeap()) {
+      release(rep());
+    }
   }
 
-  template <typename T,
-            typename std::enable_if<KArgMapInternal::is_k_type<T>::value>::type
-                * = nullptr>
-  KArgVariant(std::vector<T> &&val)
-      : m_type(KArgMapInternal::k_type_info<T>::type_code), m_vector(true) {
-    auto v = new std::vector<T>(std::move(val));
-    new (&m_value) std::shared_ptr<std::vector<T>>{v};
+  k_arg_string &operator=(k_arg_string other) K_NOEXCEPT {
+    char temp[sizeof(m_bytes)];
+    std::memcpy(temp, m_bytes, sizeof(m_bytes));
+    std::memcpy(m_bytes, other.m_bytes, sizeof(m_bytes));
+    std::memcpy(other.m_bytes, temp, sizeof(m_bytes));
+    return *this;
   }
 
-  template <typename T,
-            typename std::enable_if<KArgMapInternal::is_k_type<T>::value>::type
-                * = nullptr>
-  KArgVariant(std::vector<T> &val)
-      : m_type(KArgMapInternal::k_type_info<T>::type_code), m_vector(true) {
-    static_assert(
-        sizeof(T) != sizeof(T),
-        "to set a std::vector, wrap with std::move or std::shared_ptr.");
+  const char *data() const { return isHeap() ? rep()->chars : m_bytes; }
+  const char *c_str() const { return data(); }
+  size_t size() const {
+    return isHeap() ? rep()->size : kInlineMax - size_t(tag());
   }
+  size_t length() const { return size(); }
+  bool empty() const { return size() == 0; }
+  char operator[](size_t i) const { return data()[i]; }
 
-#if 0
-            template <typename T>
-            KArgVariant(std::shared_ptr<KArgCustomType<T>>&& val)
-                : m_type(KArgTypes::custom), m_value(val), m_vector(false)
-            {
-            }
+  /// True if the characters are stored in a heap block.
+  bool isHeap() const { return tag() == kHeap; }
 
-            template <typename T>
-            KArgVariant(KArgCustomType<T> val)
-                : m_type(KArgTypes::custom), m_value(std::make_shared<KArgCustomType<T>>(val)), m_vector(false)
-            {
-            }
-#endif
-  //===========================================================
-  template <class T, typename std::enable_if<
-                         std::is_floating_point<T>::value>::type * = nullptr>
-  T get_from_string(T defaultValue) const {
-    auto &s = m_value.string;
-    char *end;
-    auto value = std::strtod(s.c_str(), &end);
-    if (end - s.c_str() != int(s.length())) {
-      return defaultValue;
-    }
-    return convert_number_with_default(value, defaultValue);
+  /// Number of strings sharing the heap block, 0 for inline strings.
+  size_t use_count() const {
+    return isHeap() ? rep()->refs.get() : 0;
   }
 
-  static inline bool kargmap_strieq(const char *s1, const char *s2) {
-    for (; tolower(*s1) == tolower(*s2); s1++, s2++) {
-      if (*s1 == '\0')
-        return true;
+  operator std::string() const { return std::string(data(), size()); }
+
+  bool operator==(const k_arg_string &other) const {
+    if (isHeap() && other.isHeap() && rep() == other.rep()) {
+      return true;
     }
-    return false;
+    return size() == other.size() &&
+           std::memcmp(data(), other.data(), size()) == 0;
+  }
+  bool operator!=(const k_arg_string &other) const {
+    return !(*this == other);
   }
 
-  template <class T, typename std::enable_if<std::is_integral<T>::value>::type
-                         * = nullptr>
-  T get_from_string(T defaultValue) const {
-    // use strtoll and strtoull instead of std::stoll and std::stoull
-    // because they do not throw exceptions
-    auto &s = m_value.string;
-    if (s.length() == 0)
-      return defaultValue;
-    if (s[0] == '-') {
-      char *end;
-      auto value = ::strtoll(s.c_str(), &end, 10);
-      if (end - s.c_str() != int(s.length())) {
-        // Try coverting from to double, then to T
-        auto dvalue = get_from_string<double>(double(defaultValue));
-        return convert_number_with_default(dvalue, defaultValue);
-      }
-      return convert_number_with_default(value, defaultValue);
-    } else {
-      char *end;
-      auto str = s.c_str();
-      if (*str != 0) {
-        // Do a quick check to see if the string is a boolean string such as
-        // 'true'.
-        auto ch = tolower(*str);
-        if (ch == 'f' || ch == 't' || ch == 'y' || ch == 'n') {
-          if (kargmap_strieq(str, "false") || kargmap_strieq(str, "no")) {
-            return convert_number_with_default(0, defaultValue);
-          } else if (kargmap_strieq(str, "true") ||
-                     kargmap_strieq(str, "yes")) {
-            return convert_number_with_default(1, defaultValue);
-          }
-        }
-      }
+private:
+  static const uint8_t kHeap = 0x80;
 
-      auto value = ::strtoull(s.c_str(), &end, 10);
-      if (end - s.c_str() != int(s.length())) {
-        // Try coverting from to double, then to T
-        auto dvalue = get_from_string<double>(double(defaultValue));
-        return convert_number_with_default(dvalue, defaultValue);
-      }
-      return convert_number_with_default(value, defaultValue);
+  struct Rep {
+    size_t size;
+    k_ref_count refs;
+    char chars[1]; ///< size characters plus a terminating 0
+  };
+
+  static void release(Rep *r) {
+    if (r->refs.release()) {
+      r->~Rep();
+      ::operator delete(r);
     }
   }
 
-  template <class T, typename std::enable_if<
-                         std::is_same<T, KTimestamp>::value ||
-                         std::is_same<T, KDuration>::value>::type * = nullptr>
-  T get_from_string(T defaultValue) const {
-    auto secs = get_from_string<double>(-std::numeric_limits<double>::max());
-    if (secs == -std::numeric_limits<double>::max()) {
-      return defaultValue;
-    }
-    return T(std::chrono::nanoseconds(int64_t(secs * 1e9)));
+  uint8_t tag() const { return uint8_t(m_bytes[kInlineMax]); }
+
+  Rep *rep() const {
+    Rep *r;
+    std::memcpy(&r, m_bytes, sizeof(r));
+    return r;
   }
 
-  template <typename T, typename std::enable_if<
-                            (std::is_arithmetic<T>::value)>::type * = nullptr>
-  T get(T defaultValue) {
-    switch (m_type) {
-    case KArgTypes::boolean:
-      return convert_number<bool>(defaultValue);
-    case KArgTypes::int8:
-      return convert_number<int8_t>(defaultValue);
-    case KArgTypes::int16:
-      return convert_number<int16_t>(defaultValue);
-    case KArgTypes::int32:
-      return convert_number<int32_t>(defaultValue);
-    case KArgTypes::int64:
-      return convert_number<int64_t>(defaultValue);
-    case KArgTypes::uint8:
-      return convert_number<uint8_t>(defaultValue);
-    case KArgTypes::uint16:
-      return convert_number<uint16_t>(defaultValue);
-    case KArgTypes::uint32:
-      return convert_number<uint32_t>(defaultValue);
-    case KArgTypes::uint64:
-      return convert_number<uint64_t>(defaultValue);
-    case KArgTypes::float32:
-      return convert_number<float>(defaultValue);
-    case KArgTypes::float64:
-      return convert_number<double>(defaultValue);
-    case KArgTypes::timestamp: {
-      // Convert to double seconds since epoch and then convert to requested
-      // type
-      std::chrono::duration<double, std::nano> ts_ns =
-          m_value.timestamp.time_since_epoch();
-      auto utcSeconds = ts_ns.count() / 1e9;
-      KArgVariant secs(utcSeconds);
-      return secs.get<T>(defaultValue);
-    }
-    case KArgTypes::duration: {
-      std::chrono::duration<double, std::nano> duration_ns = m_value.duration;
-      auto utcSeconds = double(duration_ns.count() / 1e9);
-      KArgVariant secs(utcSeconds);
-      return secs.get<T>(defaultValue);
-    }
-    case KArgTypes::string: {
-      return get_from_string(defaultValue);
-    }
-    default:
-      return defaultValue;
+  void init(const char *s, size_t len) {
+    if (len <= kInlineMax) {
+      if (len) {
+        std::memcpy(m_bytes, s, len);
+      }
+      m_bytes[len] = 0;
+      m_bytes[kInlineMax] = char(kInlineMax - len);
+      return;
     }
+    auto r = new (::operator new(sizeof(Rep) + len)) Rep;
+    r->size = len;
+    r->refs.init();
+    std::memcpy(r->chars, s, len);
+    r->chars[len] = 0;
+    std::memcpy(m_bytes, &r, sizeof(r));
+    m_bytes[kInlineMax] = char(kHeap);
   }
 
-  template <typename T,
-            typename std::enable_if<(
-                std::is_same<T, std::complex<float>>::value)>::type * = nullptr>
-  T get(T defaultValue) {
-    if (m_type == KArgTypes::cfloat32) {
+  char m_bytes[kInlineMax + 1];
+};
+} // namespace KArgMapInternal
+
+using k_map_string_t = std::string;
+using k_map_float64_t = double;
+
+#ifdef K_STD_STRING_VIEW
+using k_string_view = std::string_view;
+#else
+/**
+ * \brief Minimal stand in for std::string_view prior to C++17.  Refers to
+ * characters it does not own.
+ */
+class k_string_view {
+public:
+  constexpr k_string_view() : m_data(""), m_size(0) {}
+  constexpr k_string_view(const char *s, size_t len) : m_data(s), m_size(len) {}
+  k_string_view(const char *s) : m_data(s), m_size(std::strlen(s)) {}
+  k_string_view(const std::string &s) : m_data(s.data()), m_size(s.size()) {}
+
+  constexpr const char *data() const { return m_data; }
+  constexpr size_t size() const { return m_size; }
+  constexpr bool empty() const { return m_size == 0; }
+  constexpr const char *begin() const { return m_data; }
+  constexpr const char *end() const { return m_data + m_size; }
+  constexpr char operator[](size_t i) const { return m_data[i]; }
+
+  bool operator==(const k_string_view &other) const {
+    return m_size == other.m_size &&
+           std::memcmp(m_data, other.m_data, m_size) == 0;
+  }
+  bool operator!=(const k_string_view &other) const {
+    return !(*this == other);
+  }
+
+private:
+  const char *m_data;
+  size_t m_size;
+};
+#endif
+
+/**
+ * \brief Read only view of a contiguous array it does not own, the
+ * std::span<const T> subset used by the KArgMap span accessors.
+ */
+template <typename T> class k_span {
+public:
+  constexpr k_span() : m_data(nullptr), m_size(0) {}
+  constexpr k_span(const T *data, size_t size) : m_data(data), m_size(size) {}
+
+  constexpr const T *data() const { return m_data; }
+  constexpr size_t size() const { return m_size; }
+  constexpr bool empty() const { return m_size == 0; }
+  constexpr const T *begin() const { return m_data; }
+  constexpr const T *end() const { return m_data + m_size; }
+  constexpr const T &operator[](size_t i) const { return m_data[i]; }
+
+private:
+  const T *m_data;
+  size_t m_size;
+};
+
+namespace KArgMapInternal {
+/**
+ * \brief The storage of a KArgMap or KArgList, with a mark set by cowClone().
+ * While a marked container is shared every handle copies it before
+ * modifying it.  The mark lives in the shared storage rather than in the
+ * handles, which stay the size of a pointer.  Copying the entries does not
+ * copy the mark.
+ */
+template <typename Base> class k_cow_container : public Base {
+public:
+  using Base::Base;
+  k_cow_container() {}
+  k_cow_container(const k_cow_container &other) : Base(other) {}
+  k_cow_container(k_cow_container &&other) : Base(std::move(other)) {}
+  k_cow_container &operator=(const k_cow_container &other) {
+    Base::operator=(other);
+    return *this;
+  }
+  k_cow_container &operator=(k_cow_container &&other) {
+    Base::operator=(std::move(other));
+    return *this;
+  }
+
+  bool isCopyOnWrite() const {
+#ifdef K_SINGLE_THREADED
+    return m_cow;
+#else
+    return m_cow.load(std::memory_order_relaxed);
+#endif
+  }
+
+  /// Mark the storage, also through a const handle.
+  void setCopyOnWrite() const {
+#ifdef K_SINGLE_THREADED
+    m_cow = true;
+#else
+    m_cow.store(true, std::memory_order_relaxed);
+#endif
+  }
+
+private:
+#ifdef K_SINGLE_THREADED
+  mutable bool m_cow = false;
+#else
+  mutable std::atomic<bool> m_cow{false};
+#endif
+};
+} // namespace KArgMapInternal
+
+#ifdef K_FLAT_HASH_MAP
+using k_arg_map_type =
+    KArgMapInternal::k_cow_container<KArgMapInternal::k_flat_hash_map<
+        k_map_string_t, KArgVariant,
+        KArgMapInternal::k_allocator<std::pair<k_map_string_t, KArgVariant>>>>;
+// KArgMap lookups never build a key string
+#define K_ALLOCATION_FREE_LOOKUP
+#elif defined(__cpp_lib_generic_unordered_lookup) &&                          \
+    __cpp_lib_generic_unordered_lookup >= 201811L
+namespace KArgMapInternal {
+/// Hash allowing std::unordered_map::find with a k_string_view.
+struct k_map_string_hash {
+  using is_transparent = void;
+  size_t operator()(k_string_view s) const {
+    return std::hash<k_string_view>()(s);
+  }
+};
+} // namespace KArgMapInternal
+using k_arg_map_type = KArgMapInternal::k_cow_container<std::unordered_map<
+    k_map_string_t, KArgVariant, KArgMapInternal::k_map_string_hash,
+    std::equal_to<>,
+    KArgMapInternal::k_allocator<std::pair<const k_map_string_t, KArgVariant>>>>;
+#define K_ALLOCATION_FREE_LOOKUP
+#else
+using k_arg_map_type = KArgMapInternal::k_cow_container<std::unordered_map<
+    k_map_string_t, KArgVariant, std::hash<k_map_string_t>,
+    std::equal_to<k_map_string_t>,
+    KArgMapInternal::k_allocator<std::pair<const k_map_string_t, KArgVariant>>>>;
+#ifndef K_THREAD_LOCAL_UNSUPPORTED
+namespace KArgMapInternal {
+/// The string keys are copied into for lookup, one per thread.  It allocates
+/// only when a key is longer than every key looked up before in the thread.
+/// Targets without thread_local storage define K_THREAD_LOCAL_UNSUPPORTED to
+/// build a temporary key string per lookup instead.
+inline k_map_string_t &k_key_buffer() {
+  static thread_local k_map_string_t buffer;
+  return buffer;
+}
+} // namespace KArgMapInternal
+#endif
+#endif
+using k_arg_list_type = KArgMapInternal::k_cow_container<
+    std::vector<KArgVariant, KArgMapInternal::k_allocator<KArgVariant>>>;
+#ifdef K_SINGLE_THREADED
+using k_arg_map_ptr = KArgMapInternal::k_ref_ptr<k_arg_map_type>;
+using k_arg_list_ptr = KArgMapInternal::k_ref_ptr<k_arg_list_type>;
+#else
+using k_arg_map_ptr = std::shared_ptr<k_arg_map_type>;
+using k_arg_list_ptr = std::shared_ptr<k_arg_list_type>;
+#endif
+
+namespace KArgMapInternal {
+/// std::make_shared for k_arg_map_ptr and k_arg_list_ptr.
+template <typename P, typename... Args> P k_make_ptr(Args &&... args) {
+#ifdef K_SINGLE_THREADED
+  return P::make(nullptr, std::forward<Args>(args)...);
+#else
+  return std::make_shared<typename P::element_type>(
+      std::forward<Args>(args)...);
+#endif
+}
+} // namespace KArgMapInternal
+
+namespace KArgMapInternal {
+/// Offset of the first '|' in path, or path.size() if there is none.
+inline size_t k_path_separator(k_string_view path) {
+  auto sep =
+      static_cast<const char *>(std::memchr(path.data(), '|', path.size()));
+  return sep ? size_t(sep - path.data()) : path.size();
+}
+
+/// True if a path segment addresses a KArgList element.
+inline bool k_path_is_index(k_string_view segment) {
+  return !segment.empty() && segment[0] >= '0' && segment[0] <= '9';
+}
+
+/// The list index at the start of a path segment, 0 if it is not numeric.
+inline size_t k_path_index(k_string_view segment) {
+  size_t index = 0;
+  for (size_t i = 0;
+       i < segment.size() && segment[i] >= '0' && segment[i] <= '9'; i++) {
+    index = index * 10 + size_t(segment[i] - '0');
+  }
+  return index;
+}
+} // namespace KArgMapInternal
+
+class KArgPath;
+
+/**
+ * \brief A key used to access a KArgMap, carrying its hash and whether it is a
+ * '|' separated path.
+ *
+ * KArgKey does not own its characters.  Keys made from string literals,
+ * including the _k literal, refer to static storage and may be kept in
+ * variables.  Keys made from a std::string are only valid while the string is,
+ * which is always the case when the string is passed straight to a KArgMap
+ * accessor.  The _k literal computes the hash and path flag at compile time so
+ * a K_FLAT_HASH_MAP lookup neither allocates nor rehashes the key.  For other
+ * keys both are worked out only when needed.
+ *
+ * Lookups build no temporary string when K_ALLOCATION_FREE_LOOKUP is defined,
+ * which is the case with K_FLAT_HASH_MAP or a C++20 standard library.
+ * Otherwise keys not made from a k_map_string_t are copied into a buffer kept
+ * per thread, which allocates only when it has to grow for a longer key.  The
+ * buffer is a thread_local; where that is not supported define
+ * K_THREAD_LOCAL_UNSUPPORTED and each such lookup builds a temporary string.
+ *
+ * A KArgKey made from a KArgPath refers to it and must not outlive it.
+ */
+class KArgKey {
+public:
+  /// A key of len characters at s.  Evaluated at compile time for literals.
+  constexpr KArgKey(const char *s, size_t len)
+      : m_data(s), m_size(len), m_string(nullptr), m_compiled(nullptr),
+        m_hash(KArgMapInternal::k_hash_constexpr(s, len)),
+        m_flags(kHashed | kPathKnown |
+                (KArgMapInternal::k_is_path(s, len) ? kPath : 0)) {}
+
+  KArgKey(const char *s)
+      : m_data(s), m_size(std::strlen(s)), m_string(nullptr),
+        m_compiled(nullptr), m_hash(0), m_flags(0) {}
+
+  /// A key referring to s, which must outlive it.  Passing a temporary
+  /// string straight to an accessor, as in map.get(prefix + "x", 0), is safe;
+  /// keeping the key, as in KArgKey key = prefix + "x";, is not.
+  KArgKey(const k_map_string_t &s K_LIFETIMEBOUND)
+      : m_data(s.data()), m_size(s.size()), m_string(&s), m_compiled(nullptr),
+        m_hash(0), m_flags(0) {}
+
+  /// A single key whose k_hash is already known.
+  KArgKey(const k_map_string_t &s K_LIFETIMEBOUND, uint32_t hash)
+      : m_data(s.data()), m_size(s.size()), m_string(&s), m_compiled(nullptr),
+        m_hash(hash), m_flags(kHashed | kPathKnown) {}
+
+  KArgKey(k_string_view s)
+      : m_data(s.data()), m_size(s.size()), m_string(nullptr),
+        m_compiled(nullptr), m_hash(0), m_flags(0) {}
+
+  KArgKey(const KArgPath &path);
+
+  constexpr const char *data() const { return m_data; }
+  constexpr size_t size() const { return m_size; }
+
+  /// The k_hash of the key.
+  uint32_t hash() const {
+    return (m_flags & kHashed) ? m_hash
+                               : KArgMapInternal::k_hash(m_data, m_size);
+  }
+
+  /// The parsed path this key was made from, or nullptr.
+  const KArgPath *compiled() const { return m_compiled; }
+
+  /// True if the key contains the '|' path separator.
+  bool isPath() const {
+    return (m_flags & kPathKnown)
+               ? (m_flags & kPath) != 0
+               : std::memchr(m_data, '|', m_size) != nullptr;
+  }
+
+  k_string_view view() const { return k_string_view(m_data, m_size); }
+
+  /// The string the key was made from, or nullptr if it was not a
+  /// k_map_string_t.
+  const k_map_string_t *string() const { return m_string; }
+
+  k_map_string_t str() const {
+    return m_string ? *m_string : k_map_string_t(m_data, m_size);
+  }
+
+private:
+  enum : uint8_t { kHashed = 1, kPathKnown = 2, kPath = 4 };
+
+  const char *m_data;
+  size_t m_size;
+  const k_map_string_t *m_string;
+  const KArgPath *m_compiled;
+  uint32_t m_hash;
+  uint8_t m_flags;
+};
+
+/**
+ * \brief A '|' separated path parsed once for repeated KArgMap access.
+ *
+ * Each segment is kept with its hash and, when it starts with a digit, its
+ * list index, so get/set/containsKey walk the path without parsing, hashing
+ * or allocating.  A KArgPath is always walked segment by segment; unlike a
+ * string key its text is never looked up as a single key first.
+ *
+ * With K_FLAT_HASH_MAP a path constructed with cache set remembers the slot
+ * each key was last found in and checks it before probing, which skips the
+ * lookup as long as the maps along the path keep their shape.  Reads update
+ * the cache, so a caching KArgPath must not be shared between threads.
+ */
+class KArgPath {
+public:
+  KArgPath(k_string_view path, bool cache = false)
+      : m_path(path.data(), path.size()), m_cache(cache) {
+    k_string_view rest(m_path.data(), m_path.size());
+    for (;;) {
+      auto pos = KArgMapInternal::k_path_separator(rest);
+      k_string_view segment(rest.data(), pos);
+      Segment s;
+      s.key.assign(segment.data(), segment.size());
+      s.hash = KArgMapInternal::k_hash(segment.data(), segment.size());
+      s.isIndex = KArgMapInternal::k_path_is_index(segment);
+      s.index = KArgMapInternal::k_path_index(segment);
+      s.cacheMap = nullptr;
+      s.cacheSlot = 0;
+      m_segments.push_back(std::move(s));
+      if (pos == rest.size()) {
+        break;
+      }
+      rest = k_string_view(rest.data() + pos + 1, rest.size() - pos - 1);
+    }
+  }
+
+  KArgPath(const char *path, bool cache = false)
+      : KArgPath(k_string_view(path), cache) {}
+
+  KArgPath(const k_map_string_t &path, bool cache = false)
+      : KArgPath(k_string_view(path), cache) {}
+
+  const k_map_string_t &str() const { return m_path; }
+
+  /// The number of segments.
+  size_t size() const { return m_segments.size(); }
+
+private:
+  friend class KArgKey;
+  friend class KArgMap;
+
+  struct Segment {
+    k_map_string_t key;
+    uint32_t hash;
+    bool isIndex;
+    size_t index;
+    mutable const void *cacheMap; ///< map the key was last found in
+    mutable size_t cacheSlot;     ///< and its position there
+  };
+
+  k_map_string_t m_path;
+  std::vector<Segment> m_segments;
+  bool m_cache;
+};
+
+inline KArgKey::KArgKey(const KArgPath &path)
+    : m_data(path.m_path.data()), m_size(path.m_path.size()),
+      m_string(&path.m_path), m_compiled(&path), m_hash(0),
+      m_flags(kPathKnown | kPath) {}
+
+/**
+ * \brief Make a KArgKey with its hash computed at compile time, e.g.
+ * map.get("speed"_k, 0.0).
+ */
+constexpr KArgKey operator"" _k(const char *s, size_t len) {
+  return KArgKey(s, len);
+}
+
+namespace KArgMapInternal { // helpers
+void argVariantToString(std::string &s, const KArgVariant &val);
+void argListToString(std::string &s, const k_arg_list_type &val);
+void argMapToString(std::string &s, const k_arg_map_type &val);
+bool argVariantEquals(const KArgVariant &a, const KArgVariant &b);
+bool argListEquals(const k_arg_list_type &a, const k_arg_list_type &b);
+bool argMapEquals(const k_arg_map_type &a, const k_arg_map_type &b);
+size_t argVariantHash(const KArgVariant &val);
+size_t argListHash(const k_arg_list_type &list);
+size_t argMapHash(const k_arg_map_type &map);
+k_arg_list_ptr k_new_list(KArgArena *arena);
+k_arg_map_ptr k_new_map(KArgArena *arena);
+k_arg_list_ptr k_copy_list(const k_arg_list_type &from);
+k_arg_map_ptr k_copy_map(const k_arg_map_type &from);
+k_arg_list_ptr k_arg_list_clone(const k_arg_list_ptr from,
+                                KArgArena *arena = nullptr);
+k_arg_map_ptr k_arg_map_clone(const k_arg_map_ptr from,
+                              KArgArena *arena = nullptr);
+
+k_arg_map_ptr customArgToString(const KArgVariant &val);
+KArgVariant argMapToCustomType(const std::string typeName, k_arg_map_ptr map);
+
+/**
+ * \brief A template to allow header only creation of singleton instances.  The
+ * 'trick' is to declare a static variable within a function.  The linker will
+ * resolve duplicate references to this static into a single instance. \tparam T
+ */
+template <class T> class Singleton {
+public:
+  static T &Instance() {
+    static T instance;
+    return instance;
+  }
+
+protected:
+  Singleton() = delete;
+  ~Singleton() = delete;
+
+private:
+  Singleton(Singleton const &) = delete;
+  Singleton &operator=(Singleton const &) = delete;
+};
+
+// Usage:
+// typedef Singleton<Foo> FooSingleton;  // creates static instance of Foo
+// FooSingleton::Instance();  // retrieves the static instance.  Note ::
+} // namespace KArgMapInternal
+
+class KListBase { // do not reference iterators here as older compilers need to
+                  // know all about KArgVariant
+  friend class KArgVariant;
+  friend void KArgMapInternal::argVariantToString(std::string &s,
+                                                  const KArgVariant &val);
+  friend bool KArgMapInternal::argVariantEquals(const KArgVariant &a,
+                                                const KArgVariant &b);
+  friend size_t KArgMapInternal::argVariantHash(const KArgVariant &val);
+  friend class KArgMapSerializer;
+  friend class KArgList;
+
+protected:
+  k_arg_list_ptr m_list;
+  operator k_arg_list_ptr() const & { return m_list; }
+  operator k_arg_list_ptr() && { return std::move(m_list); }
+};
+
+class KMapBase { // do not reference iterators here as older compilers need to
+                 // know all about KArgVariant
+  friend class KArgVariant;
+  friend void KArgMapInternal::argVariantToString(std::string &s,
+                                                  const KArgVariant &val);
+  friend bool KArgMapInternal::argVariantEquals(const KArgVariant &a,
+                                                const KArgVariant &b);
+  friend size_t KArgMapInternal::argVariantHash(const KArgVariant &val);
+  friend class KArgMapSerializer;
+  friend class KArgUtility;
+  friend k_arg_map_ptr
+  KArgMapInternal::customArgToString(const KArgVariant &val);
+  friend class KArgList;
+
+protected:
+  k_arg_map_ptr m_map;
+  operator k_arg_map_ptr() const & { return m_map; }
+  operator k_arg_map_ptr() && { return std::move(m_map); }
+};
+
+/**
+ * \brief An enumeration of basic storage types in KArgVariant.
+ */
+enum class KArgTypes : uint8_t {
+  null,      ///< null value
+  boolean,   ///< boolean value
+  int8,      ///< 8 bit int
+  int16,     ///< 16 bit int
+  int32,     ///< 32 bit int
+  int64,     ///< 64 bit int
+  uint8,     ///< 8 bit unsigned int
+  uint16,    ///< 16 bit unsigned int
+  uint32,    ///< 32 bit unsigned int
+  uint64,    ///< 64 bit unsigned int
+  float32,   ///< 32 bit floating point
+  float64,   ///< 64 bit floating point
+  cfloat32,  ///< 32 bit floating point
+  cfloat64,  ///< 64 bit floating point
+  string,    ///< string value
+  map,       ///< map (unordered set of name/value pairs)
+  list,      ///< list (ordered collection of values)
+  timestamp, ///< timestamp representing date/time
+  duration,  ///< A time duration
+  custom,    ///< User defined
+};
+
+namespace KArgMapInternal { // helpers
+template <typename T> struct is_shared_vector : std::false_type {};
+
+template <typename T>
+struct is_shared_vector<std::shared_ptr<std::vector<T>>> : std::true_type {};
+
+template <typename T, typename Dummy = void>
+struct is_k_scalar : std::false_type {};
+
+template <typename T>
+struct is_k_scalar<
+    T, typename std::enable_if<std::is_arithmetic<T>::value ||
+                               std::is_same<T, std::string>::value ||
+                               std::is_same<T, const char *>::value ||
+                               std::is_same<T, std::complex<float>>::value ||
+                               std::is_same<T, std::complex<double>>::value ||
+                               std::is_same<T, KDuration>::value ||
+                               std::is_same<T, KTimestamp>::value>::type>
+    : std::true_type {};
+
+/// True if the type is one of the basic types supported by KArgMap
+template <typename T, typename Dummy = void>
+struct is_k_base_type : std::false_type {};
+
+template <> struct is_k_base_type<KArgVariant> : std::false_type {};
+
+template <typename T>
+struct is_k_base_type<
+    T, typename std::enable_if<std::is_arithmetic<T>::value ||
+                               std::is_same<T, std::complex<float>>::value ||
+                               std::is_same<T, std::complex<double>>::value ||
+                               std::is_same<T, std::string>::value ||
+                               std::is_same<T, const char *>::value ||
+                               std::is_base_of<KMapBase, T>::value ||
+                               std::is_base_of<KListBase, T>::value ||
+                               std::is_base_of<KArgCustomTypeBase, T>::value ||
+                               std::is_same<T, k_arg_custom_ptr>::value ||
+                               std::is_same<T, k_arg_list_ptr>::value ||
+                               std::is_same<T, k_arg_map_ptr>::value ||
+                               std::is_same<T, KDuration>::value ||
+                               std::is_same<T, KTimestamp>::value>::type>
+    : std::true_type {};
+
+/// True if the type is a shared_ptr<std::vector<T>> where T is one of the
+/// KArgMap base types
+template <typename T, typename Dummy = void>
+struct is_k_shared_vector_type : std::false_type {};
+
+template <typename T>
+struct is_k_shared_vector_type<
+    std::shared_ptr<std::vector<T>>,
+    typename std::enable_if<is_k_base_type<T>::value>::type> : std::true_type {
+};
+
+/// True if T is stored as a shard_ptr
+template <typename T, typename Dummy = void>
+struct is_k_shared_ptr_type : std::false_type {};
+
+template <typename T>
+struct is_k_shared_ptr_type<
+    std::shared_ptr<T>, typename std::enable_if<is_k_base_type<T>::value>::type>
+    : std::true_type { // TODO: further restrict to only list/map/custom base
+                       // type
+};
+
+/// True if T is one of the types that can be returned from a get or used with
+/// set
+template <typename T, typename Dummy = void>
+struct is_k_type : std::false_type {};
+
+template <typename T>
+struct is_k_type<
+    T, typename std::enable_if<is_k_base_type<T>::value ||
+                               is_k_shared_ptr_type<T>::value ||
+                               is_k_shared_vector_type<T>::value>::type>
+    : std::true_type {};
+
+template <typename T, typename Dummy = void> struct k_type_info;
+
+template <typename T> struct k_base_scalar_storage {
+  typedef T type;
+  typedef T storage_type;
+  static const bool value = true;
+  static const bool is_vector = false;
+  static inline const std::string to_string(T val) {
+    char buf[30];
+    snprintf(buf, sizeof(buf) - 1, KArgMapInternal::k_type_info<T>::format,
+             val);
+    return std::string(buf);
+  };
+};
+
+template <typename T> struct k_base_vector_storage {
+  typedef std::shared_ptr<std::vector<T>> type;
+  typedef std::shared_ptr<std::vector<T>> storage_type;
+  static const bool value = true;
+  static const bool is_vector = true;
+};
+
+template <typename T> inline const std::string to_string(const T val) {
+  return KArgMapInternal::k_type_info<T>::to_string(val);
+}
+
+template <> struct k_type_info<bool> : k_base_scalar_storage<bool> {
+  static const KArgTypes type_code = KArgTypes::boolean;
+  constexpr static const char *format = nullptr;
+};
+
+template <> struct k_type_info<int8_t> : k_base_scalar_storage<int8_t> {
+  static const KArgTypes type_code = KArgTypes::int8;
+  constexpr static const char *format = "%" PRId8;
+};
+
+template <> struct k_type_info<int16_t> : k_base_scalar_storage<int16_t> {
+  static const KArgTypes type_code = KArgTypes::int16;
+  constexpr static const char *format = "%" PRId16;
+};
+
+template <> struct k_type_info<int32_t> : k_base_scalar_storage<int32_t> {
+  static const KArgTypes type_code = KArgTypes::int32;
+  constexpr static const char *format = "%" PRId32;
+};
+
+template <> struct k_type_info<int64_t> : k_base_scalar_storage<int64_t> {
+  static const KArgTypes type_code = KArgTypes::int64;
+  constexpr static const char *format = "%" PRId64;
+};
+
+template <> struct k_type_info<uint8_t> : k_base_scalar_storage<uint8_t> {
+  static const KArgTypes type_code = KArgTypes::uint8;
+  constexpr static const char *format = "%" PRIu8;
+};
+
+template <> struct k_type_info<uint16_t> : k_base_scalar_storage<uint16_t> {
+  static const KArgTypes type_code = KArgTypes::uint16;
+  constexpr static const char *format = "%" PRIu16;
+};
+
+template <> struct k_type_info<uint32_t> : k_base_scalar_storage<uint32_t> {
+  static const KArgTypes type_code = KArgTypes::uint32;
+  constexpr static const char *format = "%" PRIu32;
+};
+
+template <> struct k_type_info<uint64_t> : k_base_scalar_storage<uint64_t> {
+  static const KArgTypes type_code = KArgTypes::uint64;
+  constexpr static const char *format = "%" PRIu64;
+};
+
+template <> struct k_type_info<float> : k_base_scalar_storage<float> {
+  static const KArgTypes type_code = KArgTypes::float32;
+  constexpr static const char *format = "%.8g";
+};
+
+template <> struct k_type_info<double> : k_base_scalar_storage<double> {
+  static const KArgTypes type_code = KArgTypes::float64;
+  constexpr static const char *format = "%.15g";
+};
+
+template <>
+struct k_type_info<std::complex<float>>
+    : k_base_scalar_storage<std::complex<float>> {
+  static const KArgTypes type_code = KArgTypes::cfloat32;
+  constexpr static const char *format = "(%.8g,%.8g)";
+  static inline const std::string to_string(std::complex<float> val) {
+    char buf[64];
+    snprintf(buf, sizeof(buf) - 1, format, val.real(), val.imag());
+    return std::string(buf);
+  };
+};
+
+template <>
+struct k_type_info<std::complex<double>>
+    : k_base_scalar_storage<std::complex<double>> {
+  static const KArgTypes type_code = KArgTypes::cfloat64;
+  constexpr static const char *format = "(%.15g,%.15g)";
+  static inline const std::string to_string(const std::complex<double> val) {
+    char buf[80];
+    snprintf(buf, sizeof(buf) - 1, format, val.real(), val.imag());
+    return std::string(buf);
+  };
+};
+
+template <> struct k_type_info<KDuration> : k_base_scalar_storage<KDuration> {
+  static const KArgTypes type_code = KArgTypes::duration;
+  constexpr static const char *format = nullptr;
+  static inline const std::string to_string(const KDuration val) {
+    std::chrono::duration<double, std::nano> ts_ns = val;
+    double secs = ts_ns.count() / 1e9;
+    char buf[30];
+    snprintf(buf, sizeof(buf) - 1, k_type_info<double>::format, secs);
+    return std::string(buf);
+  }
+};
+
+template <> struct k_type_info<KTimestamp> : k_base_scalar_storage<KTimestamp> {
+  static const KArgTypes type_code = KArgTypes::timestamp;
+  constexpr static const char *format = nullptr;
+  static inline const std::string to_string(const KTimestamp val) {
+    return k_type_info<KDuration>::to_string(val.time_since_epoch());
+  }
+};
+
+template <>
+struct k_type_info<std::string> : k_base_scalar_storage<std::string> {
+  typedef k_arg_string storage_type;
+  static const KArgTypes type_code = KArgTypes::string;
+  constexpr static const char *format = "%s";
+  static inline const std::string to_string(const std::string s) { return s; }
+};
+
+template <>
+struct k_type_info<const char *> : k_base_scalar_storage<std::string> {
+  typedef k_arg_string storage_type;
+  static const KArgTypes type_code = KArgTypes::string;
+  constexpr static const char *format = "%s";
+  static inline const std::string to_string(const std::string s) { return s; }
+};
+
+template <>
+struct k_type_info<k_arg_map_ptr> : k_base_scalar_storage<k_arg_map_ptr> {
+  static const KArgTypes type_code = KArgTypes::map;
+  constexpr static const char *format = nullptr;
+};
+
+template <>
+struct k_type_info<k_arg_list_ptr> : k_base_scalar_storage<k_arg_list_ptr> {
+  static const KArgTypes type_code = KArgTypes::list;
+  constexpr static const char *format = nullptr;
+};
+
+template <typename T>
+struct k_type_info<
+    T, typename std::enable_if<std::is_base_of<KMapBase, T>::value>::type>
+    : k_base_scalar_storage<k_arg_map_ptr> {
+  static const KArgTypes type_code = KArgTypes::map;
+  constexpr static const char *format = nullptr;
+};
+
+template <typename T>
+struct k_type_info<
+    T, typename std::enable_if<std::is_base_of<KListBase, T>::value>::type>
+    : k_base_scalar_storage<k_arg_list_ptr> {
+  static const KArgTypes type_code = KArgTypes::list;
+  constexpr static const char *format = nullptr;
+};
+
+template <typename T>
+struct k_type_info<
+    T, typename std::enable_if<std::is_base_of<KArgCustomTypeBase, T>::value ||
+                               std::is_same<T, k_arg_custom_ptr>::value>::type>
+    : k_base_scalar_storage<std::shared_ptr<T>> {
+  static const KArgTypes type_code = KArgTypes::custom;
+  constexpr static const char *format = nullptr;
+};
+
+template <typename T>
+struct k_type_info<std::shared_ptr<T>, typename std::enable_if<std::is_base_of<
+                                           KArgCustomTypeBase, T>::value>::type>
+    : k_base_scalar_storage<k_arg_custom_ptr> {
+  static const KArgTypes type_code = KArgTypes::custom;
+  constexpr static const char *format = nullptr;
+};
+
+template <typename T>
+struct k_type_info<std::shared_ptr<std::vector<T>>,
+                   typename std::enable_if<is_k_base_type<T>::value>::type>
+    : k_base_vector_storage<T> {
+  static const KArgTypes type_code = k_type_info<T>::type_code;
+  constexpr static const char *format = k_type_info<T>::format;
+};
+
+template <typename T>
+struct k_type_info<
+    T, typename std::enable_if<std::is_same<T, unsigned long>::value ||
+                               std::is_same<T, unsigned int>::value>::type> {
+  static_assert(
+      sizeof(T) == -1,
+      "Use of unsupported KArgMap type unsigned long or unsigned int");
+};
+
+} // namespace KArgMapInternal
+
+/**
+ * \brief A class to contain a variant stored in a KArgMap or KArgList.  The
+ * class contains meta data for the type such as it's fundamental type (e.g.
+ * int32_t) and if it is a std::vector or std::complex type.
+ *
+ * The value is a 16 byte payload followed by the type and the vector flag,
+ * 24 bytes on 64 bit platforms.  The payload has no spare byte for the tag:
+ * std::shared_ptr and std::complex<double> fill it, and k_arg_string uses the
+ * last byte for the inline length.
+ */
+class KArgVariant {
+  friend class KArgMapSerializer;
+
+public:
+  /**
+   * \brief A union to hold scalar values or shared_ptr values for object types.
+   * Most of these fields are not directly referenced but can be handy when
+   * debugging.
+   */
+  union argvariant_value {
+    uint8_t ptr[16];
+    k_arg_map_ptr map;
+    k_arg_list_ptr list;
+    k_arg_custom_ptr custom;
+    KArgMapInternal::k_arg_string string;
+    KTimestamp timestamp;
+    KDuration duration;
+    bool boolean;
+    int8_t int8;
+    int16_t int16;
+    int32_t int32;
+    int64_t int64;
+    uint8_t uint8;
+    uint16_t uint16;
+    uint32_t uint32;
+    uint64_t uint64;
+    float float32;
+    std::complex<float> cfloat32;
+    std::complex<double> cfloat64;
+    k_map_float64_t float64;
+
+    /// default constructor (for null values), zeroed so that moving a null
+    /// value copies defined bytes
+    argvariant_value() : ptr() {}
+
+    ~argvariant_value() {}
+  };
+
+  /// the value of the current element
+  argvariant_value m_value;
+
+  /// the type of the current element
+  KArgTypes m_type = KArgTypes::null;
+
+  /// True if the value is a std::vector
+  bool m_vector = false;
+
+public:
+  ~KArgVariant() { reset(); }
+
+  KArgVariant(const KArgVariant &ref) {
+    // Because m_value has non-trivial elements (std::shared_ptr) we cannot use
+    // a plain assignment
+    //              m_value = ref.m_value;
+
+    // First clean up any allocated objects we're replacing
+    reset();
+    if (ref.m_type != KArgTypes::null && ref.m_vector) {
+      // Vector types are stored as a shared_ptr created with inplace new.
+      // Cast it into a shared_ptr<std::vector> and new inplace into dest.
+      auto vec = *reinterpret_cast<std::shared_ptr<std::vector<int8_t>> *>(
+          &const_cast<KArgVariant &>(ref).m_value);
+      new (&m_value) std::shared_ptr<std::vector<int8_t>>{vec};
+    } else {
+      switch (ref.m_type) {
+      case KArgTypes::map: {
+        // http://stackoverflow.com/questions/24713833/using-a-union-with-unique-ptr
+        new (&m_value) k_arg_map_ptr{ref.m_value.map};
+        break;
+      }
+
+      case KArgTypes::list: {
+        new (&m_value) k_arg_list_ptr{ref.m_value.list};
+        break;
+      }
+
+#ifndef K_CUSTOM_TYPES_UNSUPPORTED
+      case KArgTypes::custom: {
+        new (&m_value) k_arg_custom_ptr{ref.m_value.custom};
+        break;
+      }
+#endif
+      case KArgTypes::string: {
+        new (&m_value) KArgMapInternal::k_arg_string(ref.m_value.string);
+        break;
+      }
+
+      default:
+        std::memcpy(&m_value, &ref.m_value, sizeof(ref.m_value));
+        break;
+      }
+    }
+    m_type = ref.m_type;
+    m_vector = ref.m_vector;
+  }
+
+  /**
+   * \brief Take over the value of ref, leaving ref null.  Every value type,
+   * including strings and shared_ptrs, is relocated bitwise so nothing is
+   * copied and no reference counts change.
+   */
+  KArgVariant(KArgVariant &&ref) K_NOEXCEPT : m_type(ref.m_type),
+                                              m_vector(ref.m_vector) {
+    std::memcpy(&m_value, &ref.m_value, sizeof(m_value));
+    ref.m_type = KArgTypes::null;
+    ref.m_vector = false;
+  }
+
+  /**
+   * \brief Borrow a string value without copying it.
+   * \param defaultValue The view to return if the value is not a string.
+   * \return The stored characters.  Short strings live inside the variant, so
+   * the view is valid until the variant is modified, moved or destroyed; for a
+   * variant held by a KArgMap or KArgList that includes adding or removing
+   * entries of the container.
+   */
+  k_string_view view(k_string_view defaultValue = k_string_view()) const {
+    if (m_type == KArgTypes::string && !m_vector) {
+      return k_string_view(m_value.string.data(), m_value.string.size());
+    }
+    return defaultValue;
+  }
+
+  /**
+   * \brief Borrow the elements of a std::vector<T> value without copying it
+   * or its shared_ptr.
+   * \tparam T The element type, which must match the stored vector exactly.
+   * \return The elements, or an empty span if the value is not a
+   * std::vector<T>.  Valid until the value is modified or destroyed.
+   */
+  template <typename T> k_span<T> span() const {
+    static_assert(!std::is_same<T, bool>::value,
+                  "std::vector<bool> has no contiguous storage to borrow");
+    if (!m_vector || m_type != KArgMapInternal::k_type_info<T>::type_code) {
+      return k_span<T>();
+    }
+    const auto &vec =
+        *reinterpret_cast<const std::shared_ptr<std::vector<T>> *>(&m_value);
+    return k_span<T>(vec->data(), vec->size());
+  }
+
+  bool isVector() const { return m_vector; }
+  bool isMap() const { return m_type == KArgTypes::map; }
+  bool isList() const { return m_type == KArgTypes::list; }
+  bool isScalar() const { return !isVector() && !isMap() && !isList(); }
+  bool isCustom() const { return m_type == KArgTypes::custom; }
+
+private:
+  template <typename T> size_t getVecSize() const {
+    const auto &vec =
+        *reinterpret_cast<const std::shared_ptr<std::vector<T>> *>(
+            &m_value.ptr);
+    return vec->size();
+  }
+
+public:
+  size_t size() const {
+    if (isVector()) {
+      switch (m_type) {
+      case KArgTypes::boolean:
+        return getVecSize<bool>();
+      case KArgTypes::int8:
+        return getVecSize<int8_t>();
+      case KArgTypes::int16:
+        return getVecSize<int16_t>();
+      case KArgTypes::int32:
+        return getVecSize<int32_t>();
+      case KArgTypes::int64:
+        return getVecSize<int64_t>();
+      case KArgTypes::uint8:
+        return getVecSize<uint8_t>();
+      case KArgTypes::uint16:
+        return getVecSize<uint16_t>();
+      case KArgTypes::uint32:
+        return getVecSize<uint32_t>();
+      case KArgTypes::uint64:
+        return getVecSize<uint64_t>();
+      case KArgTypes::float32:
+        return getVecSize<float>();
+      case KArgTypes::float64:
+        return getVecSize<double>();
+      case KArgTypes::cfloat32:
+        return getVecSize<std::complex<float>>();
+      case KArgTypes::cfloat64:
+        return getVecSize<std::complex<double>>();
+      case KArgTypes::timestamp:
+        return getVecSize<KTimestamp>();
+      case KArgTypes::duration:
+        return getVecSize<KDuration>();
+      case KArgTypes::string:
+        return getVecSize<std::string>();
+      default:
+        return 0;
+      }
+    } else if (isList()) {
+      return m_value.list->size();
+    }
+    return 0;
+  }
+  KArgTypes getType() const { return m_type; }
+
+  KArgVariant &operator=(KArgVariant other) K_NOEXCEPT {
+    // every value type is blittable, swap the raw bytes
+    std::swap(m_type, other.m_type);
+    std::swap(m_vector, other.m_vector);
+    uint8_t temp[sizeof(m_value)];
+    std::memcpy(temp, &m_value, sizeof(m_value));
+    std::memcpy(&m_value, &other.m_value, sizeof(m_value));
+    std::memcpy(&other.m_value, temp, sizeof(m_value));
+    return *this;
+  }
+
+  template <typename T>
+  typename std::enable_if<KArgMapInternal::k_type_info<T>::value,
+                          KArgVariant &>::type
+  operator=(T value) K_NOEXCEPT {
+    reset();
+    m_type = KArgMapInternal::k_type_info<T>::type_code;
+    m_vector = KArgMapInternal::k_type_info<T>::is_vector;
+    new (&m_value) typename KArgMapInternal::k_type_info<T>::storage_type(
+        std::move(value));
+    return *this;
+  }
+
+  KArgVariant() : m_type(KArgTypes::null), m_vector(false) {}
+
+  template <typename T,
+            typename std::enable_if<KArgMapInternal::is_k_type<T>::value>::type
+                * = nullptr>
+  KArgVariant(T value)
+      : m_type(KArgMapInternal::k_type_info<T>::type_code),
+        m_vector(KArgMapInternal::k_type_info<T>::is_vector) {
+    new (&m_value) typename KArgMapInternal::k_type_info<T>::storage_type(
+        std::move(value));
+  }
+
+  template <typename T,
+            typename std::enable_if<KArgMapInternal::is_k_type<T>::value>::type
+                * = nullptr>
+  KArgVariant(std::vector<T> &&val)
+      : m_type(KArgMapInternal::k_type_info<T>::type_code), m_vector(true) {
+    auto v = new std::vector<T>(std::move(val));
+    new (&m_value) std::shared_ptr<std::vector<T>>{v};
+  }
+
+  template <typename T,
+            typename std::enable_if<KArgMapInternal::is_k_type<T>::value>::type
+                * = nullptr>
+  KArgVariant(std::vector<T> &val)
+      : m_type(KArgMapInternal::k_type_info<T>::type_code), m_vector(true) {
+    static_assert(
+        sizeof(T) != sizeof(T),
+        "to set a std::vector, wrap with std::move or std::shared_ptr.");
+  }
+
+#if 0
+            template <typename T>
+            KArgVariant(std::shared_ptr<KArgCustomType<T>>&& val)
+                : m_type(KArgTypes::custom), m_value(val), m_vector(false)
+            {
+            }
+
+            template <typename T>
+            KArgVariant(KArgCustomType<T> val)
+                : m_type(KArgTypes::custom), m_value(std::make_shared<KArgCustomType<T>>(val)), m_vector(false)
+            {
+            }
+#endif
+  //===========================================================
+  template <class T, typename std::enable_if<
+                         std::is_floating_point<T>::value>::type * = nullptr>
+  T get_from_string(T defaultValue) const {
+    auto &s = m_value.string;
+    char *end;
+    auto value = std::strtod(s.c_str(), &end);
+    if (end - s.c_str() != int(s.length())) {
+      return defaultValue;
+    }
+    return convert_number_with_default(value, defaultValue);
+  }
+
+  static inline bool kargmap_strieq(const char *s1, const char *s2) {
+    for (; tolower(*s1) == tolower(*s2); s1++, s2++) {
+      if (*s1 == '\0')
+        return true;
+    }
+    return false;
+  }
+
+  template <class T, typename std::enable_if<std::is_integral<T>::value>::type
+                         * = nullptr>
+  T get_from_string(T defaultValue) const {
+    // use strtoll and strtoull instead of std::stoll and std::stoull
+    // because they do not throw exceptions
+    auto &s = m_value.string;
+    if (s.length() == 0)
+      return defaultValue;
+    if (s[0] == '-') {
+      char *end;
+      auto value = ::strtoll(s.c_str(), &end, 10);
+      if (end - s.c_str() != int(s.length())) {
+        // Try coverting from to double, then to T
+        auto dvalue = get_from_string<double>(double(defaultValue));
+        return convert_number_with_default(dvalue, defaultValue);
+      }
+      return convert_number_with_default(value, defaultValue);
+    } else {
+      char *end;
+      auto str = s.c_str();
+      if (*str != 0) {
+        // Do a quick check to see if the string is a boolean string such as
+        // 'true'.
+        auto ch = tolower(*str);
+        if (ch == 'f' || ch == 't' || ch == 'y' || ch == 'n') {
+          if (kargmap_strieq(str, "false") || kargmap_strieq(str, "no")) {
+            return convert_number_with_default(0, defaultValue);
+          } else if (kargmap_strieq(str, "true") ||
+                     kargmap_strieq(str, "yes")) {
+            return convert_number_with_default(1, defaultValue);
+          }
+        }
+      }
+
+      auto value = ::strtoull(s.c_str(), &end, 10);
+      if (end - s.c_str() != int(s.length())) {
+        // Try coverting from to double, then to T
+        auto dvalue = get_from_string<double>(double(defaultValue));
+        return convert_number_with_default(dvalue, defaultValue);
+      }
+      return convert_number_with_default(value, defaultValue);
+    }
+  }
+
+  template <class T, typename std::enable_if<
+                         std::is_same<T, KTimestamp>::value ||
+                         std::is_same<T, KDuration>::value>::type * = nullptr>
+  T get_from_string(T defaultValue) const {
+    auto secs = get_from_string<double>(-std::numeric_limits<double>::max());
+    if (secs == -std::numeric_limits<double>::max()) {
+      return defaultValue;
+    }
+    return T(std::chrono::nanoseconds(int64_t(secs * 1e9)));
+  }
+
+  template <typename T, typename std::enable_if<
+                            (std::is_arithmetic<T>::value)>::type * = nullptr>
+  T get(T defaultValue) {
+    switch (m_type) {
+    case KArgTypes::boolean:
+      return convert_number<bool>(defaultValue);
+    case KArgTypes::int8:
+      return convert_number<int8_t>(defaultValue);
+    case KArgTypes::int16:
+      return convert_number<int16_t>(defaultValue);
+    case KArgTypes::int32:
+      return convert_number<int32_t>(defaultValue);
+    case KArgTypes::int64:
+      return convert_number<int64_t>(defaultValue);
+    case KArgTypes::uint8:
+      return convert_number<uint8_t>(defaultValue);
+    case KArgTypes::uint16:
+      return convert_number<uint16_t>(defaultValue);
+    case KArgTypes::uint32:
+      return convert_number<uint32_t>(defaultValue);
+    case KArgTypes::uint64:
+      return convert_number<uint64_t>(defaultValue);
+    case KArgTypes::float32:
+      return convert_number<float>(defaultValue);
+    case KArgTypes::float64:
+      return convert_number<double>(defaultValue);
+    case KArgTypes::timestamp: {
+      // Convert to double seconds since epoch and then convert to requested
+      // type
+      std::chrono::duration<double, std::nano> ts_ns =
+          m_value.timestamp.time_since_epoch();
+      auto utcSeconds = ts_ns.count() / 1e9;
+      KArgVariant secs(utcSeconds);
+      return secs.get<T>(defaultValue);
+    }
+    case KArgTypes::duration: {
+      std::chrono::duration<double, std::nano> duration_ns = m_value.duration;
+      auto utcSeconds = double(duration_ns.count() / 1e9);
+      KArgVariant secs(utcSeconds);
+      return secs.get<T>(defaultValue);
+    }
+    case KArgTypes::string: {
+      return get_from_string(defaultValue);
+    }
+    default:
+      return defaultValue;
+    }
+  }
+
+  template <typename T,
+            typename std::enable_if<(
+                std::is_same<T, std::complex<float>>::value)>::type * = nullptr>
+  T get(T defaultValue) {
+    if (m_type == KArgTypes::cfloat32) {
       return m_value.cfloat32;
     }
-    return defaultValue;
+    return defaultValue;
+  }
+
+  template <typename T, typename std::enable_if<(
+                            std::is_same<T, std::complex<double>>::value)>::type
+                            * = nullptr>
+  T get(T defaultValue) {
+    if (m_type == KArgTypes::cfloat64) {
+      return m_value.cfloat64;
+    }
+    return defaultValue;
+  }
+
+  template <typename T,
+            typename std::enable_if<(std::is_same<T, KTimestamp>::value)>::type
+                * = nullptr>
+  T get(T defaultValue) {
+    if (m_type == KArgTypes::timestamp) {
+      return m_value.timestamp;
+    }
+    double secs = get<double>(-std::numeric_limits<double>::max());
+    if (secs == -std::numeric_limits<double>::max()) {
+      return defaultValue;
+    }
+    return KTimestamp(std::chrono::nanoseconds(int64_t(secs * 1e9)));
+  }
+
+  template <typename T,
+            typename std::enable_if<(std::is_same<T, KDuration>::value)>::type
+                * = nullptr>
+  T get(T defaultValue) {
+    if (m_type == KArgTypes::duration) {
+      return m_value.duration;
+    }
+    double secs = get<double>(-std::numeric_limits<double>::max());
+    if (secs == -std::numeric_limits<double>::max()) {
+      return defaultValue;
+    }
+    return KDuration(std::chrono::nanoseconds(int64_t(secs * 1e9)));
+  }
+
+  /**
+   * \brief Get a typed value from the KArgMap
+   * \param defaultValue The value to return if the key is not present.
+   * \return
+   */
+  std::string get(const std::string &defaultValue) const {
+    if (m_type == KArgTypes::string) {
+      return std::string(m_value.string.data(), m_value.string.size());
+    }
+    if (m_vector || m_type == KArgTypes::map || m_type == KArgTypes::list) {
+      return defaultValue;
+    }
+    return scalar_to_string();
+  }
+
+  std::string get(const char *defaultValue) const {
+    if (m_type == KArgTypes::string) {
+      return std::string(m_value.string.data(), m_value.string.size());
+    }
+    if (m_vector || m_type == KArgTypes::map || m_type == KArgTypes::list) {
+      return std::string(defaultValue);
+    }
+    return scalar_to_string();
+  }
+
+  //    /**
+  //    * \brief Get a typed value from the KArgMap
+  //    * \param defaultValue The value to return if the key is not present.
+  //    * \return
+  //    */
+  //    KArgMap get(KArgMap& defaultValue)
+  //    {
+  //        if (m_type == KArgTypes::map)
+  //        {
+  //            return m_value.map;
+  //        }
+  //        return defaultValue;
+  //    }
+
+  /**
+   * \brief Get a typed value from the KArgMap
+   * \param defaultValue The value to return if the key is not present.
+   * \return
+   */
+  k_arg_map_ptr get(k_arg_map_ptr defaultValue) {
+    if (m_type == KArgTypes::map) {
+      return *reinterpret_cast<k_arg_map_ptr *>(&m_value);
+    }
+    return defaultValue;
+  }
+
+  /**
+   * \brief Get a typed value from the KArgList
+   * \param defaultValue The value to return if the key is not present.
+   * \return
+   */
+  k_arg_list_ptr get(k_arg_list_ptr defaultValue) {
+    if (m_type == KArgTypes::list) {
+      return m_value.list;
+    }
+    return defaultValue;
+  }
+
+#ifdef K_SINGLE_THREADED
+  /**
+   * \brief The storage of a map value as a std::shared_ptr, as in builds
+   * without K_SINGLE_THREADED.  It holds a reference on the intrusive count.
+   * \param defaultValue The value to return if the value is not a map.
+   */
+  std::shared_ptr<k_arg_map_type>
+  get(std::shared_ptr<k_arg_map_type> defaultValue) {
+    if (m_type == KArgTypes::map && !m_vector) {
+      return KArgMapInternal::k_shared_container(m_value.map);
+    }
+    return defaultValue;
+  }
+
+  /**
+   * \brief The storage of a list value as a std::shared_ptr, as in builds
+   * without K_SINGLE_THREADED.  It holds a reference on the intrusive count.
+   * \param defaultValue The value to return if the value is not a list.
+   */
+  std::shared_ptr<k_arg_list_type>
+  get(std::shared_ptr<k_arg_list_type> defaultValue) {
+    if (m_type == KArgTypes::list && !m_vector) {
+      return KArgMapInternal::k_shared_container(m_value.list);
+    }
+    return defaultValue;
+  }
+#endif
+
+  /**
+   * \brief Get a typed value from the KArgList
+   * \param defaultValue The value to return if the key is not present.
+   * \return
+   */
+  template <typename T>
+  std::shared_ptr<T> get(std::shared_ptr<T> defaultValue) {
+    if (m_vector) {
+      auto vec = *reinterpret_cast<std::shared_ptr<T> *>(&m_value);
+
+      auto tc = KArgMapInternal::k_type_info<typename T::value_type>::type_code;
+      if (tc != m_type) {
+        // std::cerr << "Cannot convert requested std::vector types.\n";
+        return defaultValue;
+      }
+      return vec;
+    }
+
+    // maps and lists are only returned as their own storage type, by the
+    // overloads above
+    return defaultValue;
+  }
+
+  template <typename T> std::string as_string() const {
+    char buf[30];
+    T val = as<T>();
+    snprintf(buf, sizeof(buf) - 1, KArgMapInternal::k_type_info<T>::format,
+             val);
+    return std::string(buf);
+  }
+
+#ifndef K_CUSTOM_TYPES_UNSUPPORTED
+  template <typename T> T getCustomType(T defaultValue = T()) {
+    if (m_type == KArgTypes::map) {
+      // Is there a converter registered?
+      KArgVariant v = KArgMapInternal::argMapToCustomType(KARG_TYPE_ID_NAME(T),
+                                                          m_value.map);
+      if (v.m_type != KArgTypes::custom)
+        return defaultValue;
+      auto ptr =
+          *reinterpret_cast<std::shared_ptr<KArgCustomType<T>> *>(&v.m_value);
+      return ptr->m_value;
+    }
+    if (m_type != KArgTypes::custom)
+      return defaultValue;
+    auto ptr =
+        *reinterpret_cast<std::shared_ptr<KArgCustomType<T>> *>(&m_value);
+    if (ptr->m_name != KARG_TYPE_ID_NAME(T))
+      return defaultValue;
+    return ptr->m_value;
+  }
+#endif
+
+  /**
+   * \brief Deep comparison.  Values are equal if they have the same type and
+   * equal contents; 1 and 1.0 differ, as do an int32 and an int64.  Custom
+   * values are equal only to themselves.
+   */
+  bool operator==(const KArgVariant &other) const {
+    return KArgMapInternal::argVariantEquals(*this, other);
+  }
+
+  bool operator!=(const KArgVariant &other) const {
+    return !KArgMapInternal::argVariantEquals(*this, other);
+  }
+
+  /// A hash of the contents, equal for values that compare equal.
+  size_t hash() const { return KArgMapInternal::argVariantHash(*this); }
+
+  std::string scalar_to_string() const {
+    switch (m_type) {
+    case KArgTypes::int8:
+      return KArgMapInternal::to_string(m_value.int8);
+    case KArgTypes::int16:
+      return KArgMapInternal::to_string(m_value.int16);
+    case KArgTypes::int32:
+      return KArgMapInternal::to_string(m_value.int32);
+    case KArgTypes::int64:
+      return KArgMapInternal::to_string(m_value.int64);
+    case KArgTypes::uint8:
+      return KArgMapInternal::to_string(m_value.uint8);
+    case KArgTypes::uint16:
+      return KArgMapInternal::to_string(m_value.uint16);
+    case KArgTypes::uint32:
+      return KArgMapInternal::to_string(m_value.uint32);
+    case KArgTypes::uint64:
+      return KArgMapInternal::to_string(m_value.uint64);
+    case KArgTypes::float32:
+      return KArgMapInternal::to_string(m_value.float32);
+    case KArgTypes::float64:
+      return KArgMapInternal::to_string(m_value.float64);
+    case KArgTypes::cfloat32:
+      return KArgMapInternal::to_string(m_value.cfloat32);
+    case KArgTypes::cfloat64:
+      return KArgMapInternal::to_string(m_value.cfloat64);
+    case KArgTypes::timestamp:
+      return KArgMapInternal::to_string(m_value.timestamp.time_since_epoch());
+    case KArgTypes::duration:
+      return KArgMapInternal::to_string(m_value.duration);
+    default:
+      return "";
+    }
+  }
+
+  operator std::string() const {
+    switch (m_type) {
+    case KArgTypes::string:
+      return std::string(m_value.string.data(), m_value.string.size());
+    default:
+      std::string s;
+      s.reserve(256);
+      KArgMapInternal::argVariantToString(s, *this);
+      return s;
+    }
+  }
+
+  /**
+   * \brief cast the value held in KArgVariant to the specified type.  Use of
+   * this method is discouraged due to lack of type safety and should only be
+   * used by serializers.
+   *
+   * Usage: val.as<int32_t>()
+   */
+  template <typename T> T as() const {
+    return *reinterpret_cast<const T *>(&m_value);
+  }
+
+private:
+  // Conversions helpers
+  template <typename SourceType, typename DestType,
+            typename std::enable_if<(std::is_signed<SourceType>::value)>::type
+                * = nullptr>
+  DestType convert_number_with_default_mixed_sign(SourceType value,
+                                                  DestType defaultValue)
+      const { // std::cout << "signed source, unsiged dest\n";
+    if (value < 0)
+      return defaultValue;
+    return (typename std::make_unsigned<DestType>::type(value) >
+            std::numeric_limits<DestType>::max())
+               ? defaultValue
+               : DestType(value);
+  }
+
+  template <typename SourceType, typename DestType,
+            typename std::enable_if<
+                (std::is_unsigned<SourceType>::value &&
+                 std::is_floating_point<DestType>::value)>::type * = nullptr>
+  DestType convert_number_with_default_mixed_sign(SourceType value,
+                                                  DestType defaultValue)
+      const { // std::cout << "unsigned source, floating dest\n";
+    return DestType(value);
+  }
+
+  template <typename SourceType, typename DestType,
+            typename std::enable_if<
+                (std::is_unsigned<SourceType>::value &&
+                 !std::is_floating_point<DestType>::value)>::type * = nullptr>
+  DestType convert_number_with_default_mixed_sign(SourceType value,
+                                                  DestType defaultValue)
+      const { // std::cout << "unsigned source, signed non float dest\n";
+    return (value > typename std::make_unsigned<DestType>::type(
+                        std::numeric_limits<DestType>::max()))
+               ? defaultValue
+               : DestType(value);
+  }
+
+  //=============================================
+  template <typename SourceType, typename DestType,
+            typename std::enable_if<(std::is_unsigned<SourceType>::value ==
+                                     std::is_unsigned<DestType>::value)>::type
+                * = nullptr>
+  DestType convert_number_with_default_signed_check(
+      SourceType value,
+      DestType defaultValue) const { // std::cout << "same sign\n";
+    return (value > std::numeric_limits<DestType>::max() ||
+            value < std::numeric_limits<DestType>::lowest())
+               ? defaultValue
+               : DestType(value);
+  }
+
+  template <typename SourceType, typename DestType,
+            typename std::enable_if<(std::is_unsigned<SourceType>::value !=
+                                     std::is_unsigned<DestType>::value)>::type
+                * = nullptr>
+  DestType convert_number_with_default_signed_check(
+      SourceType value,
+      DestType defaultValue) const { // dispatch to mixed sign checks
+    return convert_number_with_default_mixed_sign(value, defaultValue);
+  }
+
+  //=============================
+  template <typename SourceType, typename DestType,
+            typename std::enable_if<
+                (std::is_same<SourceType, DestType>::value)>::type * = nullptr>
+  DestType convert_number_with_default(SourceType value, DestType defaultValue)
+      const { // std::cout << "same type\n";
+    return DestType(value);
+  }
+
+  template <typename SourceType, typename DestType,
+            typename std::enable_if<
+                (!std::is_same<SourceType, DestType>::value &&
+                 std::is_same<DestType, bool>::value)>::type * = nullptr>
+  DestType convert_number_with_default(SourceType value, DestType defaultValue)
+      const { // std::cout << "dest bool\n";
+    return DestType(value != 0);
+  }
+
+  template <typename SourceType, typename DestType,
+            typename std::enable_if<
+                (!std::is_same<SourceType, DestType>::value &&
+                 std::is_same<SourceType, bool>::value)>::type * = nullptr>
+  DestType convert_number_with_default(SourceType value, DestType defaultValue)
+      const { // std::cout << "src bool\n";
+    return DestType(value ? 1 : 0);
+  }
+
+  template <typename SourceType, typename DestType,
+            typename std::enable_if<
+                (!std::is_same<SourceType, DestType>::value &&
+                 !std::is_same<bool, DestType>::value &&
+                 !std::is_same<SourceType, bool>::value)>::type * = nullptr>
+  DestType convert_number_with_default(SourceType value, DestType defaultValue)
+      const { // dispatch to signed checks
+    return convert_number_with_default_signed_check(value, defaultValue);
+  }
+
+  //===========================================
+
+  template <typename SourceType, typename DestType>
+  DestType convert_number(DestType defaultValue) const {
+    auto val = *reinterpret_cast<const SourceType *>(&m_value);
+    return convert_number_with_default(val, defaultValue);
+  }
+
+  template <typename T> void vec_reset() {
+    typedef std::shared_ptr<std::vector<T>> VecType;
+    VecType *vec = reinterpret_cast<VecType *>(&m_value);
+    vec->reset();
+    vec->~VecType();
+    // http://stackoverflow.com/questions/11988209/call-explicit-constructor-destructor-with-traits-in-templatized-function
+  }
+
+  void reset() {
+    if (m_type == KArgTypes::null)
+      return;
+    if (m_vector) {
+      switch (m_type) {
+      case KArgTypes::boolean:
+        return vec_reset<bool>();
+      case KArgTypes::int8:
+        return vec_reset<int8_t>();
+      case KArgTypes::int16:
+        return vec_reset<int16_t>();
+      case KArgTypes::int32:
+        return vec_reset<int32_t>();
+      case KArgTypes::int64:
+        return vec_reset<int64_t>();
+      case KArgTypes::uint8:
+        return vec_reset<uint8_t>();
+      case KArgTypes::uint16:
+        return vec_reset<uint16_t>();
+      case KArgTypes::uint32:
+        return vec_reset<uint32_t>();
+      case KArgTypes::uint64:
+        return vec_reset<uint64_t>();
+      case KArgTypes::float32:
+        return vec_reset<float>();
+      case KArgTypes::float64:
+        return vec_reset<double>();
+      case KArgTypes::cfloat32:
+        return vec_reset<std::complex<float>>();
+      case KArgTypes::cfloat64:
+        return vec_reset<std::complex<double>>();
+      case KArgTypes::timestamp:
+        return vec_reset<KTimestamp>();
+      case KArgTypes::duration:
+        return vec_reset<KDuration>();
+      case KArgTypes::string:
+        return vec_reset<std::string>();
+      case KArgTypes::map:
+        return vec_reset<k_arg_map_type>();
+      case KArgTypes::list:
+        return vec_reset<k_arg_list_type>();
+      default:
+        break;
+      }
+    } else {
+      switch (m_type) {
+      case KArgTypes::map: {
+        m_value.map.~k_arg_map_ptr();
+        break;
+      }
+      case KArgTypes::list: {
+        m_value.list.~k_arg_list_ptr();
+        break;
+      }
+      case KArgTypes::custom: {
+        m_value.custom.~k_arg_custom_ptr();
+        break;
+      }
+      case KArgTypes::string: {
+        m_value.string.~k_arg_string();
+        break;
+      }
+      default:
+        break;
+      }
+    }
+    m_type = KArgTypes::null;
+  }
+}; // KArgVariant
+
+static_assert(sizeof(KArgVariant) <= 16 + sizeof(void *),
+              "KArgVariant is a 16 byte payload plus type and vector flag");
+
+/// Strings are not stored as std::string, convert them.
+template <> inline std::string KArgVariant::as<std::string>() const {
+  return std::string(m_value.string.data(), m_value.string.size());
+}
+
+///< A null KArgVariant for internal use
+typedef KArgMapInternal::Singleton<KArgVariant> NullKArgVariant;
+
+template <typename T>
+void vec_string(std::string &s, const KArgVariant &val,
+                bool addQuotes = false) {
+  const auto &vec =
+      *reinterpret_cast<const std::shared_ptr<std::vector<T>> *>(&val.m_value);
+  s.append("[");
+  for (size_t i = 0; i < vec->size(); ++i) {
+    if (i != 0)
+      s.append(",");
+    if (addQuotes)
+      s.append("\"");
+    s.append(KArgMapInternal::to_string((*vec)[i]));
+    if (addQuotes)
+      s.append("\"");
+  }
+  s.append("]");
+}
+
+template <typename T>
+void vec_string_iter(std::string &s, const KArgVariant &val,
+                     std::function<void(T &)> func) {
+  const auto &vec =
+      *reinterpret_cast<const std::shared_ptr<std::vector<T>> *>(&val.m_value);
+  s.append("[");
+  for (size_t i = 0; i < vec->size(); ++i) {
+    if (i != 0)
+      s.append(",");
+    auto element = (*vec)[i];
+    func(element);
+  }
+  s.append("]");
+}
+
+namespace KArgMapInternal {
+inline void argListToString(std::string &s, const k_arg_list_type &list) {
+  s.append("[");
+  bool first = true;
+  for (auto const &item : list) {
+    if (!first) {
+      s.append(",");
+    }
+    first = false;
+    KArgMapInternal::argVariantToString(s, item);
+  }
+  s.append("]");
+}
+
+inline void argMapToString(std::string &s, const k_arg_map_type &map) {
+  s.append("{");
+  bool first = true;
+  for (auto const &item : map) {
+    if (item.second.m_type == KArgTypes::null) {
+      continue;
+    }
+    s.append(first ? "\"" : ", \"");
+    first = false;
+    s.append(item.first);
+    s.append("\":");
+    KArgMapInternal::argVariantToString(s, item.second);
+  }
+  s.append("}");
+}
+
+inline void argVariantToString(std::string &s, const KArgVariant &val) {
+  if (val.m_vector) {
+    switch (val.m_type) {
+    case KArgTypes::boolean: {
+      const auto &vec =
+          *reinterpret_cast<const std::shared_ptr<std::vector<bool>> *>(
+              &val.m_value);
+      s.append("[");
+      for (size_t i = 0; i < vec->size(); ++i) {
+        if (i != 0)
+          s.append(",");
+        s.append((*vec)[i] ? "true" : "false");
+      }
+
+      s.append("]");
+      return;
+    }
+    case KArgTypes::int8:
+      return vec_string<int8_t>(s, val);
+    case KArgTypes::int16:
+      return vec_string<int16_t>(s, val);
+    case KArgTypes::int32:
+      return vec_string<int32_t>(s, val);
+    case KArgTypes::int64:
+      return vec_string<int64_t>(s, val);
+    case KArgTypes::uint8:
+      return vec_string<uint8_t>(s, val);
+    case KArgTypes::uint16:
+      return vec_string<uint16_t>(s, val);
+    case KArgTypes::uint32:
+      return vec_string<uint32_t>(s, val);
+    case KArgTypes::uint64:
+      return vec_string<uint64_t>(s, val);
+    case KArgTypes::float32:
+      return vec_string<float>(s, val);
+    case KArgTypes::float64:
+      return vec_string<double>(s, val);
+    case KArgTypes::cfloat32:
+      return vec_string<std::complex<float>>(s, val, true);
+    case KArgTypes::cfloat64:
+      return vec_string<std::complex<double>>(s, val, true);
+    case KArgTypes::timestamp:
+      return vec_string<KTimestamp>(s, val);
+    case KArgTypes::duration:
+      return vec_string<KDuration>(s, val);
+    case KArgTypes::string:
+      return vec_string<std::string>(s, val, true);
+    case KArgTypes::map:
+      return vec_string_iter<KMapBase>(
+          s, val, [&s](KMapBase &v) { argMapToString(s, *v.m_map); });
+    case KArgTypes::list:
+      return vec_string_iter<KListBase>(
+          s, val, [&s](KListBase &v) { argListToString(s, *v.m_list); });
+    default:
+      break;
+    }
+    return;
+  }
+  switch (val.m_type) {
+  case KArgTypes::null:
+    s.append("null");
+    break;
+  case KArgTypes::map: {
+    auto map = val.m_value.map;
+    argMapToString(s, *map);
+    break;
+  }
+
+  case KArgTypes::list: {
+    argListToString(s, *val.m_value.list);
+    break;
+  }
+
+  case KArgTypes::string: {
+    s.append("\"");
+    s.append(val.m_value.string.data(), val.m_value.string.size());
+    s.append("\"");
+    break;
+  }
+
+  case KArgTypes::boolean: {
+    s.append(val.m_value.boolean ? "true" : "false");
+    break;
+  }
+  case KArgTypes::custom: {
+    argMapToString(s, *customArgToString(val));
+    break;
+  }
+  default:
+    s.append(val.scalar_to_string());
+    break;
+  }
+}
+
+/// Mix value into seed, as boost::hash_combine does.
+inline size_t k_hash_combine(size_t seed, size_t value) {
+  return seed ^ (value + 0x9e3779b9 + (seed << 6) + (seed >> 2));
+}
+
+template <typename T> inline size_t k_value_hash(const T &v) {
+  return std::hash<T>()(v);
+}
+
+// 0.0 == -0.0 and every NaN equals every other, so each group must hash alike
+inline size_t k_value_hash(float v) {
+  return v == 0 ? 0 : v != v ? 1 : std::hash<float>()(v);
+}
+
+inline size_t k_value_hash(double v) {
+  return v == 0 ? 0 : v != v ? 1 : std::hash<double>()(v);
+}
+
+template <typename T> inline size_t k_value_hash(const std::complex<T> &v) {
+  return k_hash_combine(k_value_hash(v.real()), k_value_hash(v.imag()));
+}
+
+inline size_t k_value_hash(const KTimestamp &v) {
+  return std::hash<int64_t>()(int64_t(v.time_since_epoch().count()));
+}
+
+inline size_t k_value_hash(const KDuration &v) {
+  return std::hash<int64_t>()(int64_t(v.count()));
+}
+
+/// Value equality for KArgVariant::operator==.  Unlike ==, a NaN equals any
+/// other NaN, so a value always equals its own copy.
+template <typename T> inline bool k_value_equals(const T &x, const T &y) {
+  return x == y;
+}
+
+inline bool k_value_equals(float x, float y) {
+  return x == y || (x != x && y != y);
+}
+
+inline bool k_value_equals(double x, double y) {
+  return x == y || (x != x && y != y);
+}
+
+template <typename T>
+inline bool k_value_equals(const std::complex<T> &x, const std::complex<T> &y) {
+  return k_value_equals(x.real(), y.real()) &&
+         k_value_equals(x.imag(), y.imag());
+}
+
+template <typename T, typename Equal>
+bool vec_equals(const KArgVariant &a, const KArgVariant &b, Equal equal) {
+  const auto &va =
+      *reinterpret_cast<const std::shared_ptr<std::vector<T>> *>(&a.m_value);
+  const auto &vb =
+      *reinterpret_cast<const std::shared_ptr<std::vector<T>> *>(&b.m_value);
+  if (va == vb) {
+    return true;
+  }
+  if (!va || !vb || va->size() != vb->size()) {
+    return false;
+  }
+  for (size_t i = 0; i < va->size(); ++i) {
+    const T &x = (*va)[i];
+    const T &y = (*vb)[i];
+    if (!equal(x, y)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+template <typename T>
+bool vec_equals(const KArgVariant &a, const KArgVariant &b) {
+  return vec_equals<T>(
+      a, b, [](const T &x, const T &y) { return k_value_equals(x, y); });
+}
+
+template <typename T, typename Hash>
+size_t vec_hash(const KArgVariant &val, Hash hash) {
+  const auto &vec =
+      *reinterpret_cast<const std::shared_ptr<std::vector<T>> *>(&val.m_value);
+  size_t seed = vec ? vec->size() : 0;
+  for (size_t i = 0; vec && i < vec->size(); ++i) {
+    const T &element = (*vec)[i];
+    seed = k_hash_combine(seed, hash(element));
+  }
+  return seed;
+}
+
+template <typename T> size_t vec_hash(const KArgVariant &val) {
+  return vec_hash<T>(val, [](const T &v) { return k_value_hash(v); });
+}
+
+inline bool argMapEquals(const k_arg_map_type &a, const k_arg_map_type &b) {
+  if (&a == &b) {
+    return true;
+  }
+  if (a.size() != b.size()) {
+    return false;
+  }
+  for (auto const &item : a) {
+    auto other = b.find(item.first);
+    if (other == b.end() || !argVariantEquals(item.second, other->second)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+inline bool argListEquals(const k_arg_list_type &a, const k_arg_list_type &b) {
+  if (&a == &b) {
+    return true;
+  }
+  if (a.size() != b.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < a.size(); ++i) {
+    if (!argVariantEquals(a[i], b[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+inline size_t argMapHash(const k_arg_map_type &map) {
+  // a sum does not depend on the iteration order of the map
+  size_t sum = 0;
+  for (auto const &item : map) {
+    sum += k_hash_combine(std::hash<k_map_string_t>()(item.first),
+                          argVariantHash(item.second));
+  }
+  return k_hash_combine(map.size(), sum);
+}
+
+inline size_t argListHash(const k_arg_list_type &list) {
+  size_t seed = list.size();
+  for (auto const &item : list) {
+    seed = k_hash_combine(seed, argVariantHash(item));
+  }
+  return seed;
+}
+
+inline bool argVariantEquals(const KArgVariant &a, const KArgVariant &b) {
+  if (a.m_type != b.m_type || a.m_vector != b.m_vector) {
+    return false;
+  }
+  if (a.m_vector) {
+    switch (a.m_type) {
+    case KArgTypes::boolean:
+      return vec_equals<bool>(a, b);
+    case KArgTypes::int8:
+      return vec_equals<int8_t>(a, b);
+    case KArgTypes::int16:
+      return vec_equals<int16_t>(a, b);
+    case KArgTypes::int32:
+      return vec_equals<int32_t>(a, b);
+    case KArgTypes::int64:
+      return vec_equals<int64_t>(a, b);
+    case KArgTypes::uint8:
+      return vec_equals<uint8_t>(a, b);
+    case KArgTypes::uint16:
+      return vec_equals<uint16_t>(a, b);
+    case KArgTypes::uint32:
+      return vec_equals<uint32_t>(a, b);
+    case KArgTypes::uint64:
+      return vec_equals<uint64_t>(a, b);
+    case KArgTypes::float32:
+      return vec_equals<float>(a, b);
+    case KArgTypes::float64:
+      return vec_equals<k_map_float64_t>(a, b);
+    case KArgTypes::cfloat32:
+      return vec_equals<std::complex<float>>(a, b);
+    case KArgTypes::cfloat64:
+      return vec_equals<std::complex<double>>(a, b);
+    case KArgTypes::timestamp:
+      return vec_equals<KTimestamp>(a, b);
+    case KArgTypes::duration:
+      return vec_equals<KDuration>(a, b);
+    case KArgTypes::string:
+      return vec_equals<std::string>(a, b);
+    case KArgTypes::map:
+      return vec_equals<KMapBase>(a, b, [](const KMapBase &x,
+                                           const KMapBase &y) {
+        return x.m_map == y.m_map || argMapEquals(*x.m_map, *y.m_map);
+      });
+    case KArgTypes::list:
+      return vec_equals<KListBase>(a, b, [](const KListBase &x,
+                                            const KListBase &y) {
+        return x.m_list == y.m_list || argListEquals(*x.m_list, *y.m_list);
+      });
+    default:
+      return false;
+    }
+  }
+  switch (a.m_type) {
+  case KArgTypes::null:
+    return true;
+  case KArgTypes::boolean:
+    return a.m_value.boolean == b.m_value.boolean;
+  case KArgTypes::int8:
+    return a.m_value.int8 == b.m_value.int8;
+  case KArgTypes::int16:
+    return a.m_value.int16 == b.m_value.int16;
+  case KArgTypes::int32:
+    return a.m_value.int32 == b.m_value.int32;
+  case KArgTypes::int64:
+    return a.m_value.int64 == b.m_value.int64;
+  case KArgTypes::uint8:
+    return a.m_value.uint8 == b.m_value.uint8;
+  case KArgTypes::uint16:
+    return a.m_value.uint16 == b.m_value.uint16;
+  case KArgTypes::uint32:
+    return a.m_value.uint32 == b.m_value.uint32;
+  case KArgTypes::uint64:
+    return a.m_value.uint64 == b.m_value.uint64;
+  case KArgTypes::float32:
+    return k_value_equals(a.m_value.float32, b.m_value.float32);
+  case KArgTypes::float64:
+    return k_value_equals(a.m_value.float64, b.m_value.float64);
+  case KArgTypes::cfloat32:
+    return k_value_equals(a.m_value.cfloat32, b.m_value.cfloat32);
+  case KArgTypes::cfloat64:
+    return k_value_equals(a.m_value.cfloat64, b.m_value.cfloat64);
+  case KArgTypes::timestamp:
+    return a.m_value.timestamp == b.m_value.timestamp;
+  case KArgTypes::duration:
+    return a.m_value.duration == b.m_value.duration;
+  case KArgTypes::string:
+    return a.m_value.string == b.m_value.string;
+  case KArgTypes::map:
+    return a.m_value.map == b.m_value.map ||
+           argMapEquals(*a.m_value.map, *b.m_value.map);
+  case KArgTypes::list:
+    return a.m_value.list == b.m_value.list ||
+           argListEquals(*a.m_value.list, *b.m_value.list);
+  case KArgTypes::custom:
+    // custom values are opaque, only the same object is equal
+    return a.m_value.custom == b.m_value.custom;
   }
+  return false;
+}
 
-  template <typename T, typename std::enable_if<(
-                            std::is_same<T, std::complex<double>>::value)>::type
-                            * = nullptr>
-  T get(T defaultValue) {
-    if (m_type == KArgTypes::cfloat64) {
-      return m_value.cfloat64;
+inline size_t argVariantHash(const KArgVariant &val) {
+  size_t seed = size_t(val.m_type) * 2 + (val.m_vector ? 1 : 0);
+  if (val.m_vector) {
+    switch (val.m_type) {
+    case KArgTypes::boolean:
+      return k_hash_combine(seed, vec_hash<bool>(val));
+    case KArgTypes::int8:
+      return k_hash_combine(seed, vec_hash<int8_t>(val));
+    case KArgTypes::int16:
+      return k_hash_combine(seed, vec_hash<int16_t>(val));
+    case KArgTypes::int32:
+      return k_hash_combine(seed, vec_hash<int32_t>(val));
+    case KArgTypes::int64:
+      return k_hash_combine(seed, vec_hash<int64_t>(val));
+    case KArgTypes::uint8:
+      return k_hash_combine(seed, vec_hash<uint8_t>(val));
+    case KArgTypes::uint16:
+      return k_hash_combine(seed, vec_hash<uint16_t>(val));
+    case KArgTypes::uint32:
+      return k_hash_combine(seed, vec_hash<uint32_t>(val));
+    case KArgTypes::uint64:
+      return k_hash_combine(seed, vec_hash<uint64_t>(val));
+    case KArgTypes::float32:
+      return k_hash_combine(seed, vec_hash<float>(val));
+    case KArgTypes::float64:
+      return k_hash_combine(seed, vec_hash<k_map_float64_t>(val));
+    case KArgTypes::cfloat32:
+      return k_hash_combine(seed, vec_hash<std::complex<float>>(val));
+    case KArgTypes::cfloat64:
+      return k_hash_combine(seed, vec_hash<std::complex<double>>(val));
+    case KArgTypes::timestamp:
+      return k_hash_combine(seed, vec_hash<KTimestamp>(val));
+    case KArgTypes::duration:
+      return k_hash_combine(seed, vec_hash<KDuration>(val));
+    case KArgTypes::string:
+      return k_hash_combine(seed, vec_hash<std::string>(val));
+    case KArgTypes::map:
+      return k_hash_combine(
+          seed, vec_hash<KMapBase>(val, [](const KMapBase &v) {
+            return argMapHash(*v.m_map);
+          }));
+    case KArgTypes::list:
+      return k_hash_combine(
+          seed, vec_hash<KListBase>(val, [](const KListBase &v) {
+            return argListHash(*v.m_list);
+          }));
+    default:
+      return seed;
     }
-    return defaultValue;
   }
+  switch (val.m_type) {
+  case KArgTypes::null:
+    return seed;
+  case KArgTypes::boolean:
+    return k_hash_combine(seed, k_value_hash(val.m_value.boolean));
+  case KArgTypes::int8:
+    return k_hash_combine(seed, k_value_hash(val.m_value.int8));
+  case KArgTypes::int16:
+    return k_hash_combine(seed, k_value_hash(val.m_value.int16));
+  case KArgTypes::int32:
+    return k_hash_combine(seed, k_value_hash(val.m_value.int32));
+  case KArgTypes::int64:
+    return k_hash_combine(seed, k_value_hash(val.m_value.int64));
+  case KArgTypes::uint8:
+    return k_hash_combine(seed, k_value_hash(val.m_value.uint8));
+  case KArgTypes::uint16:
+    return k_hash_combine(seed, k_value_hash(val.m_value.uint16));
+  case KArgTypes::uint32:
+    return k_hash_combine(seed, k_value_hash(val.m_value.uint32));
+  case KArgTypes::uint64:
+    return k_hash_combine(seed, k_value_hash(val.m_value.uint64));
+  case KArgTypes::float32:
+    return k_hash_combine(seed, k_value_hash(val.m_value.float32));
+  case KArgTypes::float64:
+    return k_hash_combine(seed, k_value_hash(val.m_value.float64));
+  case KArgTypes::cfloat32:
+    return k_hash_combine(seed, k_value_hash(val.m_value.cfloat32));
+  case KArgTypes::cfloat64:
+    return k_hash_combine(seed, k_value_hash(val.m_value.cfloat64));
+  case KArgTypes::timestamp:
+    return k_hash_combine(seed, k_value_hash(val.m_value.timestamp));
+  case KArgTypes::duration:
+    return k_hash_combine(seed, k_value_hash(val.m_value.duration));
+  case KArgTypes::string:
+    return k_hash_combine(seed, k_hash(val.m_value.string.data(),
+                                       val.m_value.string.size()));
+  case KArgTypes::map:
+    return k_hash_combine(seed, argMapHash(*val.m_value.map));
+  case KArgTypes::list:
+    return k_hash_combine(seed, argListHash(*val.m_value.list));
+  case KArgTypes::custom:
+    return k_hash_combine(seed, k_value_hash(val.m_value.custom));
+  }
+  return seed;
+}
+} // namespace KArgMapInternal
 
-  template <typename T,
-            typename std::enable_if<(std::is_same<T, KTimestamp>::value)>::type
-                * = nullptr>
-  T get(T defaultValue) {
-    if (m_type == KArgTypes::timestamp) {
-      return m_value.timestamp;
+inline std::ostream &operator<<(std::ostream &o, const k_arg_list_ptr val) {
+  if (val) {
+    std::string s;
+    s.reserve(256);
+    KArgMapInternal::argListToString(s, *val);
+    o << s;
+  } else {
+    o << std::string("[]");
+  }
+  return o;
+}
+
+inline std::ostream &operator<<(std::ostream &o, const k_arg_map_ptr val) {
+  if (val) {
+    std::string s;
+    s.reserve(256);
+    KArgMapInternal::argMapToString(s, *val);
+    o << s;
+  } else {
+    o << std::string("{}");
+  }
+  return o;
+}
+
+namespace KArgMapInternal {
+/// True if item holds a map or list marked copy-on-write.
+inline bool k_is_cow(const KArgVariant &item) {
+  if (item.m_vector) {
+    return false;
+  }
+  if (item.m_type == KArgTypes::map) {
+    return item.m_value.map->isCopyOnWrite();
+  }
+  return item.m_type == KArgTypes::list && item.m_value.list->isCopyOnWrite();
+}
+
+/// Mark the map or list held by item copy-on-write (see KArgMap::cowClone).
+inline void k_mark_cow(const KArgVariant &item) {
+  if (item.m_vector) {
+    return;
+  }
+  if (item.m_type == KArgTypes::map) {
+    item.m_value.map->setCopyOnWrite();
+  } else if (item.m_type == KArgTypes::list) {
+    item.m_value.list->setCopyOnWrite();
+  }
+}
+} // namespace KArgMapInternal
+
+class KArgList : public KListBase {
+  friend class KArgMap;
+  friend class KArgMapTest;
+  friend class KArgMapSerializer;
+  friend class KArgPersistentMap;
+  friend class KArgInternStore;
+  friend class KArgStringPool;
+
+  KArgList(k_arg_list_ptr list) { m_list = list; }
+
+public:
+  KArgList() { m_list = KArgMapInternal::k_make_ptr<k_arg_list_ptr>(); }
+
+  /// An empty list placed in arena (see KArgArena).
+  explicit KArgList(KArgArena &arena) {
+    m_list = KArgMapInternal::k_new_list(&arena);
+  }
+
+  KArgList(std::initializer_list<KArgVariant> l) {
+    m_list = KArgMapInternal::k_make_ptr<k_arg_list_ptr>(l);
+  }
+
+  KArgList(KArgVariant &v) {
+    if (v.m_type == KArgTypes::list) {
+      m_list = v.m_value.list;
+    } else {
+      m_list = KArgMapInternal::k_make_ptr<k_arg_list_ptr>();
     }
-    double secs = get<double>(-std::numeric_limits<double>::max());
-    if (secs == -std::numeric_limits<double>::max()) {
+  }
+
+  void add(std::initializer_list<KArgVariant> l) {
+    detach();
+    m_list->insert(m_list->end(), l);
+  }
+
+  void add(KArgList list) {
+    detach();
+    m_list->insert(m_list->end(), list.m_list->begin(), list.m_list->end());
+  }
+
+  KArgVariant &operator[](const size_t index) {
+    // Beware, exception if element does not exist
+    detach();
+    return m_list->operator[](index);
+  }
+
+  /**
+   * \brief Get a typed value from the KArgMap.
+   * \tparam T The type to return.
+   * \param index The index to look up.
+   * \param defaultValue The value to return if the key is not present.
+   * \return The value associated with key or the default value parameter.
+   */
+  template <typename T> T get(const size_t index, T defaultValue) {
+    if (index >= m_list->size())
       return defaultValue;
-    }
-    return KTimestamp(std::chrono::nanoseconds(int64_t(secs * 1e9)));
+    auto &val = m_list->operator[](index);
+    inheritCow(val);
+    return val.get(defaultValue);
   }
 
-  template <typename T,
-            typename std::enable_if<(std::is_same<T, KDuration>::value)>::type
-                * = nullptr>
-  T get(T defaultValue) {
-    if (m_type == KArgTypes::duration) {
-      return m_value.duration;
-    }
-    double secs = get<double>(-std::numeric_limits<double>::max());
-    if (secs == -std::numeric_limits<double>::max()) {
+  // get access
+  std::string get(const size_t index, const char *defaultValue) {
+    if (index >= m_list->size())
+      return defaultValue;
+    auto &val = m_list->operator[](index);
+    return val.get(defaultValue);
+  }
+
+  // TODO: support std::shared_ptr<const T> getCustomType
+  template <typename T> T get(const size_t index, T defaultValue) const {
+    if (index >= m_list->size())
+      return defaultValue;
+    auto &val = m_list->operator[](index);
+    inheritCow(val);
+    return val.get(defaultValue);
+  }
+
+  // get access
+  const std::string get(const size_t index, const char *defaultValue) const {
+    if (index >= m_list->size())
+      return defaultValue;
+    auto &val = m_list->operator[](index);
+    return val.get(defaultValue);
+  }
+
+  /**
+   * \brief Borrow a string value without copying it (see KArgVariant::view).
+   * \param index The index to look up.
+   * \param defaultValue The view to return if the index is out of range or
+   * the value is not a string.
+   */
+  k_string_view view(const size_t index,
+                     k_string_view defaultValue = k_string_view()) const {
+    if (index >= m_list->size())
+      return defaultValue;
+    return (*m_list)[index].view(defaultValue);
+  }
+
+  /**
+   * \brief Borrow the elements of a std::vector<T> value (see
+   * KArgVariant::span).
+   * \param index The index to look up.
+   * \return The elements, or an empty span if the index is out of range or the
+   * value is not a std::vector<T>.
+   */
+  template <typename T> k_span<T> span(const size_t index) const {
+    if (index >= m_list->size())
+      return k_span<T>();
+    return (*m_list)[index].span<T>();
+  }
+
+#ifndef K_CUSTOM_TYPES_UNSUPPORTED
+  template <typename T>
+  T getCustomType(const size_t index, T defaultValue = T()) {
+    if (index >= m_list->size())
+      return defaultValue;
+    auto &val = m_list->operator[](index);
+    return val.getCustomType(defaultValue);
+  }
+
+  // TODO: support std::shared_ptr<const T> getCustomType
+  template <typename T>
+  const T getCustomType(const size_t index, T defaultValue = T()) const {
+    if (index >= m_list->size())
       return defaultValue;
+    auto &val = m_list->operator[](index);
+    return val.getCustomType(defaultValue);
+  }
+#endif
+
+  template <typename T>
+  typename std::enable_if<KArgMapInternal::is_k_type<T>::value, void>::type
+  set(const size_t index, T value) {
+    detach();
+    m_list->operator[](index) = std::move(value);
+  }
+
+  template <typename T>
+  void set(const size_t index, const std::shared_ptr<const T> value) {
+    static_assert(sizeof(T) != sizeof(T), "Cannot store const element.");
+  }
+
+  template <typename T> void set(const size_t index, std::vector<T> &&value) {
+    detach();
+    m_list->operator[](index) = std::move(value);
+  }
+
+  template <typename T> void set(const size_t index, std::vector<T> &value) {
+    static_assert(
+        sizeof(T) != sizeof(T),
+        "to set a std::vector, wrap with std::move or std::shared_ptr.");
+  }
+
+  operator std::string() const {
+    std::string s;
+    s.reserve(256);
+    KArgMapInternal::argListToString(s, *m_list);
+    return s;
+  }
+
+  size_t use_count() const noexcept { return m_list.use_count(); }
+
+  // delegated methods
+  size_t size() const { return m_list->size(); }
+
+  bool empty() const { return m_list->empty(); }
+
+  /// Deep comparison of the elements, see KArgVariant::operator==.
+  bool operator==(const KArgList &other) const {
+    return m_list == other.m_list ||
+           KArgMapInternal::argListEquals(*m_list, *other.m_list);
+  }
+
+  bool operator!=(const KArgList &other) const { return !(*this == other); }
+
+  /// A hash of the elements in order, recomputed on every call (see
+  /// KArgMap::hash()).
+  size_t hash() const { return KArgMapInternal::argListHash(*m_list); }
+
+  void clear() {
+    if (m_list->isCopyOnWrite() && m_list.use_count() > 1) {
+      m_list = KArgMapInternal::k_new_list(arena());
+      m_list->setCopyOnWrite();
+      return;
+    }
+    m_list->clear();
+  }
+
+  decltype(m_list->begin())
+  begin() K_NOEXCEPT { // return iterator for beginning of mutable sequence
+    return (m_list->begin());
+  }
+
+  decltype(m_list->begin()) begin() const
+      K_NOEXCEPT { // return iterator for beginning of nonmutable sequence
+    return (m_list->begin());
+  }
+
+  decltype(m_list->end())
+  end() K_NOEXCEPT { // return iterator for end of mutable sequence
+    return (m_list->end());
+  }
+
+  decltype(m_list->end())
+  end() const K_NOEXCEPT { // return iterator for end of nonmutable sequence
+    return (m_list->end());
+  }
+
+  void push_back(KArgVariant &&_Val) {
+    detach();
+    m_list->push_back(std::move(_Val));
+  }
+
+  void add(KArgVariant &&_Val) {
+    detach();
+    m_list->push_back(std::move(_Val));
+  }
+
+  template <typename T>
+  typename std::enable_if<KArgMapInternal::is_k_type<T>::value, void>::type
+  add(T value) {
+    detach();
+    m_list->emplace_back(std::move(value));
+  }
+
+  /**
+   * \brief Append a value constructed in place from value.
+   * \return The new element.
+   */
+  template <typename T>
+  typename std::enable_if<
+      KArgMapInternal::is_k_type<typename std::decay<T>::type>::value ||
+          std::is_same<typename std::decay<T>::type, KArgVariant>::value,
+      KArgVariant &>::type
+  emplace_back(T &&value) {
+    detach();
+    m_list->emplace_back(std::forward<T>(value));
+    return m_list->back();
+  }
+
+  template <typename T> void addCustomType(T value) {
+    auto ptr = std::make_shared<KArgCustomType<T>>(value);
+    detach();
+    m_list->push_back(std::move(ptr));
+  }
+
+  void removeAt(size_t index) {
+    if (index < m_list->size()) {
+      detach();
+      m_list->erase(m_list->begin() + index);
     }
-    return KDuration(std::chrono::nanoseconds(int64_t(secs * 1e9)));
   }
 
   /**
-   * \brief Get a typed value from the KArgMap
-   * \param defaultValue The value to return if the key is not present.
-   * \return
+   * \brief An O(1) copy-on-write clone.  The clone shares all storage with
+   * this list, which is marked copy-on-write: from then on every handle to it
+   * (and to the maps and lists below it) copies a shared list or map before
+   * modifying it, so a change never shows through another handle.  Only the
+   * containers along the modified path are copied.
+   *
+   * References and iterators reach the storage directly: modify values only
+   * through KArgList and KArgMap methods, or through references obtained after
+   * the modification that detached them.
    */
-  std::string get(const std::string &defaultValue) const {
-    if (m_type == KArgTypes::string) {
-      return std::string(m_value.string);
-    }
-    if (m_vector || m_type == KArgTypes::map || m_type == KArgTypes::list) {
-      return defaultValue;
-    }
-    return scalar_to_string();
+  KArgList cowClone() const {
+    m_list->setCopyOnWrite();
+    return *this;
   }
 
-  std::string get(const char *defaultValue) const {
-    if (m_type == KArgTypes::string) {
-      return std::string(m_value.string);
+  /// True if the storage is copied before it is modified while shared.
+  bool isCopyOnWrite() const { return m_list->isCopyOnWrite(); }
+
+  KArgList deepClone() const {
+    KArgList result = KArgMapInternal::k_arg_list_clone(m_list);
+    return result;
+  }
+
+  /// A deep copy placed in arena.
+  KArgList deepClone(KArgArena &arena) const {
+    KArgList result = KArgMapInternal::k_arg_list_clone(m_list, &arena);
+    return result;
+  }
+
+  /// The arena holding this list, nullptr if it is on the heap.
+  KArgArena *arena() const { return m_list->get_allocator().arena(); }
+
+private:
+  /// In copy-on-write mode, replace shared storage by a private copy.
+  void detach() {
+    if (m_list->isCopyOnWrite() && m_list.use_count() > 1) {
+      m_list = KArgMapInternal::k_copy_list(*m_list);
     }
-    if (m_vector || m_type == KArgTypes::map || m_type == KArgTypes::list) {
-      return std::string(defaultValue);
+  }
+
+  /// Maps and lists below copy-on-write storage are copy-on-write too.
+  void inheritCow(const KArgVariant &child) const {
+    if (m_list->isCopyOnWrite()) {
+      KArgMapInternal::k_mark_cow(child);
     }
-    return scalar_to_string();
   }
 
-  //    /**
-  //    * \brief Get a typed value from the KArgMap
-  //    * \param defaultValue The value to return if the key is not present.
-  //    * \return
-  //    */
-  //    KArgMap get(KArgMap& defaultValue)
-  //    {
-  //        if (m_type == KArgTypes::map)
-  //        {
-  //            return m_value.map;
-  //        }
-  //        return defaultValue;
-  //    }
+public:
 
-  /**
-   * \brief Get a typed value from the KArgMap
-   * \param defaultValue The value to return if the key is not present.
-   * \return
-   */
-  k_arg_map_ptr get(k_arg_map_ptr defaultValue) {
-    if (m_type == KArgTypes::map) {
-      return *reinterpret_cast<k_arg_map_ptr *>(&m_value);
+  friend inline std::ostream &operator<<(std::ostream &o, const KArgList &arg);
+}; // KArgList
+
+inline std::ostream &operator<<(std::ostream &o, const KArgList &arg) {
+  o << arg.m_list;
+  return o;
+}
+
+class KArgMap : public KMapBase {
+  friend class KArgList;
+  friend class KArgMapTest;
+  friend class KArgMapSerializer;
+  friend class KArgPersistentMap;
+  friend class KArgInternStore;
+  friend class KArgStringPool;
+  friend class KArgConcurrentMap;
+
+public:
+  KArgMap() { m_map = KArgMapInternal::k_make_ptr<k_arg_map_ptr>(); }
+
+  /// An empty map placed in arena (see KArgArena).  Maps and lists created
+  /// by paths below it are placed in the same arena.
+  explicit KArgMap(KArgArena &arena) {
+    m_map = KArgMapInternal::k_new_map(&arena);
+  }
+
+  KArgMap(std::initializer_list<std::pair<const std::string, KArgVariant>> l) {
+    m_map = KArgMapInternal::k_make_ptr<k_arg_map_ptr>(l);
+  }
+
+  KArgMap(KArgVariant &v) {
+    if (v.m_type == KArgTypes::map) {
+      m_map = v.m_value.map;
+    } else {
+      m_map = KArgMapInternal::k_make_ptr<k_arg_map_ptr>();
     }
-    return defaultValue;
   }
 
-  /**
-   * \brief Get a typed value from the KArgList
-   * \param defaultValue The value to return if the key is not present.
-   * \return
-   */
-  k_arg_list_ptr get(k_arg_list_ptr defaultValue) {
-    if (m_type == KArgTypes::list) {
-      return m_value.list;
+  void add(std::initializer_list<std::pair<const std::string, KArgVariant>> l) {
+    detach();
+    m_map->insert(l.begin(), l.end());
+  }
+
+  bool containsKey(const KArgKey &key) const {
+    if (key.compiled()) {
+      return findPath(*key.compiled(), false) != nullptr;
     }
-    return defaultValue;
+    return !(findKey(key) == m_map->end());
   }
 
-  /**
-   * \brief Get a typed value from the KArgList
-   * \param defaultValue The value to return if the key is not present.
-   * \return
-   */
+  // String get methods with both const char * and std::string
   template <typename T>
-  std::shared_ptr<T> get(std::shared_ptr<T> defaultValue) {
-    if (m_vector) {
-      auto vec = *reinterpret_cast<std::shared_ptr<T> *>(&m_value);
+  typename std::enable_if<(std::is_same<T, const char *>::value ||
+                           std::is_same<T, std::string>::value),
+                          std::string>::type
+  get(const KArgKey &key, T defaultValue) const {
+    return const_cast<KArgMap *>(this)->get_impl<std::string>(key,
+                                                              defaultValue);
+  }
 
-      auto tc = KArgMapInternal::k_type_info<typename T::value_type>::type_code;
-      if (tc != m_type) {
-        // std::cerr << "Cannot convert requested std::vector types.\n";
-        return defaultValue;
-      }
-      return vec;
+  template <typename T>
+  typename std::enable_if<(std::is_same<T, const char *>::value ||
+                           std::is_same<T, std::string>::value),
+                          std::string>::type
+  get(const KArgKey &key, T defaultValue) {
+    return get_impl<std::string>(key, defaultValue);
+  }
+
+  template <typename T>
+  typename std::enable_if<std::is_same<T, KArgMap>::value, KArgMap>::type
+  get(const KArgKey &key, T defaultValue) {
+    bool cow = false;
+    auto item = findItem(key, &cow);
+    if (!item) {
+      return defaultValue;
+    }
+    if (cow) {
+      KArgMapInternal::k_mark_cow(*item);
     }
+    KArgMap result = get_item(*item, defaultValue.m_map);
+    return result;
+  }
 
-    if (m_type == KArgTypes::list || m_type == KArgTypes::map) {
-      auto vec = *reinterpret_cast<std::shared_ptr<T> *>(&m_value);
-      return vec;
+  template <typename T>
+  typename std::enable_if<std::is_same<T, KArgMap>::value, const KArgMap>::type
+  get(const KArgKey &key, T defaultValue) const {
+    return const_cast<KArgMap *>(this)->get<T>(key, defaultValue);
+  }
+
+  template <typename T>
+  typename std::enable_if<std::is_same<T, KArgList>::value, KArgList>::type
+  get(const KArgKey &key, T defaultValue) {
+    bool cow = false;
+    auto item = findItem(key, &cow);
+    if (!item) {
+      return defaultValue;
+    }
+    if (cow) {
+      KArgMapInternal::k_mark_cow(*item);
     }
+    KArgList result = get_item(*item, defaultValue.m_list);
+    return result;
+  }
 
-    return defaultValue;
+  template <typename T>
+  typename std::enable_if<std::is_same<T, KArgList>::value,
+                          const KArgList>::type
+  get(const KArgKey &key, T defaultValue) const {
+    return const_cast<KArgMap *>(this)->get<T>(key, defaultValue);
   }
 
-  template <typename T> std::string as_string() const {
-    char buf[30];
-    T val = as<T>();
-    snprintf(buf, sizeof(buf) - 1, KArgMapInternal::k_type_info<T>::format,
-             val);
-    return std::string(buf);
+  /**
+   * \brief Get a typed value from the KArgMap.
+   * \tparam T The type to return.
+   * \param key The key name to look up.
+   * \param defaultValue The value to return if the key is not present.
+   * \return The value associated with key or the default value parameter.
+   */
+  template <typename T>
+  typename std::enable_if<(!std::is_class<T>::value &&
+                           !std::is_pointer<T>::value) ||
+                              std::is_same<T, std::complex<float>>::value ||
+                              std::is_same<T, std::complex<double>>::value ||
+                              std::is_same<T, KTimestamp>::value ||
+                              std::is_same<T, KDuration>::value,
+                          T>::type
+  get(const KArgKey &key, T defaultValue) {
+    return get_impl(key, defaultValue);
   }
 
-#ifndef K_CUSTOM_TYPES_UNSUPPORTED
-  template <typename T> T getCustomType(T defaultValue = T()) {
-    if (m_type == KArgTypes::map) {
-      // Is there a converter registered?
-      KArgVariant v = KArgMapInternal::argMapToCustomType(KARG_TYPE_ID_NAME(T),
-                                                          m_value.map);
-      if (v.m_type != KArgTypes::custom)
-        return defaultValue;
-      auto ptr =
-          *reinterpret_cast<std::shared_ptr<KArgCustomType<T>> *>(&v.m_value);
-      return ptr->m_value;
-    }
-    if (m_type != KArgTypes::custom)
-      return defaultValue;
-    auto ptr =
-        *reinterpret_cast<std::shared_ptr<KArgCustomType<T>> *>(&m_value);
-    if (ptr->m_name != KARG_TYPE_ID_NAME(T))
-      return defaultValue;
-    return ptr->m_value;
+  template <typename T>
+  typename std::enable_if<(!std::is_class<T>::value), T>::type
+  get(const KArgKey &key) {
+    static_assert(sizeof(T) != sizeof(T),
+                  "Get operations require a default value to be provided.");
+    return const_cast<KArgMap *>(this)->get_impl(key, T(0));
   }
-#endif
 
-  std::string scalar_to_string() const {
-    switch (m_type) {
-    case KArgTypes::int8:
-      return KArgMapInternal::to_string(m_value.int8);
-    case KArgTypes::int16:
-      return KArgMapInternal::to_string(m_value.int16);
-    case KArgTypes::int32:
-      return KArgMapInternal::to_string(m_value.int32);
-    case KArgTypes::int64:
-      return KArgMapInternal::to_string(m_value.int64);
-    case KArgTypes::uint8:
-      return KArgMapInternal::to_string(m_value.uint8);
-    case KArgTypes::uint16:
-      return KArgMapInternal::to_string(m_value.uint16);
-    case KArgTypes::uint32:
-      return KArgMapInternal::to_string(m_value.uint32);
-    case KArgTypes::uint64:
-      return KArgMapInternal::to_string(m_value.uint64);
-    case KArgTypes::float32:
-      return KArgMapInternal::to_string(m_value.float32);
-    case KArgTypes::float64:
-      return KArgMapInternal::to_string(m_value.float64);
-    case KArgTypes::cfloat32:
-      return KArgMapInternal::to_string(m_value.cfloat32);
-    case KArgTypes::cfloat64:
-      return KArgMapInternal::to_string(m_value.cfloat64);
-    case KArgTypes::timestamp:
-      return KArgMapInternal::to_string(m_value.timestamp.time_since_epoch());
-    case KArgTypes::duration:
-      return KArgMapInternal::to_string(m_value.duration);
-    default:
-      return "";
-    }
+  /**
+   * \brief Get a typed value from the KArgMap.
+   * \tparam T The type to return.
+   * \param key The key name to look up.
+   * \param defaultValue The value to return if the key is not present.
+   * \return The value associated with key or the default value parameter.
+   */
+  template <typename T>
+  typename std::enable_if<(!std::is_class<T>::value &&
+                           !std::is_pointer<T>::value) ||
+                              std::is_same<T, std::complex<float>>::value ||
+                              std::is_same<T, std::complex<double>>::value ||
+                              std::is_same<T, KTimestamp>::value ||
+                              std::is_same<T, KDuration>::value,
+                          T>::type
+  get(const KArgKey &key, T defaultValue) const {
+    return const_cast<KArgMap *>(this)->get_impl(key, defaultValue);
   }
 
-  operator std::string() const {
-    switch (m_type) {
-    case KArgTypes::string:
-      return std::string(m_value.string);
-    default:
-      std::string s;
-      s.reserve(256);
-      KArgMapInternal::argVariantToString(s, *this);
-      return s;
-    }
+  template <typename T>
+  typename std::enable_if<(!std::is_class<T>::value ||
+                           std::is_same<std::string, T>::value),
+                          T>::type
+  get(const KArgKey &key) const {
+    static_assert(sizeof(T) != sizeof(T),
+                  "Get operations require a default value to be provided.");
+    return const_cast<KArgMap *>(this)->get_impl(key, T(0));
   }
 
   /**
-   * \brief cast the value held in KArgVariant to the specified type.  Use of
-   * this method is discouraged due to lack of type safety and should only be
-   * used by serializers.
-   *
-   * Usage: val.as<int32_t>()
+   * \brief Get a typed value from the KArgMap for a type that returns a smart
+   * pointer. \tparam T The type to return. \param key The key name to look up.
+   * \param defaultValue The value to return if the key is not present.  Default
+   * is an empty smart pointer. \return The value associated with key or the
+   * default value parameter.
    */
-  template <typename T> T as() const {
-    return *reinterpret_cast<const T *>(&m_value);
+  template <typename T>
+  typename std::enable_if<!std::is_same<std::string, T>::value &&
+                              std::is_class<T>::value,
+                          std::shared_ptr<T>>::type
+  get(const KArgKey &key,
+      std::shared_ptr<T> defaultValue = std::make_shared<T>()) {
+    return get_impl(key, defaultValue);
   }
 
-private:
-  // Conversions helpers
-  template <typename SourceType, typename DestType,
-            typename std::enable_if<(std::is_signed<SourceType>::value)>::type
-                * = nullptr>
-  DestType convert_number_with_default_mixed_sign(SourceType value,
-                                                  DestType defaultValue)
-      const { // std::cout << "signed source, unsiged dest\n";
-    if (value < 0)
+  template <typename T>
+  typename std::enable_if<!std::is_same<std::string, T>::value &&
+                              std::is_class<T>::value,
+                          std::shared_ptr<const T>>::type
+  get(const KArgKey &key, std::shared_ptr<const T> defaultValue =
+                                  std::make_shared<const T>()) const {
+    // hokey workaround as I couldn't figure hot to cast to std::shared_ptr<T>
+    // for get_impl call
+    auto x = std::make_shared<T>();
+    auto value =
+        const_cast<KArgMap *>(this)->get_impl<std::shared_ptr<T>>(key, x);
+    if (x == value)
       return defaultValue;
-    return (typename std::make_unsigned<DestType>::type(value) >
-            std::numeric_limits<DestType>::max())
-               ? defaultValue
-               : DestType(value);
+    return value;
   }
 
-  template <typename SourceType, typename DestType,
-            typename std::enable_if<
-                (std::is_unsigned<SourceType>::value &&
-                 std::is_floating_point<DestType>::value)>::type * = nullptr>
-  DestType convert_number_with_default_mixed_sign(SourceType value,
-                                                  DestType defaultValue)
-      const { // std::cout << "unsigned source, floating dest\n";
-    return DestType(value);
+  /**
+   * \brief Borrow a string value without copying it (see KArgVariant::view).
+   * \param key The key or path to look up.
+   * \param defaultValue The view to return if the key is not present or the
+   * value is not a string.
+   * \return The stored characters, valid until this map adds or removes keys
+   * or the value is modified.
+   */
+  k_string_view view(const KArgKey &key,
+                     k_string_view defaultValue = k_string_view()) const {
+    auto item = findItem(key);
+    return item ? item->view(defaultValue) : defaultValue;
   }
 
-  template <typename SourceType, typename DestType,
-            typename std::enable_if<
-                (std::is_unsigned<SourceType>::value &&
-                 !std::is_floating_point<DestType>::value)>::type * = nullptr>
-  DestType convert_number_with_default_mixed_sign(SourceType value,
-                                                  DestType defaultValue)
-      const { // std::cout << "unsigned source, signed non float dest\n";
-    return (value > typename std::make_unsigned<DestType>::type(
-                        std::numeric_limits<DestType>::max()))
-               ? defaultValue
-               : DestType(value);
+  /**
+   * \brief Borrow the elements of a std::vector<T> value without copying it
+   * or its shared_ptr (see KArgVariant::span).
+   * \param key The key or path to look up.
+   * \return The elements, or an empty span if the key is not present or the
+   * value is not a std::vector<T>.  Valid until the value is modified or
+   * removed.
+   */
+  template <typename T> k_span<T> span(const KArgKey &key) const {
+    auto item = findItem(key);
+    return item ? item->span<T>() : k_span<T>();
   }
 
-  //=============================================
-  template <typename SourceType, typename DestType,
-            typename std::enable_if<(std::is_unsigned<SourceType>::value ==
-                                     std::is_unsigned<DestType>::value)>::type
-                * = nullptr>
-  DestType convert_number_with_default_signed_check(
-      SourceType value,
-      DestType defaultValue) const { // std::cout << "same sign\n";
-    return (value > std::numeric_limits<DestType>::max() ||
-            value < std::numeric_limits<DestType>::lowest())
-               ? defaultValue
-               : DestType(value);
+  KArgVariant &operator[](const KArgKey &key) {
+    // Beware, the array operator will create a key entry if it does not exist.
+    auto item = slot(key);
+    return item ? *item : NullKArgVariant::Instance();
   }
 
-  template <typename SourceType, typename DestType,
-            typename std::enable_if<(std::is_unsigned<SourceType>::value !=
-                                     std::is_unsigned<DestType>::value)>::type
-                * = nullptr>
-  DestType convert_number_with_default_signed_check(
-      SourceType value,
-      DestType defaultValue) const { // dispatch to mixed sign checks
-    return convert_number_with_default_mixed_sign(value, defaultValue);
+  /// The value of key or path, a null value if it is not present.  Unlike
+  /// the non-const operator the map is never modified, so concurrent reads
+  /// are safe.
+  const KArgVariant &operator[](const KArgKey &key) const {
+    auto item = findItem(key);
+    return item ? *item : NullKArgVariant::Instance();
   }
 
-  //=============================
-  template <typename SourceType, typename DestType,
-            typename std::enable_if<
-                (std::is_same<SourceType, DestType>::value)>::type * = nullptr>
-  DestType convert_number_with_default(SourceType value, DestType defaultValue)
-      const { // std::cout << "same type\n";
-    return DestType(value);
+  // Set operations
+
+#if 0
+            template <typename T>
+            void set(const std::string& key, T value) const
+            {
+                static_assert(always_false<T>::value, "Cannot set values in a const container");
+            }
+#endif
+
+  template <typename T>
+  typename std::enable_if<KArgMapInternal::is_k_type<T>::value, void>::type
+  set(const KArgKey &key, T value) {
+    if (auto item = setSlot(key)) {
+      *item = std::move(value);
+    }
   }
 
-  template <typename SourceType, typename DestType,
-            typename std::enable_if<
-                (!std::is_same<SourceType, DestType>::value &&
-                 std::is_same<DestType, bool>::value)>::type * = nullptr>
-  DestType convert_number_with_default(SourceType value, DestType defaultValue)
-      const { // std::cout << "dest bool\n";
-    return DestType(value != 0);
+  /**
+   * \brief Store value under key, moving it when passed an rvalue, unless key
+   * already holds a value.  As with std::unordered_map::emplace an existing
+   * value is kept; use set() to replace it.  value is not moved from if it is
+   * not stored.
+   * \return The value held by key, and true if value was stored.  A path
+   * through a value that is not a map or list stores nothing and returns a
+   * null value.
+   */
+  template <typename T>
+  typename std::enable_if<
+      KArgMapInternal::is_k_type<typename std::decay<T>::type>::value ||
+          std::is_same<typename std::decay<T>::type, KArgVariant>::value,
+      std::pair<KArgVariant &, bool>>::type
+  emplace(const KArgKey &key, T &&value) {
+    KArgVariant *item = setSlot(key);
+    if (!item) {
+      return std::pair<KArgVariant &, bool>(NullKArgVariant::Instance(), false);
+    }
+    if (item->m_type != KArgTypes::null) {
+      return std::pair<KArgVariant &, bool>(*item, false);
+    }
+    *item = std::forward<T>(value);
+    return std::pair<KArgVariant &, bool>(*item, true);
   }
 
-  template <typename SourceType, typename DestType,
-            typename std::enable_if<
-                (!std::is_same<SourceType, DestType>::value &&
-                 std::is_same<SourceType, bool>::value)>::type * = nullptr>
-  DestType convert_number_with_default(SourceType value, DestType defaultValue)
-      const { // std::cout << "src bool\n";
-    return DestType(value ? 1 : 0);
+  /**
+   * \brief Store value under key only if key does not already hold a value.
+   * \return True if the value was stored.
+   */
+  template <typename T>
+  typename std::enable_if<
+      KArgMapInternal::is_k_type<typename std::decay<T>::type>::value ||
+          std::is_same<typename std::decay<T>::type, KArgVariant>::value,
+      bool>::type
+  try_emplace(const KArgKey &key, T &&value) {
+    return emplace(key, std::forward<T>(value)).second;
   }
 
-  template <typename SourceType, typename DestType,
-            typename std::enable_if<
-                (!std::is_same<SourceType, DestType>::value &&
-                 !std::is_same<bool, DestType>::value &&
-                 !std::is_same<SourceType, bool>::value)>::type * = nullptr>
-  DestType convert_number_with_default(SourceType value, DestType defaultValue)
-      const { // dispatch to signed checks
-    return convert_number_with_default_signed_check(value, defaultValue);
+  template <typename T>
+  void set(const KArgKey &key, const std::shared_ptr<const T> value) {
+    static_assert(sizeof(T) != sizeof(T), "Cannot store const element.");
   }
 
-  //===========================================
+  template <typename T>
+  void set(const KArgKey &key, std::vector<T> &&value) {
+    if (auto item = slot(key)) {
+      *item = std::move(value);
+    }
+  }
 
-  template <typename SourceType, typename DestType>
-  DestType convert_number(DestType defaultValue) const {
-    auto val = *reinterpret_cast<const SourceType *>(&m_value);
-    return convert_number_with_default(val, defaultValue);
+  template <typename T>
+  void set(const KArgKey &key, std::vector<T> &value) {
+    static_assert(
+        sizeof(T) != sizeof(T),
+        "to set a std::vector, wrap with std::move or std::shared_ptr.");
   }
 
-  template <typename T> void vec_reset() {
-    typedef std::shared_ptr<std::vector<T>> VecType;
-    VecType *vec = reinterpret_cast<VecType *>(&m_value);
-    vec->reset();
-    vec->~VecType();
-    // http://stackoverflow.com/questions/11988209/call-explicit-constructor-destructor-with-traits-in-templatized-function
+#ifndef K_CUSTOM_TYPES_UNSUPPORTED
+  template <typename T> void setCustomType(const KArgKey &key, T value) {
+    if (auto item = slot(key)) {
+      *item = std::make_shared<KArgCustomType<T>>(value);
+    }
   }
 
-  void reset() {
-    if (m_type == KArgTypes::null)
-      return;
-    if (m_vector) {
-      switch (m_type) {
-      case KArgTypes::int8:
-        return vec_reset<int8_t>();
-      case KArgTypes::int16:
-        return vec_reset<int16_t>();
-      case KArgTypes::int32:
-        return vec_reset<int32_t>();
-      case KArgTypes::int64:
-        return vec_reset<int64_t>();
-      case KArgTypes::uint8:
-        return vec_reset<uint8_t>();
-      case KArgTypes::uint16:
-        return vec_reset<uint16_t>();
-      case KArgTypes::uint32:
-        return vec_reset<uint32_t>();
-      case KArgTypes::uint64:
-        return vec_reset<uint64_t>();
-      case KArgTypes::float32:
-        return vec_reset<float>();
-      case KArgTypes::float64:
-        return vec_reset<double>();
-      case KArgTypes::cfloat32:
-        return vec_reset<std::complex<float>>();
-      case KArgTypes::cfloat64:
-        return vec_reset<std::complex<double>>();
-      case KArgTypes::string:
-        return vec_reset<std::string>();
-      case KArgTypes::map:
-        return vec_reset<k_arg_map_type>();
-      case KArgTypes::list:
-        return vec_reset<k_arg_list_type>();
-      default:
-        break;
-      }
+  template <typename T>
+  T getCustomType(const KArgKey &key, T defaultValue = T()) {
+    KArgVariant *item = nullptr;
+    if (key.compiled()) {
+      item = findPath(*key.compiled(), false);
     } else {
-      switch (m_type) {
-      case KArgTypes::map: {
-        m_value.map.~k_arg_map_ptr();
-        break;
-      }
-      case KArgTypes::list: {
-        m_value.list.~k_arg_list_ptr();
-        break;
-      }
-      case KArgTypes::custom: {
-        m_value.custom.~k_arg_custom_ptr();
-        break;
-      }
-      case KArgTypes::string: {
-        m_value.string.~k_map_string_t();
-        break;
-      }
-      default:
-        break;
-      }
+      auto val = findKey(key);
+      item = val == m_map->end() ? nullptr : &val->second;
     }
-    m_type = KArgTypes::null;
+    if (!item || (item->m_type != KArgTypes::custom &&
+                  item->m_type != KArgTypes::map))
+      return defaultValue;
+    return item->getCustomType(defaultValue);
   }
-}; // KArgVariant
-
-///< A null KArgVariant for internal use
-typedef KArgMapInternal::Singleton<KArgVariant> NullKArgVariant;
+#endif
 
-template <typename T>
-void vec_string(std::string &s, const KArgVariant &val,
-                bool addQuotes = false) {
-  const auto &vec =
-      *reinterpret_cast<const std::shared_ptr<std::vector<T>> *>(&val.m_value);
-  s.append("[");
-  for (size_t i = 0; i < vec->size(); ++i) {
-    if (i != 0)
-      s.append(",");
-    if (addQuotes)
-      s.append("\"");
-    s.append(KArgMapInternal::to_string((*vec)[i]));
-    if (addQuotes)
-      s.append("\"");
-  }
-  s.append("]");
-}
+  // to string support
+  operator std::string() const { return to_string(); }
 
-template <typename T>
-void vec_string_iter(std::string &s, const KArgVariant &val,
-                     std::function<void(T &)> func) {
-  const auto &vec =
-      *reinterpret_cast<const std::shared_ptr<std::vector<T>> *>(&val.m_value);
-  s.append("[");
-  for (size_t i = 0; i < vec->size(); ++i) {
-    if (i != 0)
-      s.append(",");
-    auto element = (*vec)[i];
-    func(element);
+  std::string to_string() const {
+    std::string s;
+    s.reserve(256);
+    KArgMapInternal::argMapToString(s, *m_map);
+    return s;
   }
-  s.append("]");
-}
 
-namespace KArgMapInternal {
-inline void argListToString(std::string &s, const k_arg_list_type &list) {
-  s.append("[");
-  bool first = true;
-  for (auto const &item : list) {
-    if (!first) {
-      s.append(",");
+  // delegated methods
+  size_t erase(const KArgKey &key) const {
+    k_arg_map_type *map = m_map.get();
+    KArgKey last = key;
+    KArgVariant *parent = nullptr;
+    bool cow = m_map->isCopyOnWrite();
+    if (key.compiled()) {
+      // erase the last segment from the map holding it
+      auto &segments = key.compiled()->m_segments;
+      parent = segments.size() > 1 ? findPath(*key.compiled(), false,
+                                              segments.size() - 1, &cow)
+                                   : nullptr;
+      if (parent) {
+        cow = cow || KArgMapInternal::k_is_cow(*parent);
+      }
+      if (segments.size() > 1 &&
+          (!parent || parent->m_type != KArgTypes::map || parent->m_vector)) {
+        return 0;
+      }
+      if (parent) {
+        map = parent->m_value.map.get();
+      }
+      last = KArgKey(segments.back().key, segments.back().hash);
     }
-    first = false;
-    KArgMapInternal::argVariantToString(s, item);
+    auto val = findIn(*map, last);
+    if (val == map->end()) {
+      return 0;
+    }
+    if (cow) {
+      // walk the path again copying the shared containers leading to the key
+      const_cast<KArgMap *>(this)->detach();
+      map = m_map.get();
+      if (parent) {
+        parent = findPath(*key.compiled(), true,
+                          key.compiled()->m_segments.size() - 1);
+        unshare(*parent);
+        map = parent->m_value.map.get();
+      }
+      val = findIn(*map, last);
+    }
+    map->erase(val);
+    return 1;
   }
-  s.append("]");
-}
 
-inline void argMapToString(std::string &s, const k_arg_map_type &map) {
-  s.append("{");
-  bool first = true;
-  for (auto const &item : map) {
-    if (item.second.m_type == KArgTypes::null) {
-      continue;
-    }
-    s.append(first ? "\"" : ", \"");
-    first = false;
-    s.append(item.first);
-    s.append("\":");
-    KArgMapInternal::argVariantToString(s, item.second);
+  size_t size() const { return m_map->size(); }
+
+  bool empty() const { return m_map->empty(); }
+
+  /// Deep comparison of keys and values, see KArgVariant::operator==.
+  bool operator==(const KArgMap &other) const {
+    return m_map == other.m_map ||
+           KArgMapInternal::argMapEquals(*m_map, *other.m_map);
   }
-  s.append("}");
-}
 
-inline void argVariantToString(std::string &s, const KArgVariant &val) {
-  if (val.m_vector) {
-    switch (val.m_type) {
-    case KArgTypes::boolean: {
-      const auto &vec =
-          *reinterpret_cast<const std::shared_ptr<std::vector<bool>> *>(
-              &val.m_value);
-      s.append("[");
-      for (size_t i = 0; i < vec->size(); ++i) {
-        if (i != 0)
-          s.append(",");
-        s.append((*vec)[i] ? "true" : "false");
-      }
+  bool operator!=(const KArgMap &other) const { return !(*this == other); }
 
-      s.append("]");
+  /**
+   * \brief A hash of the contents, independent of the order of the keys.
+   * It walks the whole tree on every call.  Nothing is cached because values
+   * can be changed through references and iterators, which the map never
+   * sees, so a stored hash could not be invalidated reliably.
+   */
+  size_t hash() const { return KArgMapInternal::argMapHash(*m_map); }
+
+  void clear() {
+    if (m_map->isCopyOnWrite() && m_map.use_count() > 1) {
+      m_map = KArgMapInternal::k_new_map(arena());
+      m_map->setCopyOnWrite();
       return;
     }
-    case KArgTypes::int8:
-      return vec_string<int8_t>(s, val);
-    case KArgTypes::int16:
-      return vec_string<int16_t>(s, val);
-    case KArgTypes::int32:
-      return vec_string<int32_t>(s, val);
-    case KArgTypes::int64:
-      return vec_string<int64_t>(s, val);
-    case KArgTypes::uint8:
-      return vec_string<uint8_t>(s, val);
-    case KArgTypes::uint16:
-      return vec_string<uint16_t>(s, val);
-    case KArgTypes::uint32:
-      return vec_string<uint32_t>(s, val);
-    case KArgTypes::uint64:
-      return vec_string<uint64_t>(s, val);
-    case KArgTypes::float32:
-      return vec_string<float>(s, val);
-    case KArgTypes::float64:
-      return vec_string<double>(s, val);
-    case KArgTypes::cfloat32:
-      return vec_string<std::complex<float>>(s, val, true);
-    case KArgTypes::cfloat64:
-      return vec_string<std::complex<double>>(s, val, true);
-    case KArgTypes::timestamp:
-      return vec_string<KTimestamp>(s, val);
-    case KArgTypes::duration:
-      return vec_string<KDuration>(s, val);
-    case KArgTypes::string:
-      return vec_string<std::string>(s, val, true);
-    case KArgTypes::map:
-      return vec_string_iter<KMapBase>(
-          s, val, [&s](KMapBase &v) { argMapToString(s, *v.m_map); });
-    case KArgTypes::list:
-      return vec_string_iter<KListBase>(
-          s, val, [&s](KListBase &v) { argListToString(s, *v.m_list); });
-    default:
-      break;
-    }
-    return;
-  }
-  switch (val.m_type) {
-  case KArgTypes::null:
-    s.append("null");
-    break;
-  case KArgTypes::map: {
-    auto map = val.m_value.map;
-    argMapToString(s, *map);
-    break;
+    m_map->clear();
   }
 
-  case KArgTypes::list: {
-    argListToString(s, *val.m_value.list);
-    break;
+  decltype(m_map->begin())
+  begin() K_NOEXCEPT { // return iterator for beginning of mutable sequence
+    return (m_map->begin());
   }
 
-  case KArgTypes::string: {
-    s.append("\"");
-    s.append(val.m_value.string);
-    s.append("\"");
-    break;
+  decltype(m_map->begin()) begin() const
+      K_NOEXCEPT { // return iterator for beginning of nonmutable sequence
+    return (m_map->begin());
   }
 
-  case KArgTypes::boolean: {
-    s.append(val.m_value.boolean ? "true" : "false");
-    break;
+  decltype(m_map->end())
+  end() K_NOEXCEPT { // return iterator for end of mutable sequence
+    return (m_map->end());
   }
-  case KArgTypes::custom: {
-    argMapToString(s, *customArgToString(val));
-    break;
+
+  decltype(m_map->end())
+  end() const K_NOEXCEPT { // return iterator for end of nonmutable sequence
+    return (m_map->end());
   }
-  default:
-    s.append(val.scalar_to_string());
-    break;
+
+  size_t use_count() const K_NOEXCEPT { return m_map.use_count(); }
+
+  KArgMap deepClone() const {
+    KArgMap map = KArgMapInternal::k_arg_map_clone(m_map);
+    return map;
   }
-}
-} // namespace KArgMapInternal
 
-inline std::ostream &operator<<(std::ostream &o, const k_arg_list_ptr val) {
-  if (val) {
-    std::string s;
-    s.reserve(256);
-    KArgMapInternal::argListToString(s, *val);
-    o << s;
-  } else {
-    o << std::string("[]");
+  /// A deep copy placed in arena.
+  KArgMap deepClone(KArgArena &arena) const {
+    KArgMap map = KArgMapInternal::k_arg_map_clone(m_map, &arena);
+    return map;
   }
-  return o;
-}
 
-inline std::ostream &operator<<(std::ostream &o, const k_arg_map_ptr val) {
-  if (val) {
-    std::string s;
-    s.reserve(256);
-    KArgMapInternal::argMapToString(s, *val);
-    o << s;
-  } else {
-    o << std::string("{}");
+  /// The arena holding this map, nullptr if it is on the heap.
+  KArgArena *arena() const { return m_map->get_allocator().arena(); }
+
+  /**
+   * \brief An O(1) copy-on-write clone.  The clone shares all storage with
+   * this map, which is marked copy-on-write: from then on every handle to it,
+   * including this one and handles copied from it earlier, and every handle
+   * to the maps and lists below it copies a shared map or list before
+   * modifying it, so a change never shows through another handle.  set(),
+   * operator[], erase(), clear() and path creation copy only the containers
+   * along the modified path.  The mark is kept with the storage, so handles
+   * stay the size of a pointer.
+   *
+   * References and iterators reach the storage directly: modify values only
+   * through KArgMap and KArgList methods, or through references obtained after
+   * the modification that detached them.  A child handle from get() is a
+   * snapshot too: modifying it copies the child without changing this map,
+   * so modify nested values through paths on this map.
+   */
+  KArgMap cowClone() const {
+    m_map->setCopyOnWrite();
+    return *this;
   }
-  return o;
-}
 
-class KArgList : public KListBase {
-  friend class KArgMap;
-  friend class KArgMapTest;
-  friend class KArgMapSerializer;
+  /// True if the storage is copied before it is modified while shared.
+  bool isCopyOnWrite() const { return m_map->isCopyOnWrite(); }
 
-  KArgList(std::shared_ptr<k_arg_list_type> list) { m_list = list; }
+protected:
+  KArgMap(k_arg_map_ptr map) { m_map = map; }
 
-public:
-  KArgList() { m_list = std::make_shared<k_arg_list_type>(); }
+private:
+  /**
+   * \brief Find a key without allocating.  With K_FLAT_HASH_MAP the hash
+   * carried by the key is used as is.
+   */
+  static k_arg_map_type::iterator findIn(k_arg_map_type &map,
+                                         const KArgKey &key) {
+#ifdef K_FLAT_HASH_MAP
+    return map.find_hashed(key);
+#elif defined(K_ALLOCATION_FREE_LOOKUP)
+    return map.find(key.view());
+#else
+    if (key.string()) {
+      return map.find(*key.string());
+    }
+#ifdef K_THREAD_LOCAL_UNSUPPORTED
+    return map.find(key.str());
+#else
+    auto &buffer = KArgMapInternal::k_key_buffer();
+    buffer.assign(key.data(), key.size());
+    return map.find(buffer);
+#endif
+#endif
+  }
 
-  KArgList(std::initializer_list<KArgVariant> l) {
-    m_list = std::make_shared<k_arg_list_type>(l);
+  k_arg_map_type::iterator findKey(const KArgKey &key) const {
+    return findIn(*m_map, key);
   }
 
-  KArgList(KArgVariant &v) {
-    if (v.m_type == KArgTypes::list) {
-      m_list = v.m_value.list;
-    } else {
-      m_list = std::make_shared<k_arg_list_type>();
+  /**
+   * \brief Find a key in map, inserting a null entry if createPath is true.
+   * \param cache The path segment remembering where the key was last found,
+   * or nullptr.
+   * \return The entry's value or nullptr if absent.
+   */
+  static KArgVariant *mapStep(k_arg_map_type &map, const KArgKey &key,
+                              bool createPath,
+                              const KArgPath::Segment *cache = nullptr) {
+#ifdef K_FLAT_HASH_MAP
+    if (cache && cache->cacheMap == &map && cache->cacheSlot < map.size()) {
+      auto &entry = *(map.begin() + cache->cacheSlot);
+      if (entry.first.size() == key.size() &&
+          std::memcmp(entry.first.data(), key.data(), key.size()) == 0) {
+        return &entry.second;
+      }
+    }
+#endif
+    auto val = findIn(map, key);
+    if (val == map.end()) {
+      if (!createPath) {
+        return nullptr;
+      }
+      val = map.emplace(key.str(), KArgVariant()).first;
     }
+#ifdef K_FLAT_HASH_MAP
+    if (cache) {
+      cache->cacheMap = &map;
+      cache->cacheSlot = size_t(val - map.begin());
+    }
+#else
+    (void)cache; // slots are only cached in the flat hash map
+#endif
+    return &val->second;
   }
 
-  void add(std::initializer_list<KArgVariant> l) {
-    m_list->insert(m_list->end(), l);
+  /// State carried down a path that is being created or modified.
+  struct PathState {
+    KArgArena *arena; ///< arena of the container holding the current item
+    bool cow;         ///< copy shared containers before descending into them
+  };
+
+  /// Replace a map or list shared with a copy-on-write clone by a copy.
+  static void unshare(KArgVariant &item) {
+    if (item.m_vector) {
+      return;
+    }
+    if (item.m_type == KArgTypes::map && item.m_value.map.use_count() > 1) {
+      item.m_value.map = KArgMapInternal::k_copy_map(*item.m_value.map);
+    } else if (item.m_type == KArgTypes::list &&
+               item.m_value.list.use_count() > 1) {
+      item.m_value.list = KArgMapInternal::k_copy_list(*item.m_value.list);
+    }
   }
 
-  void add(KArgList list) {
-    m_list->insert(m_list->end(), list.m_list->begin(), list.m_list->end());
+  /**
+   * \brief Descend from item into the child addressed by a path segment.  A
+   * numeric segment requires item to be a list, anything else a map.  When
+   * creating, a null item becomes the required container and a scalar item is
+   * moved under the key "value" of a new map.
+   * \param create nullptr to only look up the child.  Otherwise the state of
+   * the path being created, updated for the container holding the child.
+   * \return The child or nullptr if the segment does not resolve.
+   */
+  static KArgVariant *childStep(KArgVariant &item, const KArgKey &key,
+                                bool isIndex, size_t index, PathState *create,
+                                const KArgPath::Segment *cache = nullptr) {
+    if (create) {
+      if (item.m_type == KArgTypes::null) {
+        if (isIndex) {
+          item = KArgMapInternal::k_new_list(create->arena);
+        } else {
+          item = KArgMapInternal::k_new_map(create->arena);
+        }
+      } else if (!isIndex && item.m_type != KArgTypes::map) {
+        auto m = KArgMapInternal::k_new_map(create->arena);
+        (*m)["value"] = std::move(item);
+        item = m;
+      } else {
+        // containers below copy-on-write storage are copy-on-write too
+        create->cow = create->cow || KArgMapInternal::k_is_cow(item);
+        if (create->cow) {
+          unshare(item);
+        }
+      }
+    }
+    if (isIndex) {
+      // need a list
+      if (item.m_type != KArgTypes::list || item.m_vector) {
+        return nullptr;
+      }
+      auto &list = *item.m_value.list;
+      if (create) {
+        for (size_t i = list.size(); i <= index; i++)
+          list.insert(list.end(), KArgVariant());
+        create->arena = list.get_allocator().arena();
+      }
+      return index < list.size() ? &list[index] : nullptr;
+    }
+    // need a map
+    if (item.m_type != KArgTypes::map || item.m_vector) {
+      return nullptr;
+    }
+    if (create) {
+      create->arena = item.m_value.map->get_allocator().arena();
+    }
+    return mapStep(*item.m_value.map, key, create != nullptr, cache);
   }
 
-  KArgVariant &operator[](const size_t index) {
-    // Beware, exception if element does not exist
-    return m_list->operator[](index);
+  /**
+   * \brief Find the node associated with a '|' separated path string.  The
+   * first segment is always a key of this map.
+   * \param path The path to traverse to find the specified node.
+   * \param createPath If true, create containers as needed while traversing
+   * path.
+   * \param cow If not null, set to true if a container holding the node is
+   * copy-on-write.
+   * \return The KArgVariant node associated with the path, nullptr if the
+   * path does not resolve to a valid node.
+   */
+  KArgVariant *findByPath(k_string_view path, bool createPath,
+                          bool *cow = nullptr) {
+    auto pos = KArgMapInternal::k_path_separator(path);
+    KArgVariant *item =
+        mapStep(*m_map, KArgKey(k_string_view(path.data(), pos)), createPath);
+    PathState state{arena(), m_map->isCopyOnWrite()};
+    if (cow) {
+      *cow = state.cow;
+    }
+    while (item && pos != path.size()) {
+      path = k_string_view(path.data() + pos + 1, path.size() - pos - 1);
+      pos = KArgMapInternal::k_path_separator(path);
+      k_string_view segment(path.data(), pos);
+      if (cow) {
+        *cow = *cow || KArgMapInternal::k_is_cow(*item);
+      }
+      item = childStep(*item, KArgKey(segment),
+                       KArgMapInternal::k_path_is_index(segment),
+                       KArgMapInternal::k_path_index(segment),
+                       createPath ? &state : nullptr);
+    }
+    return item;
   }
 
   /**
-   * \brief Get a typed value from the KArgMap.
-   * \tparam T The type to return.
-   * \param index The index to look up.
-   * \param defaultValue The value to return if the key is not present.
-   * \return The value associated with key or the default value parameter.
+   * \brief Walk the first count segments of a parsed path.
+   * \param cow If not null, set to true if a container holding the node
+   * reached is copy-on-write.
+   * \return The node reached or nullptr if the path does not resolve.
    */
-  template <typename T> T get(const size_t index, T defaultValue) {
-    if (index > m_list->size())
-      return defaultValue;
-    auto val = m_list->operator[](index);
-    return val.get(defaultValue);
+  KArgVariant *findPath(const KArgPath &path, bool createPath,
+                        size_t count = size_t(-1), bool *cow = nullptr) const {
+    auto &segments = path.m_segments;
+    count = std::min(count, segments.size());
+    KArgVariant *item = nullptr;
+    PathState state{arena(), m_map->isCopyOnWrite()};
+    if (cow) {
+      *cow = state.cow;
+    }
+    for (size_t i = 0; i < count; i++) {
+      auto &segment = segments[i];
+      KArgKey key(segment.key, segment.hash);
+      auto cache = path.m_cache ? &segment : nullptr;
+      if (cow && i != 0) {
+        *cow = *cow || KArgMapInternal::k_is_cow(*item);
+      }
+      item = i == 0 ? mapStep(*m_map, key, createPath, cache)
+                    : childStep(*item, key, segment.isIndex, segment.index,
+                                createPath ? &state : nullptr, cache);
+      if (!item) {
+        break;
+      }
+    }
+    return item;
+  }
+
+  /**
+   * \brief The node set() stores into, created if it does not exist.  A key
+   * not present in this map that contains '|' is followed as a path.
+   * \return The node, nullptr if the path runs through a value that is not
+   * a map or list.
+   */
+  KArgVariant *setSlot(const KArgKey &key) {
+    detach();
+    if (key.compiled()) {
+      return slot(key);
+    }
+    auto val = findKey(key);
+    if (val != m_map->end()) {
+      // key already exists, replace value
+      return &val->second;
+    }
+    if (key.isPath()) {
+      return findByPath(key.view(), true);
+    }
+    if (key.string()) {
+      return &m_map->emplace(*key.string(), KArgVariant()).first->second;
+    }
+    return &m_map->emplace(key.str(), KArgVariant()).first->second;
   }
 
-  // get access
-  std::string get(const size_t index, const char *defaultValue) {
-    if (index > m_list->size())
-      return defaultValue;
-    auto val = m_list->operator[](index);
-    return val.get(defaultValue);
+  /// The node for key, created if it does not exist.  nullptr if a compiled
+  /// path cannot be created.
+  KArgVariant *slot(const KArgKey &key) {
+    detach();
+    if (key.compiled()) {
+      return findPath(*key.compiled(), true);
+    }
+    auto val = findKey(key);
+    if (val != m_map->end()) {
+      return &val->second;
+    }
+    return &m_map->operator[](key.str());
   }
 
-  // TODO: support std::shared_ptr<const T> getCustomType
-  template <typename T> T get(const size_t index, T defaultValue) const {
-    if (index > m_list->size())
-      return defaultValue;
-    auto val = m_list->operator[](index);
-    return val.get(defaultValue);
+  /// In copy-on-write mode, replace shared storage by a private copy.
+  void detach() {
+    if (m_map->isCopyOnWrite() && m_map.use_count() > 1) {
+      m_map = KArgMapInternal::k_copy_map(*m_map);
+    }
   }
 
-  // get access
-  const std::string get(const size_t index, const char *defaultValue) const {
-    if (index > m_list->size())
-      return defaultValue;
-    auto val = m_list->operator[](index);
-    return val.get(defaultValue);
+  /**
+   * \brief The node for key or path, nullptr if it does not exist.
+   * \param cow If not null, set to true if a container holding the node is
+   * copy-on-write.
+   */
+  KArgVariant *findItem(const KArgKey &key, bool *cow = nullptr) const {
+    if (key.compiled()) {
+      return findPath(*key.compiled(), false, size_t(-1), cow);
+    }
+    if (cow) {
+      *cow = m_map->isCopyOnWrite();
+    }
+    auto val = findKey(key);
+    if (val != m_map->end()) {
+      return &val->second;
+    }
+    if (key.isPath()) {
+      return const_cast<KArgMap *>(this)->findByPath(key.view(), false, cow);
+    }
+    return nullptr;
   }
 
-#ifndef K_CUSTOM_TYPES_UNSUPPORTED
-  template <typename T>
-  T getCustomType(const size_t index, T defaultValue = T()) {
-    if (index > m_list->size())
-      return defaultValue;
-    auto val = m_list->operator[](index);
-    return val.getCustomType(defaultValue);
+  template <typename T> T get_impl(const KArgKey &key, T defaultValue) {
+    auto item = findItem(key);
+    return item ? get_item(*item, defaultValue) : defaultValue;
   }
 
-  // TODO: support std::shared_ptr<const T> getCustomType
   template <typename T>
-  const T getCustomType(const size_t index, T defaultValue = T()) const {
-    if (index > m_list->size())
+  static T get_item(KArgVariant &item, T defaultValue) {
+    if (item.m_type == KArgTypes::null)
       return defaultValue;
-    auto val = m_list->operator[](index);
-    return val.getCustomType(defaultValue);
-  }
-#endif
-
-  template <typename T>
-  typename std::enable_if<KArgMapInternal::is_k_type<T>::value, void>::type
-  set(const size_t index, T value) {
-    m_list->operator[](index) = value;
-  }
-
-  template <typename T>
-  void set(const size_t index, const std::shared_ptr<const T> value) {
-    static_assert(sizeof(T) != sizeof(T), "Cannot store const element.");
+    if (item.m_type == KArgTypes::map &&
+        KArgMapInternal::k_type_info<T>::type_code != KArgTypes::map) {
+      // The get request is for something other than a
+      // map. Descend into the map looking for 'value'.
+      auto val = findIn(*item.m_value.map, "value"_k);
+      if (val == item.m_value.map->end())
+        return defaultValue;
+      return get_item(val->second, defaultValue);
+    }
+    return item.get(defaultValue);
   }
 
-  template <typename T> void set(const size_t index, std::vector<T> &&value) {
-    m_list->operator[](index) = std::move(value);
-  }
+  friend std::ostream &operator<<(std::ostream &o, const KArgMap &arg);
+  friend KArgVariant
+  KArgMapInternal::argMapToCustomType(const std::string typeName,
+                                      k_arg_map_ptr map);
+};
 
-  template <typename T> void set(const size_t index, std::vector<T> &value) {
-    static_assert(
-        sizeof(T) != sizeof(T),
-        "to set a std::vector, wrap with std::move or std::shared_ptr.");
+namespace KArgMapInternal {
+/// A new empty list, placed in arena if it is not null.
+inline k_arg_list_ptr k_new_list(KArgArena *arena) {
+  if (!arena) {
+    return k_make_ptr<k_arg_list_ptr>();
   }
+#ifdef K_SINGLE_THREADED
+  return k_arg_list_ptr::make(arena, k_arg_list_type::allocator_type(arena));
+#else
+  return std::allocate_shared<k_arg_list_type>(
+      k_allocator<k_arg_list_type>(arena),
+      k_arg_list_type::allocator_type(arena));
+#endif
+}
 
-  operator std::string() const {
-    std::string s;
-    s.reserve(256);
-    KArgMapInternal::argListToString(s, *m_list);
-    return s;
+/// A new empty map, placed in arena if it is not null.
+inline k_arg_map_ptr k_new_map(KArgArena *arena) {
+  if (!arena) {
+    return k_make_ptr<k_arg_map_ptr>();
   }
+#ifdef K_SINGLE_THREADED
+  return k_arg_map_ptr::make(arena, k_arg_map_type::allocator_type(arena));
+#else
+  return std::allocate_shared<k_arg_map_type>(
+      k_allocator<k_arg_map_type>(arena),
+      k_arg_map_type::allocator_type(arena));
+#endif
+}
 
-  size_t use_count() const noexcept { return m_list.use_count(); }
-
-  // delegated methods
-  size_t size() const { return m_list->size(); }
-
-  bool empty() const { return m_list->empty(); }
+/// A copy-on-write copy of the entries of from sharing its children, in the
+/// same arena.
+inline k_arg_list_ptr k_copy_list(const k_arg_list_type &from) {
+  auto result = k_new_list(from.get_allocator().arena());
+  *result = from;
+  result->setCopyOnWrite();
+  return result;
+}
 
-  void clear() { return m_list->clear(); }
+/// A copy-on-write copy of the entries of from sharing its children, in the
+/// same arena.
+inline k_arg_map_ptr k_copy_map(const k_arg_map_type &from) {
+  auto result = k_new_map(from.get_allocator().arena());
+  *result = from;
+  result->setCopyOnWrite();
+  return result;
+}
 
-  decltype(m_list->begin())
-  begin() K_NOEXCEPT { // return iterator for beginning of mutable sequence
-    return (m_list->begin());
+/// The elements of a vector of T (KArgMap or KArgList) deep copied into a
+/// new vector.
+template <typename T>
+KArgVariant k_vector_clone(const KArgVariant &item, KArgArena *arena) {
+  const auto &from =
+      *reinterpret_cast<const std::shared_ptr<std::vector<T>> *>(&item.m_value);
+  if (!from) {
+    return item;
   }
-
-  decltype(m_list->begin()) begin() const
-      K_NOEXCEPT { // return iterator for beginning of nonmutable sequence
-    return (m_list->begin());
+  std::vector<T> result;
+  result.reserve(from->size());
+  for (auto const &element : *from) {
+    result.push_back(arena ? element.deepClone(*arena) : element.deepClone());
   }
+  return KArgVariant(std::move(result));
+}
 
-  decltype(m_list->end())
-  end() K_NOEXCEPT { // return iterator for end of mutable sequence
-    return (m_list->end());
+/// A copy of a vector for deepClone.  Vectors of maps and lists get cloned
+/// elements; other vectors hold no containers and stay shared.
+inline KArgVariant k_vector_clone(const KArgVariant &item, KArgArena *arena) {
+  switch (item.m_type) {
+  case KArgTypes::map:
+    return k_vector_clone<KArgMap>(item, arena);
+  case KArgTypes::list:
+    return k_vector_clone<KArgList>(item, arena);
+  default:
+    return item;
   }
+}
 
-  decltype(m_list->end())
-  end() const K_NOEXCEPT { // return iterator for end of nonmutable sequence
-    return (m_list->end());
+inline k_arg_list_ptr k_arg_list_clone(const k_arg_list_ptr from,
+                                       KArgArena *arena) {
+  k_arg_list_ptr result = k_new_list(arena);
+  k_arg_list_type &list = *result;
+  for (auto &item : *from) {
+    if (item.m_vector) {
+      list.push_back(k_vector_clone(item, arena));
+      continue;
+    }
+    switch (item.m_type) {
+    case KArgTypes::map: {
+      list.push_back(k_arg_map_clone(item.m_value.map, arena));
+      break;
+    }
+    case KArgTypes::list:
+      list.push_back(k_arg_list_clone(item.m_value.list, arena));
+      break;
+    default:
+      list.push_back(item);
+    }
   }
+  return result;
+}
 
-  void push_back(KArgVariant &&_Val) { m_list->push_back(_Val); }
-
-  void add(KArgVariant &&_Val) { m_list->push_back(_Val); }
-
-  template <typename T>
-  typename std::enable_if<KArgMapInternal::is_k_type<T>::value, void>::type
-  add(T value) {
-    m_list->emplace_back(value);
+inline k_arg_map_ptr k_arg_map_clone(const k_arg_map_ptr from,
+                                     KArgArena *arena) {
+  k_arg_map_ptr result = k_new_map(arena);
+  k_arg_map_type &map = *result;
+  for (auto &item : *from) {
+    auto key = item.first;
+    if (item.second.m_vector) {
+      map[key] = k_vector_clone(item.second, arena);
+      continue;
+    }
+    switch (item.second.m_type) {
+    case KArgTypes::map: {
+      map[key] = k_arg_map_clone(item.second.m_value.map, arena);
+      break;
+    }
+    case KArgTypes::list:
+      map[key] = k_arg_list_clone(item.second.m_value.list, arena);
+      break;
+    default:
+      map[key] = item.second;
+    }
   }
+  return result;
+}
+} // namespace KArgMapInternal
 
-  template <typename T> void addCustomType(T value) {
-    auto ptr = std::make_shared<KArgCustomType<T>>(value);
-    m_list->push_back(std::move(ptr));
-  }
+inline std::ostream &operator<<(std::ostream &o, const KArgMap &arg) {
+  o << arg.m_map;
+  return o;
+}
 
-  void removeAt(size_t index) {
-    if (index < m_list->size()) {
-      m_list->erase(m_list->begin() + index);
-    }
-  }
+namespace KArgMapInternal {
+class k_hamt_node;
 
-  KArgList deepClone() const {
-    KArgList result = KArgMapInternal::k_arg_list_clone(m_list);
-    return result;
+/// Intrusive reference to a k_hamt_node.
+class k_hamt_ref {
+public:
+  k_hamt_ref() K_NOEXCEPT : m_node(nullptr) {}
+  /// Take ownership of a new node.
+  explicit k_hamt_ref(k_hamt_node *node) K_NOEXCEPT : m_node(node) {}
+  k_hamt_ref(const k_hamt_ref &other) K_NOEXCEPT;
+  k_hamt_ref(k_hamt_ref &&other) K_NOEXCEPT : m_node(other.m_node) {
+    other.m_node = nullptr;
   }
+  ~k_hamt_ref();
 
-  friend inline std::ostream &operator<<(std::ostream &o, const KArgList &arg);
-}; // KArgList
+  k_hamt_ref &operator=(k_hamt_ref other) K_NOEXCEPT {
+    std::swap(m_node, other.m_node);
+    return *this;
+  }
 
-inline std::ostream &operator<<(std::ostream &o, const KArgList &arg) {
-  o << arg.m_list;
-  return o;
-}
+  k_hamt_node *get() const K_NOEXCEPT { return m_node; }
+  k_hamt_node &operator*() const K_NOEXCEPT { return *m_node; }
+  k_hamt_node *operator->() const K_NOEXCEPT { return m_node; }
+  explicit operator bool() const K_NOEXCEPT { return m_node != nullptr; }
 
-class KArgMap : public KMapBase {
-  friend class KArgList;
-  friend class KArgMapTest;
-  friend class KArgMapSerializer;
+private:
+  k_hamt_node *m_node;
+};
 
+/**
+ * \brief A node of the hash array mapped trie behind KArgPersistentMap.
+ *
+ * Each level uses 5 bits of the key's k_hash to pick one of 32 slots.
+ * datamap marks the slots holding an entry and nodemap those holding a child
+ * node, and entries and children are stored densely in slot order.  Keys
+ * whose hashes are equal end up in a collision node below the last level,
+ * which holds only entries.  A child always holds at least two entries, so
+ * every map has a single shape whatever order keys were added in.
+ *
+ * A node reachable from a KArgPersistentMap is never modified.  Updates copy
+ * the nodes on the path to the key and share the rest.
+ */
+class k_hamt_node {
 public:
-  KArgMap() { m_map = std::make_shared<k_arg_map_type>(); }
+  struct Entry {
+    k_map_string_t key;
+    uint32_t hash;
+    KArgVariant value;
+  };
 
-  KArgMap(std::initializer_list<std::pair<const std::string, KArgVariant>> l) {
-    m_map = std::make_shared<k_arg_map_type>(l);
+  k_hamt_node() { refs.init(); }
+  k_hamt_node(const k_hamt_node &other)
+      : datamap(other.datamap), nodemap(other.nodemap),
+        entries(other.entries), children(other.children) {
+    refs.init();
   }
 
-  KArgMap(KArgVariant &v) {
-    if (v.m_type == KArgTypes::map) {
-      m_map = v.m_value.map;
-    } else {
-      m_map = std::make_shared<k_arg_map_type>();
+  k_ref_count refs;
+  uint32_t datamap = 0;
+  uint32_t nodemap = 0;
+  std::vector<Entry> entries;
+  std::vector<k_hamt_ref> children;
+
+  /// The entry for key, nullptr if it is not present below node.
+  static const Entry *find(const k_hamt_node *node, uint32_t hash,
+                           k_string_view key) {
+    for (unsigned shift = 0; node; shift += kBits) {
+      if (collision(shift)) {
+        for (auto const &e : node->entries) {
+          if (equals(e.key, key)) {
+            return &e;
+          }
+        }
+        return nullptr;
+      }
+      uint32_t bit = slot(hash, shift);
+      if (node->datamap & bit) {
+        auto const &e = node->entries[index(node->datamap, bit)];
+        return e.hash == hash && equals(e.key, key) ? &e : nullptr;
+      }
+      if (!(node->nodemap & bit)) {
+        return nullptr;
+      }
+      node = node->children[index(node->nodemap, bit)].get();
     }
+    return nullptr;
   }
 
-  void add(std::initializer_list<std::pair<const std::string, KArgVariant>> l) {
-    m_map->insert(l.begin(), l.end());
+  /**
+   * \brief node with entry added, or replacing the value of an entry with the
+   * same key.
+   * \param edit Modify nodes that are not shared in place rather than copying
+   * them.  Only for a trie that no map has been given yet.
+   * \param added Set to true if the key was not present.
+   */
+  static k_hamt_ref insert(const k_hamt_ref &node, unsigned shift,
+                           Entry &&entry, bool edit, bool &added) {
+    k_hamt_ref result = edit && node->refs.get() == 1
+                            ? node
+                            : k_hamt_ref(new k_hamt_node(*node));
+    k_hamt_node &n = *result;
+    if (collision(shift)) {
+      for (auto &e : n.entries) {
+        if (equals(e.key, entry.key)) {
+          e.value = std::move(entry.value);
+          return result;
+        }
+      }
+      n.entries.push_back(std::move(entry));
+      added = true;
+      return result;
+    }
+    uint32_t bit = slot(entry.hash, shift);
+    if (n.nodemap & bit) {
+      auto &child = n.children[index(n.nodemap, bit)];
+      child = insert(child, shift + kBits, std::move(entry), edit, added);
+      return result;
+    }
+    size_t i = index(n.datamap, bit);
+    if (!(n.datamap & bit)) {
+      n.entries.insert(n.entries.begin() + i, std::move(entry));
+      n.datamap |= bit;
+      added = true;
+      return result;
+    }
+    auto &e = n.entries[i];
+    if (e.hash == entry.hash && equals(e.key, entry.key)) {
+      e.value = std::move(entry.value);
+      return result;
+    }
+    // two keys share the slot, move both into a new child
+    auto child = merge(std::move(e), std::move(entry), shift + kBits);
+    n.entries.erase(n.entries.begin() + i);
+    n.datamap &= ~bit;
+    n.nodemap |= bit;
+    n.children.insert(n.children.begin() + index(n.nodemap, bit),
+                      std::move(child));
+    added = true;
+    return result;
   }
 
-  bool containsKey(const std::string key) const {
-    return !(m_map->find(key) == m_map->end());
+  /**
+   * \brief node without the entry for key, or node itself if key is not
+   * present.
+   * \param removed Set to true if the key was present.
+   */
+  static k_hamt_ref remove(const k_hamt_ref &node, unsigned shift,
+                           uint32_t hash, k_string_view key, bool &removed) {
+    if (collision(shift)) {
+      for (size_t i = 0; i < node->entries.size(); i++) {
+        if (equals(node->entries[i].key, key)) {
+          k_hamt_ref result(new k_hamt_node(*node));
+          result->entries.erase(result->entries.begin() + i);
+          removed = true;
+          return result;
+        }
+      }
+      return node;
+    }
+    uint32_t bit = slot(hash, shift);
+    if (node->datamap & bit) {
+      size_t i = index(node->datamap, bit);
+      auto const &e = node->entries[i];
+      if (e.hash != hash || !equals(e.key, key)) {
+        return node;
+      }
+      k_hamt_ref result(new k_hamt_node(*node));
+      result->entries.erase(result->entries.begin() + i);
+      result->datamap &= ~bit;
+      removed = true;
+      return result;
+    }
+    if (!(node->nodemap & bit)) {
+      return node;
+    }
+    size_t ci = index(node->nodemap, bit);
+    auto child = remove(node->children[ci], shift + kBits, hash, key, removed);
+    if (!removed) {
+      return node;
+    }
+    k_hamt_ref result(new k_hamt_node(*node));
+    if (child->nodemap == 0 && child->entries.size() == 1) {
+      // a child needs two entries, keep the last one here instead
+      result->children.erase(result->children.begin() + ci);
+      result->nodemap &= ~bit;
+      result->datamap |= bit;
+      result->entries.insert(
+          result->entries.begin() + index(result->datamap, bit),
+          child->entries.front());
+    } else {
+      result->children[ci] = std::move(child);
+    }
+    return result;
   }
 
-  // String get methods with both const char * and std::string
-  template <typename T>
-  typename std::enable_if<(std::is_same<T, const char *>::value ||
-                           std::is_same<T, std::string>::value),
-                          std::string>::type
-  get(const std::string &key, T defaultValue) const {
-    return const_cast<KArgMap *>(this)->get_impl<std::string>(key,
-                                                              defaultValue);
+  /// Call f(key, value) for every entry below node.
+  template <typename F> static void forEach(const k_hamt_node &node, F &f) {
+    for (auto const &e : node.entries) {
+      f(e.key, e.value);
+    }
+    for (auto const &child : node.children) {
+      forEach(*child, f);
+    }
   }
 
-  template <typename T>
-  typename std::enable_if<(std::is_same<T, const char *>::value ||
-                           std::is_same<T, std::string>::value),
-                          std::string>::type
-  get(const std::string &key, T defaultValue) {
-    return get_impl<std::string>(key, defaultValue);
+private:
+  /// Bits of the hash used per level.
+  static const unsigned kBits = 5;
+
+  /// True below the last level, where all keys have the same hash.
+  static bool collision(unsigned shift) { return shift >= 32; }
+
+  static uint32_t slot(uint32_t hash, unsigned shift) {
+    return uint32_t(1) << ((hash >> shift) & 31);
   }
 
-  template <typename T>
-  typename std::enable_if<std::is_same<T, KArgMap>::value, KArgMap>::type
-  get(const std::string &key, T defaultValue) {
-    return get_impl(key, defaultValue.m_map);
+  /// The position of bit among the bits set in map.
+  static size_t index(uint32_t map, uint32_t bit) {
+    return k_popcount(map & (bit - 1));
   }
 
-  template <typename T>
-  typename std::enable_if<std::is_same<T, KArgMap>::value, const KArgMap>::type
-  get(const std::string &key, T defaultValue) const {
-    return const_cast<KArgMap *>(this)->get_impl<T>(key, defaultValue.m_map);
+  static bool equals(const k_map_string_t &a, k_string_view b) {
+    return a.size() == b.size() && std::memcmp(a.data(), b.data(), b.size()) == 0;
   }
 
-  template <typename T>
-  typename std::enable_if<std::is_same<T, KArgList>::value, KArgList>::type
-  get(const std::string &key, T defaultValue) {
-    return get_impl<>(key, defaultValue.m_list);
+  /// A node holding two entries with different keys.
+  static k_hamt_ref merge(Entry &&a, Entry &&b, unsigned shift) {
+    k_hamt_ref result(new k_hamt_node());
+    k_hamt_node &n = *result;
+    if (collision(shift)) {
+      n.entries.push_back(std::move(a));
+      n.entries.push_back(std::move(b));
+      return result;
+    }
+    uint32_t bitA = slot(a.hash, shift);
+    uint32_t bitB = slot(b.hash, shift);
+    if (bitA == bitB) {
+      n.nodemap = bitA;
+      n.children.push_back(merge(std::move(a), std::move(b), shift + kBits));
+      return result;
+    }
+    n.datamap = bitA | bitB;
+    if (bitA < bitB) {
+      n.entries.push_back(std::move(a));
+      n.entries.push_back(std::move(b));
+    } else {
+      n.entries.push_back(std::move(b));
+      n.entries.push_back(std::move(a));
+    }
+    return result;
   }
+};
 
-  template <typename T>
-  typename std::enable_if<std::is_same<T, KArgList>::value,
-                          const KArgList>::type
-  get(const std::string &key, T defaultValue) const {
-    return const_cast<KArgMap *>(this)->get_impl<T>(key, defaultValue.m_list);
+inline k_hamt_ref::k_hamt_ref(const k_hamt_ref &other) K_NOEXCEPT
+    : m_node(other.m_node) {
+  if (m_node) {
+    m_node->refs.add();
   }
+}
 
-  /**
-   * \brief Get a typed value from the KArgMap.
-   * \tparam T The type to return.
-   * \param key The key name to look up.
-   * \param defaultValue The value to return if the key is not present.
-   * \return The value associated with key or the default value parameter.
-   */
-  template <typename T>
-  typename std::enable_if<(!std::is_class<T>::value &&
-                           !std::is_pointer<T>::value) ||
-                              std::is_same<T, std::complex<float>>::value ||
-                              std::is_same<T, std::complex<double>>::value ||
-                              std::is_same<T, KTimestamp>::value ||
-                              std::is_same<T, KDuration>::value,
-                          T>::type
-  get(const std::string &key, T defaultValue) {
-    return get_impl(key, defaultValue);
+inline k_hamt_ref::~k_hamt_ref() {
+  if (m_node && m_node->refs.release()) {
+    delete m_node;
+  }
+}
+} // namespace KArgMapInternal
+
+/**
+ * \brief An immutable map backed by a hash array mapped trie.
+ *
+ * with() and without() return a new version in O(log n) that shares every
+ * node off the path to the key with this one, so keeping many versions of a
+ * large map (e.g. a configuration history for undo) costs little more than
+ * their differences.  Copies are O(1) and versions can be read from several
+ * threads at once.
+ *
+ * Keys are single keys, '|' is not followed as a path.  Values are shared
+ * with the KArgMap they came from or were added with, and the maps and lists
+ * among them are marked copy-on-write (see KArgMap::cowClone): modifying them
+ * later, through the source map or a handle from get(), copies them and does
+ * not change any version.
+ */
+class KArgPersistentMap {
+  using Node = KArgMapInternal::k_hamt_node;
+
+public:
+  KArgPersistentMap() : m_size(0) {}
+
+  /// The entries of map, sharing their values.  O(n).
+  explicit KArgPersistentMap(const KArgMap &map) : m_size(0) {
+    for (auto const &item : *map.m_map) {
+      KArgMapInternal::k_mark_cow(item.second);
+      insert(Node::Entry{item.first,
+                         KArgMapInternal::k_hash(item.first.data(),
+                                                 item.first.size()),
+                         item.second},
+             true);
+    }
   }
 
-  template <typename T>
-  typename std::enable_if<(!std::is_class<T>::value), T>::type
-  get(const std::string &key) {
-    static_assert(sizeof(T) != sizeof(T),
-                  "Get operations require a default value to be provided.");
-    return const_cast<KArgMap *>(this)->get_impl(key, T(0));
+  size_t size() const { return m_size; }
+
+  bool empty() const { return m_size == 0; }
+
+  bool containsKey(const KArgKey &key) const { return find(key) != nullptr; }
+
+  /// The value of key, a null value if it is not present.
+  const KArgVariant &operator[](const KArgKey &key) const {
+    auto item = find(key);
+    return item ? *item : NullKArgVariant::Instance();
   }
 
   /**
-   * \brief Get a typed value from the KArgMap.
-   * \tparam T The type to return.
-   * \param key The key name to look up.
+   * \brief Get a typed value, converted as KArgMap::get does.
+   * \param key The key to look up.
    * \param defaultValue The value to return if the key is not present.
-   * \return The value associated with key or the default value parameter.
    */
   template <typename T>
   typename std::enable_if<(!std::is_class<T>::value &&
@@ -1717,379 +4611,479 @@ public:
                               std::is_same<T, KTimestamp>::value ||
                               std::is_same<T, KDuration>::value,
                           T>::type
-  get(const std::string &key, T defaultValue) const {
-    return const_cast<KArgMap *>(this)->get_impl(key, defaultValue);
-  }
-
-  template <typename T>
-  typename std::enable_if<(!std::is_class<T>::value ||
-                           std::is_same<std::string, T>::value),
-                          T>::type
-  get(const std::string &key) const {
-    static_assert(sizeof(T) != sizeof(T),
-                  "Get operations require a default value to be provided.");
-    return const_cast<KArgMap *>(this)->get_impl(key, T(0));
-  }
-
-  /**
-   * \brief Get a typed value from the KArgMap for a type that returns a smart
-   * pointer. \tparam T The type to return. \param key The key name to look up.
-   * \param defaultValue The value to return if the key is not present.  Default
-   * is an empty smart pointer. \return The value associated with key or the
-   * default value parameter.
-   */
-  template <typename T>
-  typename std::enable_if<!std::is_same<std::string, T>::value &&
-                              std::is_class<T>::value,
-                          std::shared_ptr<T>>::type
-  get(const std::string &key,
-      std::shared_ptr<T> defaultValue = std::make_shared<T>()) {
+  get(const KArgKey &key, T defaultValue) const {
     return get_impl(key, defaultValue);
   }
 
-  template <typename T>
-  typename std::enable_if<!std::is_same<std::string, T>::value &&
-                              std::is_class<T>::value,
-                          std::shared_ptr<const T>>::type
-  get(const std::string &key, std::shared_ptr<const T> defaultValue =
-                                  std::make_shared<const T>()) const {
-    // hokey workaround as I couldn't figure hot to cast to std::shared_ptr<T>
-    // for get_impl call
-    auto x = std::make_shared<T>();
-    auto value =
-        const_cast<KArgMap *>(this)->get_impl<std::shared_ptr<T>>(key, x);
-    if (x == value)
-      return defaultValue;
-    return value;
+  std::string get(const KArgKey &key, const std::string &defaultValue) const {
+    return get_impl(key, defaultValue);
   }
 
-  KArgVariant &operator[](const std::string &key) {
-    // Beware, the array operator will create a key entry if it does not exist.
-    return m_map->operator[](key);
+  std::string get(const KArgKey &key, const char *defaultValue) const {
+    return get_impl(key, std::string(defaultValue));
   }
 
-  const KArgVariant &operator[](const std::string &key) const {
-    auto val = m_map->find(key);
-    if (val == m_map->end()) {
-#ifdef K_NOEXECEPT
-      throw std::exception("Key not found in const KArgMap");
-#else
-      // Not in list, useless to caller, no exceptions so fall thru and see what
-      // happens
-#endif
+  template <typename T>
+  typename std::enable_if<std::is_same<T, KArgMap>::value, KArgMap>::type
+  get(const KArgKey &key, T defaultValue) const {
+    KArgMap result = get_impl(key, defaultValue.m_map);
+    if (result.m_map != defaultValue.m_map) {
+      result.m_map->setCopyOnWrite();
     }
-    return m_map->operator[](key);
+    return result;
   }
 
-  // Set operations
-
-#if 0
-            template <typename T>
-            void set(const std::string& key, T value) const
-            {
-                static_assert(always_false<T>::value, "Cannot set values in a const container");
-            }
-#endif
-
   template <typename T>
-  typename std::enable_if<KArgMapInternal::is_k_type<T>::value, void>::type
-  set(const std::string &key, T value) {
-    auto pair = m_map->find(key);
-    if (pair != m_map->end()) {
-      // key already exists, replace value
-      pair->second = value;
-    } else {
-      // the key does not exist in the map.
-      // check to see if it contains a path and utilize the path if so.
-      // If the key is not a path, insert immediately.
-      auto ckey = key.c_str();
-      while (*ckey && *ckey != '|') {
-        ckey++;
-      }
-      if (*ckey) {
-        KArgVariant &item = getByPath(key, *this, true);
-        item = value;
-      } else {
-        // Use lb as a hint to insert, so it can avoid another lookup
-        m_map->emplace(key, value);
-      }
+  typename std::enable_if<std::is_same<T, KArgList>::value, KArgList>::type
+  get(const KArgKey &key, T defaultValue) const {
+    KArgList result = get_impl(key, defaultValue.m_list);
+    if (result.m_list != defaultValue.m_list) {
+      result.m_list->setCopyOnWrite();
     }
+    return result;
   }
 
+  /// A version with key set to value.  O(log n).
   template <typename T>
-  void set(const std::string &key, const std::shared_ptr<const T> value) {
-    static_assert(sizeof(T) != sizeof(T), "Cannot store const element.");
+  typename std::enable_if<
+      KArgMapInternal::is_k_type<typename std::decay<T>::type>::value ||
+          std::is_same<typename std::decay<T>::type, KArgVariant>::value,
+      KArgPersistentMap>::type
+  with(const KArgKey &key, T &&value) const {
+    KArgPersistentMap result(*this);
+    Node::Entry entry{key.str(), key.hash(), KArgVariant(std::forward<T>(value))};
+    KArgMapInternal::k_mark_cow(entry.value);
+    result.insert(std::move(entry), false);
+    return result;
   }
 
-  template <typename T>
-  void set(const std::string &key, std::vector<T> &&value) {
-    (*m_map)[key] = std::move(value);
+  /// A version without key, or a copy of this one if key is not present.
+  /// O(log n).
+  KArgPersistentMap without(const KArgKey &key) const {
+    if (!m_root) {
+      return *this;
+    }
+    bool removed = false;
+    auto root = Node::remove(m_root, 0, key.hash(), key.view(), removed);
+    if (!removed) {
+      return *this;
+    }
+    KArgPersistentMap result;
+    result.m_size = m_size - 1;
+    if (result.m_size) {
+      result.m_root = std::move(root);
+    }
+    return result;
   }
 
-  template <typename T>
-  void set(const std::string &key, std::vector<T> &value) {
-    static_assert(
-        sizeof(T) != sizeof(T),
-        "to set a std::vector, wrap with std::move or std::shared_ptr.");
+  /// Call f(key, value) for every entry, in no particular order.
+  template <typename F> void forEach(F f) const {
+    if (m_root) {
+      Node::forEach(*m_root, f);
+    }
   }
 
-#ifndef K_CUSTOM_TYPES_UNSUPPORTED
-  template <typename T> void setCustomType(const std::string &key, T value) {
-    auto ptr = std::make_shared<KArgCustomType<T>>(value);
-    (*m_map)[key] = std::move(ptr);
+  /// A KArgMap with the entries of this map, sharing their values.  O(n).
+  KArgMap toArgMap() const {
+    KArgMap result;
+    result.m_map->reserve(m_size);
+    forEach([&result](const k_map_string_t &key, const KArgVariant &value) {
+      result.m_map->emplace(key, value);
+    });
+    return result;
   }
 
-  template <typename T>
-  T getCustomType(const std::string &key, T defaultValue = T()) {
-    auto val = m_map->find(key);
-    if (val == m_map->end() || (val->second.m_type != KArgTypes::custom &&
-                                val->second.m_type != KArgTypes::map))
-      return defaultValue;
-    return val->second.getCustomType(defaultValue);
+private:
+  const KArgVariant *find(const KArgKey &key) const {
+    auto entry = Node::find(m_root.get(), key.hash(), key.view());
+    return entry ? &entry->value : nullptr;
   }
-#endif
 
-  // to string support
-  operator std::string() const { return to_string(); }
+  template <typename T> T get_impl(const KArgKey &key, T defaultValue) const {
+    auto item = find(key);
+    return item ? KArgMap::get_item(const_cast<KArgVariant &>(*item),
+                                    defaultValue)
+                : defaultValue;
+  }
 
-  std::string to_string() const {
-    std::string s;
-    s.reserve(256);
-    KArgMapInternal::argMapToString(s, *m_map);
-    return s;
+  void insert(Node::Entry &&entry, bool edit) {
+    if (!m_root) {
+      m_root = KArgMapInternal::k_hamt_ref(new Node());
+      edit = true;
+    }
+    bool added = false;
+    m_root = Node::insert(m_root, 0, std::move(entry), edit, added);
+    if (added) {
+      m_size++;
+    }
   }
 
-  // delegated methods
-  size_t erase(const std::string key) const { return m_map->erase(key); }
+  KArgMapInternal::k_hamt_ref m_root;
+  size_t m_size;
+};
 
-  size_t size() const { return m_map->size(); }
+inline std::ostream &operator<<(std::ostream &o, const KArgPersistentMap &arg) {
+  std::string s;
+  s.reserve(256);
+  s.append("{");
+  bool first = true;
+  arg.forEach([&](const k_map_string_t &key, const KArgVariant &value) {
+    if (value.m_type == KArgTypes::null) {
+      return;
+    }
+    s.append(first ? "\"" : ", \"");
+    first = false;
+    s.append(key);
+    s.append("\":");
+    KArgMapInternal::argVariantToString(s, value);
+  });
+  s.append("}");
+  o << s;
+  return o;
+}
 
-  bool empty() const { return m_map->empty(); }
+/**
+ * \brief Shares one copy of identical maps, lists and vectors.
+ *
+ * intern() returns a deep copy of a map or list in which every subtree that
+ * equals one interned before (by KArgVariant::operator==) is replaced by the
+ * stored instance, so repeated metadata blocks or calibration tables cost
+ * memory once.  Interned storage is shared by everything interned through
+ * the store, so intern() returns copy-on-write handles (see
+ * KArgMap::cowClone): modifying them copies the changed path and never
+ * alters the shared copy.  Do not write through references into it.
+ *
+ * The store keeps every distinct subtree alive until collect() or clear().
+ * Like KArgMap, it is not thread-safe.
+ */
+class KArgInternStore {
+public:
+  /// Counts since the store was created or cleared.
+  struct Stats {
+    size_t interned = 0; ///< maps, lists and vectors passed to the store
+    size_t unique = 0;   ///< of those, the ones that were new and kept
 
-  void clear() { return m_map->clear(); }
+    /// Copies per stored instance, 1 when nothing was shared.
+    double ratio() const { return unique ? double(interned) / unique : 1.0; }
+  };
 
-  decltype(m_map->begin())
-  begin() K_NOEXCEPT { // return iterator for beginning of mutable sequence
-    return (m_map->begin());
+  /// A copy of map sharing identical subtrees with earlier results.
+  KArgMap intern(const KArgMap &map) {
+    size_t hash;
+    return KArgMap(internMap(map.m_map, hash)).cowClone();
   }
 
-  decltype(m_map->begin()) begin() const
-      K_NOEXCEPT { // return iterator for beginning of nonmutable sequence
-    return (m_map->begin());
+  /// A copy of list sharing identical subtrees with earlier results.
+  KArgList intern(const KArgList &list) {
+    size_t hash;
+    return KArgList(internList(list.m_list, hash)).cowClone();
   }
 
-  decltype(m_map->end())
-  end() K_NOEXCEPT { // return iterator for end of mutable sequence
-    return (m_map->end());
-  }
+  const Stats &stats() const { return m_stats; }
 
-  decltype(m_map->end())
-  end() const K_NOEXCEPT { // return iterator for end of nonmutable sequence
-    return (m_map->end());
+  /// The number of distinct maps, lists and vectors held.
+  size_t size() const {
+    return m_maps.size() + m_lists.size() + m_vectors.size();
   }
 
-  size_t use_count() const K_NOEXCEPT { return m_map.use_count(); }
-
-  KArgMap deepClone() const {
-    KArgMap map = KArgMapInternal::k_arg_map_clone(m_map);
-    return map;
+  /// Drop the stored subtrees no longer used outside the store.
+  /// \return The number dropped.
+  size_t collect() {
+    size_t total = 0;
+    size_t dropped;
+    do { // dropping a parent can leave its children unused
+      dropped = drop(m_maps) + drop(m_lists) + dropVectors();
+      total += dropped;
+    } while (dropped);
+    return total;
   }
 
-protected:
-  KArgMap(std::shared_ptr<k_arg_map_type> map) { m_map = map; }
+  void clear() {
+    m_maps.clear();
+    m_lists.clear();
+    m_vectors.clear();
+    m_hashes.clear();
+    m_stats = Stats();
+  }
 
 private:
-  /**
-   * \brief Given a path and a KArgVariant node, examine the key to determine if
-   * the node is required to be a list or a map.   If createPath==true nodes
-   * will be adjusted to satisfy the key hint.  If createPath==false then a null
-   * element is returned if a node is discovered of the incorrerct type. \param
-   * path The container path to traverse. \param item The candidate node. \param
-   * createPath True to allow the elements to be created or adjusted. \return
-   * The KArgVariant node associated with the path.  A null KArgVariant is
-   * returned if the path does not resolve to a valid node.
-   */
-  KArgVariant &getByPath(const std::string &path, KArgVariant &item,
-                         bool createPath) {
-    auto isNumeric = path[0] >= '0' && path[0] <= '9';
-    if (isNumeric) {
-      // need a list
-      if (createPath) {
-        if (item.m_type == KArgTypes::null) {
-          item = KArgList();
-        }
-      }
-      if (item.m_type == KArgTypes::list && !item.m_vector) {
-        KArgList temp = item.m_value.list;
-        return getByPath(path, temp, createPath);
-      }
-      return NullKArgVariant::Instance();
-    } else {
-      // need a map
-      if (createPath) {
-        if (item.m_type == KArgTypes::null) {
-          item = KArgMap();
-        } else if (item.m_type != KArgTypes::map) {
-          KArgMap m;
-          m["value"] = std::move(item);
-          item = m;
+  /// The stored instance equal to value, or value after storing it.  hash
+  /// receives argVariantHash(value), computed from the children's hashes.
+  KArgVariant internValue(const KArgVariant &value, size_t &hash) {
+    size_t seed = size_t(value.m_type) * 2;
+    if (value.m_vector) {
+      hash = KArgMapInternal::argVariantHash(value);
+      m_stats.interned++;
+      auto range = m_vectors.equal_range(hash);
+      for (auto it = range.first; it != range.second; ++it) {
+        if (KArgMapInternal::argVariantEquals(it->second, value)) {
+          return it->second;
         }
       }
+      m_stats.unique++;
+      m_vectors.emplace(hash, value);
+      return value;
+    }
+    switch (value.m_type) {
+    case KArgTypes::map: {
+      KArgVariant result = internMap(value.m_value.map, hash);
+      hash = KArgMapInternal::k_hash_combine(seed, hash);
+      return result;
+    }
+    case KArgTypes::list: {
+      KArgVariant result = internList(value.m_value.list, hash);
+      hash = KArgMapInternal::k_hash_combine(seed, hash);
+      return result;
+    }
+    default:
+      hash = KArgMapInternal::argVariantHash(value);
+      return value;
+    }
+  }
+
+  k_arg_map_ptr internMap(const k_arg_map_ptr &map, size_t &hash) {
+    auto known = m_hashes.find(map.get());
+    if (known != m_hashes.end()) { // already a stored instance
+      hash = known->second;
+      m_stats.interned++;
+      return map;
+    }
+    auto copy = KArgMapInternal::k_new_map(nullptr);
+    copy->reserve(map->size());
+    size_t sum = 0;
+    for (auto const &item : *map) {
+      size_t h;
+      KArgVariant value = internValue(item.second, h);
+      // the same combination as argMapHash
+      sum += KArgMapInternal::k_hash_combine(
+          std::hash<k_map_string_t>()(item.first), h);
+      copy->emplace(item.first, std::move(value));
+    }
+    hash = KArgMapInternal::k_hash_combine(copy->size(), sum);
+    return store(m_maps, copy, hash, KArgMapInternal::argMapEquals);
+  }
 
-      if (item.m_type == KArgTypes::map && !item.m_vector) {
-        KArgMap m = item.m_value.map;
-        return getByPath(path, m, createPath);
+  k_arg_list_ptr internList(const k_arg_list_ptr &list, size_t &hash) {
+    auto known = m_hashes.find(list.get());
+    if (known != m_hashes.end()) {
+      hash = known->second;
+      m_stats.interned++;
+      return list;
+    }
+    auto copy = KArgMapInternal::k_new_list(nullptr);
+    copy->reserve(list->size());
+    hash = list->size();
+    for (auto const &item : *list) {
+      size_t h;
+      copy->push_back(internValue(item, h));
+      hash = KArgMapInternal::k_hash_combine(hash, h);
+    }
+    return store(m_lists, copy, hash, KArgMapInternal::argListEquals);
+  }
+
+  /// The stored container equal to copy, whose children are already
+  /// interned, or copy after storing it.
+  template <typename Ptr, typename Equal>
+  Ptr store(std::unordered_multimap<size_t, Ptr> &stored, const Ptr &copy,
+            size_t hash, Equal equal) {
+    m_stats.interned++;
+    auto range = stored.equal_range(hash);
+    for (auto it = range.first; it != range.second; ++it) {
+      // children are stored instances, so equal ones compare by address
+      if (equal(*it->second, *copy)) {
+        return it->second;
       }
-      return NullKArgVariant::Instance();
     }
+    m_stats.unique++;
+    stored.emplace(hash, copy);
+    m_hashes[copy.get()] = hash;
+    return copy;
   }
 
-  /**
-   * \brief Find the node associated with the path string.
-   * \param path The path to traverse to find the specified node.
-   * \param list The initial container to being the search from.
-   * \param createPath If true, create containers as needed while traversing
-   * path. \return The KArgVariant node associated with the path.  A null
-   * KArgVariant is returned if the path does not resolve to a valid node.
-   */
-  KArgVariant &getByPath(const std::string path, KArgList &list,
-                         bool createPath) {
-    const char *ckey = path.c_str();
-    const char *key1 = ckey;
-    while (*ckey && *ckey != '|') {
-      ckey++;
-    }
-    if (*ckey != '|') {
-      auto index =
-          key1[0] >= '0' && key1[0] <= '9' ? ::strtoull(key1, nullptr, 10) : 0;
-      if (createPath) {
-        for (size_t i = list.size(); i <= index; i++)
-          list.m_list->insert(list.m_list->end(), KArgVariant());
+  template <typename Ptr>
+  size_t drop(std::unordered_multimap<size_t, Ptr> &stored) {
+    size_t count = 0;
+    for (auto it = stored.begin(); it != stored.end();) {
+      if (it->second.use_count() == 1) {
+        m_hashes.erase(it->second.get());
+        it = stored.erase(it);
+        count++;
+      } else {
+        ++it;
       }
-      if (index >= list.size()) {
-        return NullKArgVariant::Instance();
+    }
+    return count;
+  }
+
+  size_t dropVectors() {
+    size_t count = 0;
+    for (auto it = m_vectors.begin(); it != m_vectors.end();) {
+      // the element type does not matter for the reference count
+      auto const &vec = *reinterpret_cast<
+          const std::shared_ptr<std::vector<uint8_t>> *>(&it->second.m_value);
+      if (vec.use_count() == 1) {
+        it = m_vectors.erase(it);
+        count++;
+      } else {
+        ++it;
       }
-      return list.m_list->operator[](uint32_t(index));
     }
+    return count;
+  }
+
+  std::unordered_multimap<size_t, k_arg_map_ptr> m_maps;
+  std::unordered_multimap<size_t, k_arg_list_ptr> m_lists;
+  std::unordered_multimap<size_t, KArgVariant> m_vectors;
+  std::unordered_map<const void *, size_t> m_hashes; ///< stored containers
+  Stats m_stats;
+};
 
-    auto pos = ckey - path.c_str();
-    auto keyfirst = std::string(path, 0, pos);
-    auto keylast = path.substr(pos + 1);
-    auto index =
-        key1[0] >= '0' && key1[0] <= '9' ? ::strtoull(key1, nullptr, 10) : 0;
+/**
+ * \brief Shares the storage of repeated string values.
+ *
+ * String values longer than 15 characters live in a reference counted heap
+ * block; shorter ones are stored inside the KArgVariant and need no pool.
+ * The pool keeps up to capacity() of the long strings it has seen, and values
+ * made or interned through it share their block, so a model name repeated
+ * in every map is stored once and two such values compare equal without
+ * looking at their characters.  When full, the least recently used string
+ * is dropped from the pool; values using it keep it alive.
+ *
+ * Enable it for a decoder with CborSerializer::setStringPool(), or apply it
+ * to an existing map with intern().  With K_UNSHARED_STRINGS every value
+ * is a copy with a block of its own: the pool still finds repeated strings
+ * but saves no memory.  Like KArgMap, it is not thread-safe.
+ */
+class KArgStringPool {
+public:
+  explicit KArgStringPool(size_t capacity = 4096) : m_capacity(capacity) {}
+
+  /// A string value equal to s, sharing storage with earlier equal values.
+  KArgVariant value(k_string_view s) {
+    KArgVariant result;
+    new (&result.m_value.string)
+        KArgMapInternal::k_arg_string(pooled(s, nullptr));
+    result.m_type = KArgTypes::string;
+    return result;
+  }
 
-    if (createPath) {
-      for (size_t i = list.size(); i <= index; i++)
-        list.m_list->insert(list.m_list->end(), KArgVariant());
+  /// Make a string value share storage with earlier equal values.
+  void intern(KArgVariant &value) {
+    if (value.m_type == KArgTypes::string && !value.m_vector &&
+        value.m_value.string.isHeap()) {
+      auto &s = value.m_value.string;
+      s = pooled(k_string_view(s.data(), s.size()), &s);
     }
-    if (index >= list.size()) {
-      return NullKArgVariant::Instance();
-    }
-    KArgVariant &item = list.m_list->operator[](uint32_t(index));
-    return getByPath(keylast, item, createPath);
   }
 
   /**
-   * \brief Find the node associated with the path string.
-   * \param path The path to traverse to find the specified node.
-   * \param map The initial container to being the search from.
-   * \param createPath If true, create containers as needed while traversing
-   * path. \return The KArgVariant node associated with the path.  A null
-   * KArgVariant is returned if the path does not resolve to a valid node.
+   * \brief Intern every string value in map and the maps and lists below it.
+   * Values stay equal, so handles sharing the storage (e.g. copy-on-write
+   * clones) see no change, but no other thread may read the map meanwhile.
    */
-  KArgVariant &getByPath(const std::string path, KArgMap &map,
-                         bool createPath) {
-    const char *ckey = path.c_str();
-    while (*ckey && *ckey != '|') {
-      ckey++;
-    }
-    if (*ckey != '|') {
-      return map.m_map->operator[](path);
+  void intern(KArgMap &map) {
+    for (auto &item : *map.m_map) {
+      internChildren(item.second);
     }
-
-    auto pos = ckey - path.c_str();
-    auto keyfirst = std::string(path, 0, pos);
-    auto keylast = path.substr(pos + 1);
-    KArgVariant &item = map.m_map->operator[](keyfirst);
-
-    return getByPath(keylast, item, createPath);
   }
 
-  template <typename T> T get_impl(const std::string &key, T defaultValue) {
-    auto val = m_map->find(key);
-    bool usePath = false;
-    if (val == m_map->end()) {
-      // Look for path character
-      auto pos = key.find('|');
-      if (pos == std::string::npos)
-        return defaultValue;
-      usePath = true;
+  /// Intern every string value in list and the maps and lists below it.
+  void intern(KArgList &list) {
+    for (auto &item : *list.m_list) {
+      internChildren(item);
     }
+  }
 
-    KArgVariant &item = usePath ? getByPath(key, *this, false) : val->second;
-    if (item.m_type == KArgTypes::null)
-      return defaultValue;
-    if (item.m_type == KArgTypes::map &&
-        KArgMapInternal::k_type_info<T>::type_code != KArgTypes::map) {
-      // The get request is for something other than a
-      // map. Descend into the map looking for 'value'.
-      KArgMap temp(item.m_value.map);
-      return temp.get_impl("value", defaultValue);
-    }
-    return item.get(defaultValue);
+  size_t size() const { return m_index.size(); }
+  size_t capacity() const { return m_capacity; }
+
+  /// Strings found in the pool.
+  size_t hits() const { return m_hits; }
+  /// Strings added to the pool.
+  size_t misses() const { return m_misses; }
+  /// Strings dropped to stay within capacity().
+  size_t evictions() const { return m_evictions; }
+
+  /// Drop every pooled string and reset the counters.
+  void clear() {
+    m_index.clear();
+    m_strings.clear();
+    m_hits = 0;
+    m_misses = 0;
+    m_evictions = 0;
   }
 
-  friend std::ostream &operator<<(std::ostream &o, const KArgMap &arg);
-  friend KArgVariant
-  KArgMapInternal::argMapToCustomType(const std::string typeName,
-                                      k_arg_map_ptr map);
-};
+private:
+  struct ViewHash {
+    size_t operator()(const k_string_view &s) const {
+      return KArgMapInternal::k_hash(s.data(), s.size());
+    }
+  };
+  typedef std::list<KArgMapInternal::k_arg_string> string_list;
 
-namespace KArgMapInternal {
-inline k_arg_list_ptr k_arg_list_clone(const k_arg_list_ptr from) {
-  k_arg_list_ptr result = std::make_shared<k_arg_list_type>();
-  k_arg_list_type &list = *result;
-  for (auto &item : *from) {
-    switch (item.m_type) {
-    case KArgTypes::map: {
-      list.push_back(k_arg_map_clone(item.m_value.map));
-      break;
+  void internChildren(KArgVariant &value) {
+    if (value.m_vector) {
+      return;
     }
+    switch (value.m_type) {
+    case KArgTypes::string:
+      intern(value);
+      break;
+    case KArgTypes::map:
+      for (auto &item : *value.m_value.map) {
+        internChildren(item.second);
+      }
+      break;
     case KArgTypes::list:
-      list.push_back(k_arg_list_clone(item.m_value.list));
+      for (auto &item : *value.m_value.list) {
+        internChildren(item);
+      }
       break;
     default:
-      list.push_back(item);
+      break;
     }
   }
-  return result;
-}
 
-inline k_arg_map_ptr k_arg_map_clone(const k_arg_map_ptr from) {
-  k_arg_map_ptr result = std::make_shared<k_arg_map_type>();
-  k_arg_map_type &map = *result;
-  for (auto &item : *from) {
-    auto key = item.first;
-    switch (item.second.m_type) {
-    case KArgTypes::map: {
-      map[key] = k_arg_map_clone(item.second.m_value.map);
-      break;
+  /// The pooled string equal to s.  A new one is added as a copy of
+  /// existing, if given, so that its heap block is reused.
+  KArgMapInternal::k_arg_string
+  pooled(k_string_view s, const KArgMapInternal::k_arg_string *existing) {
+    if (s.size() <= KArgMapInternal::k_arg_string::kInlineMax) {
+      return KArgMapInternal::k_arg_string(s.data(), s.size());
     }
-    case KArgTypes::list:
-      map[key] = k_arg_list_clone(item.second.m_value.list);
-      break;
-    default:
-      map[key] = item.second;
+    auto found = m_index.find(s);
+    if (found != m_index.end()) {
+      m_hits++;
+      // most recently used first
+      m_strings.splice(m_strings.begin(), m_strings, found->second);
+      return *found->second;
+    }
+    m_misses++;
+    if (existing) {
+      m_strings.push_front(*existing);
+    } else {
+      m_strings.emplace_front(s.data(), s.size());
+    }
+    // the key refers to the characters of the node the list owns
+    auto &added = m_strings.front();
+    m_index.emplace(k_string_view(added.data(), added.size()),
+                    m_strings.begin());
+    if (m_index.size() > m_capacity) {
+      auto &oldest = m_strings.back();
+      m_index.erase(k_string_view(oldest.data(), oldest.size()));
+      m_strings.pop_back();
+      m_evictions++;
     }
+    return added;
   }
-  return result;
-}
-} // namespace KArgMapInternal
 
-inline std::ostream &operator<<(std::ostream &o, const KArgMap &arg) {
-  o << arg.m_map;
-  return o;
-}
+  size_t m_capacity;
+  string_list m_strings; ///< most recently used first
+  std::unordered_map<k_string_view, string_list::iterator, ViewHash> m_index;
+  size_t m_hits = 0;
+  size_t m_misses = 0;
+  size_t m_evictions = 0;
+};
 
 namespace KArgMapInternal {
 
@@ -2251,3 +5245,15 @@ inline KArgVariant argMapToCustomType(const std::string typeName,
 }
 } // namespace KArgMapInternal
 } // namespace entazza
+
+namespace std {
+template <> struct hash<entazza::KArgVariant> {
+  size_t operator()(const entazza::KArgVariant &v) const { return v.hash(); }
+};
+template <> struct hash<entazza::KArgMap> {
+  size_t operator()(const entazza::KArgMap &m) const { return m.hash(); }
+};
+template <> struct hash<entazza::KArgList> {
+  size_t operator()(const entazza::KArgList &l) const { return l.hash(); }
+};
+} // namespace std
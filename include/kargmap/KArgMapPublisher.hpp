@@ -0,0 +1,229 @@
+// SPDX-License-Identifier: BSD-3-Clause
+#pragma once
+
+#include "kargmap/KArgMap.hpp"
+#include <atomic>
+#include <mutex>
+
+#ifdef K_SINGLE_THREADED
+#error KArgMapPublisher.hpp shares maps between threads and cannot be used with K_SINGLE_THREADED
+#endif
+
+namespace entazza {
+
+/**
+ * \brief Publishes snapshots of a KArgMap to many reader threads.
+ *
+ * A writer replaces the whole map with publish() or update().  Readers see
+ * the snapshot that was current when they called KArgMapPublisher::Reader::
+ * read(), unchanged for as long as they hold the returned guard.  Reading is
+ * wait-free: it takes no lock, never retries, and writes only to the reader's
+ * own cache line, so readers do not slow each other down.
+ *
+ * A replaced snapshot is freed once no reader can still be using it.  Readers
+ * announce the epoch they entered in, and each publish() frees the replaced
+ * snapshots that are older than every announced epoch.  A writer never waits
+ * for readers.
+ *
+ * Published maps are held in copy-on-write mode (see KArgMap::cowClone), so
+ * the writer may keep modifying its handle, or any other handle to the same
+ * storage, without affecting readers.
+ */
+class KArgMapPublisher {
+  struct Snapshot {
+    Snapshot(const KArgMap &m, uint64_t v) : map(m), version(v) {}
+    KArgMap map;
+    uint64_t version;
+    Snapshot *nextRetired = nullptr;
+    uint64_t retiredEpoch = 0;
+  };
+
+  /// The epoch a reader entered in, 0 while it is not reading.  Padded so
+  /// the epochs of two readers are never on the same cache line.
+  struct Slot {
+    std::atomic<uint64_t> epoch{0};
+    std::atomic<bool> inUse{true};
+    Slot *next = nullptr;
+    char padding[64];
+  };
+
+public:
+  class Reader;
+
+  /// A consistent snapshot, valid while the guard is alive.
+  class Guard {
+  public:
+    Guard(Guard &&other) K_NOEXCEPT : m_slot(other.m_slot),
+                                      m_snapshot(other.m_snapshot) {
+      other.m_slot = nullptr;
+    }
+    ~Guard() {
+      if (m_slot) {
+        m_slot->epoch.store(0, std::memory_order_release);
+      }
+    }
+
+    const KArgMap &operator*() const { return m_snapshot->map; }
+    const KArgMap *operator->() const { return &m_snapshot->map; }
+
+    /// The number of publish() calls before this snapshot, 0 for the first.
+    uint64_t version() const { return m_snapshot->version; }
+
+  private:
+    friend class Reader;
+    Guard(Slot *slot, Snapshot *snapshot)
+        : m_slot(slot), m_snapshot(snapshot) {}
+    Guard(const Guard &) = delete;
+    Guard &operator=(const Guard &) = delete;
+
+    Slot *m_slot;
+    Snapshot *m_snapshot;
+  };
+
+  /**
+   * \brief A reader registered with a publisher.  Create one per reading
+   * thread and keep it for as long as the thread reads; a Reader must not be
+   * used by two threads at once.  Guards must not be nested.
+   */
+  class Reader {
+  public:
+    explicit Reader(KArgMapPublisher &publisher)
+        : m_publisher(publisher), m_slot(publisher.acquireSlot()) {}
+    ~Reader() { m_slot->inUse.store(false, std::memory_order_release); }
+
+    /// The current snapshot.  Wait-free.
+    Guard read() {
+      m_slot->epoch.store(
+          m_publisher.m_epoch.load(std::memory_order_seq_cst),
+          std::memory_order_seq_cst);
+      return Guard(m_slot,
+                   m_publisher.m_current.load(std::memory_order_seq_cst));
+    }
+
+  private:
+    Reader(const Reader &) = delete;
+    Reader &operator=(const Reader &) = delete;
+
+    KArgMapPublisher &m_publisher;
+    Slot *m_slot;
+  };
+
+  explicit KArgMapPublisher(const KArgMap &map = KArgMap())
+      : m_current(new Snapshot(map.cowClone(), 0)) {}
+
+  /// All readers must have been destroyed.
+  ~KArgMapPublisher() {
+    delete m_current.load(std::memory_order_relaxed);
+    reclaim(true);
+    for (Slot *slot = m_slots.load(); slot;) {
+      Slot *next = slot->next;
+      delete slot;
+      slot = next;
+    }
+  }
+
+  /**
+   * \brief Make map the current snapshot.  Readers that already hold a guard
+   * keep their snapshot.  Snapshots no reader can still hold are freed.
+   */
+  void publish(const KArgMap &map) {
+    std::lock_guard<std::mutex> lock(m_writer);
+    publishLocked(map);
+  }
+
+  /**
+   * \brief Publish the current snapshot as modified by f(KArgMap &).  The
+   * snapshot is not copied; f modifies a copy-on-write handle, which copies
+   * only the containers along the paths it changes.  Concurrent updates are
+   * applied one after another.
+   */
+  template <typename F> void update(F f) {
+    std::lock_guard<std::mutex> lock(m_writer);
+    KArgMap next = m_current.load(std::memory_order_relaxed)->map;
+    f(next);
+    publishLocked(next);
+  }
+
+  /**
+   * \brief A handle to the current snapshot for occasional use, e.g. by the
+   * writer.  It keeps the snapshot alive on its own but copying it updates a
+   * shared reference count, so frequent readers should use a Reader.
+   */
+  KArgMap snapshot() {
+    std::lock_guard<std::mutex> lock(m_writer);
+    return m_current.load(std::memory_order_relaxed)->map;
+  }
+
+  /// The number of replaced snapshots not yet freed.
+  size_t retired() {
+    std::lock_guard<std::mutex> lock(m_writer);
+    size_t count = 0;
+    for (Snapshot *s = m_retired; s; s = s->nextRetired) {
+      count++;
+    }
+    return count;
+  }
+
+private:
+  void publishLocked(const KArgMap &map) {
+    Snapshot *old = m_current.load(std::memory_order_relaxed);
+    Snapshot *next = new Snapshot(map.cowClone(), old->version + 1);
+    m_current.store(next, std::memory_order_seq_cst);
+    // readers that entered in a later epoch cannot have seen old
+    old->retiredEpoch = m_epoch.fetch_add(1, std::memory_order_seq_cst);
+    old->nextRetired = m_retired;
+    m_retired = old;
+    reclaim(false);
+  }
+
+  /// Free the retired snapshots no reader can hold, or all of them if force.
+  void reclaim(bool force) {
+    uint64_t oldest = UINT64_MAX;
+    if (!force) {
+      for (Slot *slot = m_slots.load(std::memory_order_acquire); slot;
+           slot = slot->next) {
+        uint64_t epoch = slot->epoch.load(std::memory_order_seq_cst);
+        if (epoch != 0 && epoch < oldest) {
+          oldest = epoch;
+        }
+      }
+    }
+    Snapshot **link = &m_retired;
+    while (*link) {
+      Snapshot *s = *link;
+      if (s->retiredEpoch < oldest) {
+        *link = s->nextRetired;
+        delete s;
+      } else {
+        link = &s->nextRetired;
+      }
+    }
+  }
+
+  /// A free slot, or a new one added to the list.
+  Slot *acquireSlot() {
+    for (Slot *slot = m_slots.load(std::memory_order_acquire); slot;
+         slot = slot->next) {
+      bool expected = false;
+      if (!slot->inUse.load(std::memory_order_relaxed) &&
+          slot->inUse.compare_exchange_strong(expected, true,
+                                              std::memory_order_acquire)) {
+        return slot;
+      }
+    }
+    Slot *slot = new Slot();
+    slot->next = m_slots.load(std::memory_order_relaxed);
+    while (!m_slots.compare_exchange_weak(slot->next, slot,
+                                          std::memory_order_release)) {
+    }
+    return slot;
+  }
+
+  std::atomic<Snapshot *> m_current;
+  std::atomic<uint64_t> m_epoch{1};
+  std::atomic<Slot *> m_slots{nullptr};
+  std::mutex m_writer;               ///< serializes publish() and update()
+  Snapshot *m_retired = nullptr;     ///< replaced snapshots, newest first
+};
+
+} // namespace entazza
@@ -0,0 +1,223 @@
+// SPDX-License-Identifier: BSD-3-Clause
+#pragma once
+
+#include "kargmap/KArgMap.hpp"
+#include <functional>
+#include <set>
+#include <vector>
+
+namespace entazza {
+
+/**
+ * \brief A KArgMap that reports changes to subscribers.
+ *
+ * A subscriber names a key or '|' path and is told about changes at, below
+ * or above it: subscribing to "net" reports set("net|port", ...) and
+ * subscribing to "net|port" reports erase("net").  The empty path matches
+ * every change.
+ *
+ * Changes are collected per transaction.  When the outermost Transaction
+ * ends each subscriber with matching changes is called once with the sorted,
+ * de-duplicated list of changed paths.  A change made outside a transaction
+ * is delivered at once, as a transaction of its own.  operator[] counts as a
+ * change of its key whether or not the returned value is written; as the
+ * write happens after it returns, outside a transaction that change is held
+ * back until the next change, the end of the next transaction or flush(), so
+ * callbacks see the written value.
+ *
+ * An exception thrown by a callback propagates out of the call that
+ * delivered the changes; changes not yet delivered stay pending.  Callbacks
+ * run by ~Transaction must not throw.
+ *
+ * Changes must be made through this class; writes through other handles to
+ * the same storage are not seen.  Without subscribers a change costs one
+ * check.  Like KArgMap, the class is not thread-safe.
+ */
+class KArgObservableMap {
+public:
+  /// Called with the changed paths that match the subscription.
+  typedef std::function<void(const std::vector<k_map_string_t> &paths)>
+      Callback;
+
+  /**
+   * \brief Collects changes until the outermost transaction ends and then
+   * delivers them.  Transactions may be nested.
+   */
+  class Transaction {
+  public:
+    explicit Transaction(KArgObservableMap &map) : m_map(map) {
+      m_map.m_depth++;
+    }
+    ~Transaction() {
+      if (--m_map.m_depth == 0) {
+        m_map.deliver();
+      }
+    }
+
+  private:
+    Transaction(const Transaction &) = delete;
+    Transaction &operator=(const Transaction &) = delete;
+
+    KArgObservableMap &m_map;
+  };
+
+  KArgObservableMap() {}
+
+  /// Observe changes made through this object to map's storage.
+  explicit KArgObservableMap(const KArgMap &map) : m_map(map) {}
+
+  /**
+   * \brief Call callback after each transaction that changes path or a path
+   * above or below it.
+   * \return An id for unsubscribe().
+   */
+  size_t subscribe(const k_map_string_t &path, Callback callback) {
+    m_observers.push_back(Observer{++m_lastId, path, std::move(callback)});
+    return m_lastId;
+  }
+
+  void unsubscribe(size_t id) {
+    for (auto it = m_observers.begin(); it != m_observers.end(); ++it) {
+      if (it->id == id) {
+        m_observers.erase(it);
+        return;
+      }
+    }
+  }
+
+  /// The map, for reading.
+  const KArgMap &map() const { return m_map; }
+
+  template <typename T>
+  auto get(const KArgKey &key, T defaultValue) const
+      -> decltype(std::declval<const KArgMap &>().get(key, defaultValue)) {
+    return m_map.get(key, defaultValue);
+  }
+
+  bool containsKey(const KArgKey &key) const { return m_map.containsKey(key); }
+
+  const KArgVariant &operator[](const KArgKey &key) const {
+    return static_cast<const KArgMap &>(m_map)[key];
+  }
+
+  size_t size() const { return m_map.size(); }
+
+  bool empty() const { return m_map.empty(); }
+
+  template <typename T> void set(const KArgKey &key, T &&value) {
+    m_map.set(key, std::forward<T>(value));
+    changed(key.view());
+  }
+
+  /// Store value unless key holds one (see KArgMap::emplace).  Reported as a
+  /// change only if value was stored.
+  template <typename T>
+  std::pair<KArgVariant &, bool> emplace(const KArgKey &key, T &&value) {
+    auto result = m_map.emplace(key, std::forward<T>(value));
+    if (result.second) {
+      changed(key.view());
+    }
+    return result;
+  }
+
+  /**
+   * \brief The value of key, created if it does not exist.  Reported as a
+   * change once the value can have been written: at the end of the open
+   * transaction or, outside one, with the next change or flush().
+   */
+  KArgVariant &operator[](const KArgKey &key) {
+    KArgVariant &item = m_map[key];
+    changed(key.view(), true);
+    return item;
+  }
+
+  /// Deliver changes held back by operator[].  Inside a transaction they are
+  /// delivered when it ends.
+  void flush() {
+    if (m_depth == 0 && !m_pending.empty()) {
+      deliver();
+    }
+  }
+
+  size_t erase(const KArgKey &key) {
+    size_t count = m_map.erase(key);
+    if (count) {
+      changed(key.view());
+    }
+    return count;
+  }
+
+  /// Remove every key, reported as a change of the empty path.
+  void clear() {
+    m_map.clear();
+    changed(k_string_view(""));
+  }
+
+private:
+  struct Observer {
+    size_t id;
+    k_map_string_t path;
+    Callback callback;
+  };
+
+  void changed(k_string_view path, bool deferred = false) {
+    if (m_observers.empty()) {
+      return;
+    }
+    m_pending.insert(k_map_string_t(path.data(), path.size()));
+    if (m_depth == 0 && !deferred) {
+      deliver();
+    }
+  }
+
+  /// True if a change of path affects the subscription to observed.
+  static bool matches(const k_map_string_t &observed,
+                      const k_map_string_t &path) {
+    auto within = [](const k_map_string_t &inner,
+                     const k_map_string_t &outer) {
+      return outer.empty() ||
+             (inner.size() >= outer.size() &&
+              inner.compare(0, outer.size(), outer) == 0 &&
+              (inner.size() == outer.size() || inner[outer.size()] == '|'));
+    };
+    return within(path, observed) || within(observed, path);
+  }
+
+  /// Keeps the map inside a transaction while callbacks run, also when one
+  /// throws.
+  struct DeliveryScope {
+    explicit DeliveryScope(int &depth) : m_depth(depth) { m_depth++; }
+    ~DeliveryScope() { m_depth--; }
+    int &m_depth;
+  };
+
+  /// Deliver the pending changes, and any made by the callbacks.
+  void deliver() {
+    // changes made by callbacks form the next batch
+    DeliveryScope scope(m_depth);
+    while (!m_pending.empty()) {
+      std::set<k_map_string_t> pending;
+      pending.swap(m_pending);
+      auto observers = m_observers;
+      for (auto const &observer : observers) {
+        std::vector<k_map_string_t> paths;
+        for (auto const &path : pending) {
+          if (matches(observer.path, path)) {
+            paths.push_back(path);
+          }
+        }
+        if (!paths.empty()) {
+          observer.callback(paths);
+        }
+      }
+    }
+  }
+
+  KArgMap m_map;
+  std::vector<Observer> m_observers;
+  std::set<k_map_string_t> m_pending; ///< changes of the open transaction
+  size_t m_lastId = 0;
+  int m_depth = 0; ///< nesting of open transactions
+};
+
+} // namespace entazza
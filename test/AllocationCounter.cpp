@@ -0,0 +1,17 @@
+// SPDX-License-Identifier: BSD-3-Clause
+#include "AllocationCounter.hpp"
+#include <cstdlib>
+#include <new>
+
+std::atomic<size_t> g_allocationCount{0};
+
+void *operator new(size_t size) {
+  g_allocationCount++;
+  if (void *p = std::malloc(size ? size : 1)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete(void *p, size_t) noexcept { std::free(p); }
@@ -0,0 +1,11 @@
+// SPDX-License-Identifier: BSD-3-Clause
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+
+/// The number of calls to the global operator new, so tests can check that
+/// lookups do not allocate.  The replacement operators live in their own
+/// translation unit so the compiler never pairs their malloc and free with
+/// the inlined new and delete expressions of the tests.
+extern std::atomic<size_t> g_allocationCount;
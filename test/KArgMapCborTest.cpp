@@ -11,6 +11,8 @@
 
 #include "gtest/gtest.h"
 #include <kargmap/CborSerializer.hpp>
+#include <kargmap/CborEventReader.hpp>
+#include <kargmap/CborStreamDecoder.hpp>
 #include <kargmap/KArgMap.hpp>
 
 namespace entazza {
@@ -154,6 +156,304 @@ TEST(KArgMapCborTest, list) {
   ASSERT_EQ("test", list[1].get("fail"));
 }
 
+TEST(KArgMapCborTest, decodeIntoArena) {
+  KArgMap map;
+  map.set("child|a", int16_t(1234));
+  map.set("list", KArgList{KArgMap{{"b", "itemb"}}, 2});
+
+  uint8_t buffer[4096];
+  CborSerializer coder(buffer, sizeof(buffer));
+  coder.encode(map);
+
+  KArgArena arena;
+  CborSerializer decoder(buffer, sizeof(buffer));
+  auto map2 = decoder.decode(arena);
+
+  ASSERT_EQ(&arena, map2.arena());
+  ASSERT_EQ(&arena, map2.get("child", KArgMap()).arena());
+  auto list = map2.get("list", KArgList());
+  ASSERT_EQ(&arena, list.arena());
+  ASSERT_EQ(&arena, list.get(0, KArgMap()).arena());
+  ASSERT_EQ(1234, map2.get("child|a", -1));
+  ASSERT_EQ("itemb", map2.get("list|0|b", "fail"));
+  ASSERT_EQ(2, map2.get("list|1", -1));
+}
+
+TEST(KArgMapCborTest, persistentMap) {
+  KArgPersistentMap map;
+  map = map.with("a", 1).with("child", KArgMap{{"b", "itemb"}});
+
+  uint8_t buffer[4096];
+  CborSerializer coder(buffer, sizeof(buffer));
+  coder.encode(map);
+
+  CborSerializer decoder(buffer, sizeof(buffer));
+  KArgPersistentMap map2(decoder.decode());
+  ASSERT_EQ(2, map2.size());
+  ASSERT_EQ(1, map2.get("a", -1));
+  ASSERT_EQ("itemb", map2.get("child", KArgMap()).get("b", "fail"));
+}
+
+TEST(KArgMapCborTest, encodedSize) {
+  KArgMap map;
+  map.set("s", "test");
+  map.set("long", std::string(300, 'x'));
+  map.set("child|a", int16_t(1234));
+  map.set("flags", std::vector<bool>{true, false, true});
+  map.set("names", std::vector<std::string>{"a", "bc"});
+  map.set("list", KArgList{KArgMap{{"b", "itemb"}}, 2});
+
+  uint8_t buffer[4096];
+  CborSerializer coder(buffer, sizeof(buffer));
+  auto size = coder.encodedSize(map);
+  ASSERT_EQ(0, int(coder.encode(map)));
+  ASSERT_EQ(coder.bytesSerialized(), size);
+
+  // the buffer is usable afterwards
+  coder.restart();
+  ASSERT_EQ(size, coder.encodedSize(map));
+  coder.encode(map);
+  CborSerializer decoder(buffer, sizeof(buffer));
+  ASSERT_EQ("itemb", decoder.decode().get("list|0|b", "fail"));
+}
+
+TEST(KArgMapCborTest, encodeToVector) {
+  KArgMap map;
+  for (int i = 0; i < 100; i++) {
+    map.set("child|k" + std::to_string(i), "value " + std::to_string(i));
+  }
+  map.set("list", KArgList{KArgMap{{"b", "itemb"}}, 2});
+
+  uint8_t unused[1];
+  CborSerializer coder(unused, sizeof(unused));
+  std::vector<uint8_t> out{0xAA}; // appended to, not replaced
+  ASSERT_EQ(0, int(coder.encode(map, out)));
+  ASSERT_EQ(0xAA, out[0]);
+
+  CborSerializer decoder(out.data() + 1, uint32_t(out.size() - 1));
+  auto map2 = decoder.decode();
+  ASSERT_EQ("value 99", map2.get("child|k99", "fail"));
+  ASSERT_EQ("itemb", map2.get("list|0|b", "fail"));
+  ASSERT_EQ(2, map2.get("list|1", -1));
+}
+
+TEST(KArgMapCborTest, projectedDecode) {
+  std::vector<uint8_t> out;
+  uint8_t unused[1];
+  CborSerializer coder(unused, sizeof(unused));
+  for (int seq = 0; seq < 2; seq++) {
+    KArgMap header{{"seq", seq}, {"source", "sensor"}};
+    header.set("when", KTimestamp(std::chrono::seconds(10)));
+    KArgMap map;
+    map.set("header", header);
+    for (int i = 0; i < 200; i++) {
+      map.set("k" + std::to_string(i), "value " + std::to_string(i));
+    }
+    map.set("samples", KArgList{KArgMap{{"value", 1.5}},
+                                KArgMap{{"value", seq + 10}, {"unit", "C"}},
+                                KArgMap{{"value", 3}}});
+    map.set("payload", std::vector<int32_t>{1, 2, 3});
+    ASSERT_EQ(0, int(coder.encode(map, out)));
+  }
+
+  CborProjection projection{"header|seq", "samples|1|value", "payload",
+                            "missing|key"};
+  CborSerializer decoder(out.data(), uint32_t(out.size()));
+  for (int seq = 0; seq < 2; seq++) {
+    auto map = decoder.decode(projection);
+    ASSERT_EQ(3, map.size());
+    ASSERT_EQ(seq, map.get("header|seq", -1));
+    ASSERT_EQ(1, map.get("header", KArgMap()).size());
+    // list positions are kept up to the last wanted element
+    auto samples = map.get("samples", KArgList());
+    ASSERT_EQ(2, samples.size());
+    ASSERT_EQ(KArgTypes::null, samples[0].m_type);
+    ASSERT_EQ(seq + 10, map.get("samples|1|value", -1));
+    ASSERT_FALSE(map.containsKey("samples|1|unit"));
+    ASSERT_EQ(2, map.get("payload", std::shared_ptr<std::vector<int32_t>>())->at(1));
+  }
+  ASSERT_EQ(out.size(), decoder.bytesSerialized());
+
+  // the empty path, or a path above the others, takes everything below it
+  decoder.initBuffer((const void *)out.data(), uint32_t(out.size()));
+  ASSERT_EQ(203, decoder.decode(CborProjection{""}).size());
+  decoder.initBuffer((const void *)out.data(), uint32_t(out.size()));
+  auto header = decoder.decode(CborProjection{"header|seq", "header"});
+  ASSERT_EQ(3, header.get("header", KArgMap()).size());
+}
+
+TEST(KArgMapCborTest, encodeToSink) {
+  KArgMap map;
+  for (int i = 0; i < 100; i++) {
+    map.set("k" + std::to_string(i), i);
+  }
+  map.set("long", std::string(500, 'x')); // larger than the buffer
+
+  uint8_t buffer[64];
+  CborSerializer coder(buffer, sizeof(buffer));
+  std::vector<uint8_t> out;
+  size_t chunks = 0;
+  auto result = coder.encode(map, [&](const uint8_t *data, size_t size) {
+    out.insert(out.end(), data, data + size);
+    chunks++;
+  });
+  ASSERT_EQ(0, int(result));
+  ASSERT_GT(chunks, 10);
+
+  std::vector<uint8_t> whole;
+  coder.encode(map, whole);
+  ASSERT_EQ(whole, out);
+
+  CborSerializer decoder(out.data(), uint32_t(out.size()));
+  auto map2 = decoder.decode();
+  ASSERT_EQ(99, map2.get("k99", -1));
+  ASSERT_EQ(500, map2.get("long", "").size());
+}
+
+TEST(KArgMapCborTest, streamDecoder) {
+  std::vector<uint8_t> stream;
+  for (int i = 0; i < 3; i++) {
+    KArgMap map;
+    map.set("i", i);
+    map.set("name", "message " + std::to_string(i));
+    map.set("child|pts", std::vector<int32_t>{1, 2, 3});
+    map.set("list", KArgList{KArgMap{{"b", "itemb"}}, -2, 1.5});
+    map.set("when", KTimestamp(std::chrono::milliseconds(1125)));
+    map.set("flags", std::vector<bool>{true, false});
+    uint8_t buffer[1024];
+    CborSerializer coder(buffer, sizeof(buffer));
+    ASSERT_EQ(0, int(coder.encode(map)));
+    stream.insert(stream.end(), buffer, buffer + coder.bytesSerialized());
+  }
+
+  // any chunk size decodes the same maps
+  for (size_t chunk : {size_t(1), size_t(7), stream.size()}) {
+    std::vector<KArgMap> maps;
+    CborStreamDecoder decoder([&](KArgMap map) { maps.push_back(map); });
+    for (size_t i = 0; i < stream.size(); i += chunk) {
+      ASSERT_TRUE(decoder.feed(stream.data() + i,
+                               std::min(chunk, stream.size() - i)));
+    }
+    ASSERT_TRUE(decoder.idle());
+    ASSERT_EQ(3, maps.size());
+    CborSerializer reference(stream.data(), uint32_t(stream.size()));
+    for (int i = 0; i < 3; i++) {
+      ASSERT_TRUE(maps[i] == reference.decode());
+      ASSERT_EQ("message " + std::to_string(i), maps[i].get("name", ""));
+    }
+    ASSERT_EQ(2, maps[2].get("child|pts", std::shared_ptr<std::vector<int32_t>>())->at(1));
+  }
+
+  CborStreamDecoder decoder([](KArgMap) {});
+  const uint8_t reserved = 0x1c;
+  ASSERT_FALSE(decoder.feed(&reserved, 1));
+  decoder.reset();
+  ASSERT_TRUE(decoder.feed(stream.data(), 5));
+  ASSERT_FALSE(decoder.idle());
+}
+
+TEST(KArgMapCborTest, eventReader) {
+  KArgMap map;
+  map.set("name", "a name longer than fifteen");
+  KArgMap child;
+  child.set("pts", std::vector<int32_t>{1, 2, 3});
+  map.set("child", child);
+  map.set("list", KArgList{-2, 1.5, true, KArgVariant()});
+  map.set("when", KTimestamp(std::chrono::milliseconds(1125)));
+  uint8_t buffer[1024];
+  CborSerializer coder(buffer, sizeof(buffer));
+  ASSERT_EQ(0, int(coder.encode(map)));
+  size_t size = coder.bytesSerialized();
+
+  struct Recorder : CborEventHandler {
+    std::string events;
+    k_string_view name;
+    bool onMapStart(size_t) { return events += "{", true; }
+    bool onListStart(size_t) { return events += "[", true; }
+    bool onEnd() { return events += "}", true; }
+    bool onKey(k_string_view key) {
+      events += std::string(key.data(), key.size()) + ":";
+      return true;
+    }
+    bool onInt(int64_t value) { return events += std::to_string(value) + ",", true; }
+    bool onFloat(double value) { return events += "f" + std::to_string(int(value * 10)) + ",", true; }
+    bool onBool(bool value) { return events += value ? "t," : "f,", true; }
+    bool onNull() { return events += "n,", true; }
+    bool onString(k_string_view value) { return name = value, events += "s,", true; }
+    bool onTypedArray(KArgTypes type, const void *data, size_t count) {
+      int32_t second;
+      std::memcpy(&second, (const char *)data + 4, 4);
+      events += (type == KArgTypes::int32 ? "i32x" : "?x") + std::to_string(count) +
+                "=" + std::to_string(second) + ",";
+      return true;
+    }
+    bool onTimestamp(KTimestamp value) {
+      events += "ms" + std::to_string(std::chrono::duration_cast<std::chrono::milliseconds>(
+                                          value.time_since_epoch()).count()) + ",";
+      return true;
+    }
+  } recorder;
+  CborEventReader reader(buffer, size);
+  ASSERT_EQ(CborEventReader::Result::done, reader.read(recorder));
+  ASSERT_TRUE(reader.atEnd());
+  // the order of keys is the order of the map
+  for (auto event : {"name:s,", "child:{pts:i32x3=2,}", "list:[-2,f15,t,n,}",
+                     "when:ms1125,"}) {
+    ASSERT_NE(std::string::npos, recorder.events.find(event)) << recorder.events;
+  }
+  // strings are not copied
+  ASSERT_EQ(k_string_view("a name longer than fifteen"), recorder.name);
+  ASSERT_TRUE(recorder.name.data() > (const char *)buffer &&
+              recorder.name.data() < (const char *)buffer + size);
+
+  // a handler can stop at the value it wants
+  struct Finder : CborEventHandler {
+    bool found = false;
+    std::vector<int32_t> pts;
+    bool onKey(k_string_view key) { return found = key == k_string_view("pts"), true; }
+    bool onTypedArray(KArgTypes, const void *data, size_t count) {
+      if (!found) {
+        return true;
+      }
+      pts.resize(count);
+      std::memcpy(pts.data(), data, count * sizeof(int32_t));
+      return false;
+    }
+  } finder;
+  CborEventReader again(buffer, size);
+  ASSERT_EQ(CborEventReader::Result::stopped, again.read(finder));
+  ASSERT_EQ((std::vector<int32_t>{1, 2, 3}), finder.pts);
+
+  CborEventHandler ignore;
+  CborEventReader truncated(buffer, size - 1);
+  ASSERT_EQ(CborEventReader::Result::malformed, truncated.read(ignore));
+
+  // a tagged top level item is read whole: self-described CBOR (55799) and
+  // a timestamp of 2.5 seconds, one after the other
+  const uint8_t tagged[] = {0xd9, 0xd9, 0xf7, 0xa1, 0x61, 'a', 0x01,
+                            0xd9, 0x03, 0xe9, 0xa2, 0x01, 0x02, 0x28,
+                            0x1a, 0x1d, 0xcd, 0x65, 0x00};
+  Recorder top;
+  CborEventReader sequence(tagged, sizeof(tagged));
+  ASSERT_EQ(CborEventReader::Result::done, sequence.read(top));
+  ASSERT_EQ("{a:1,}", top.events);
+  ASSERT_EQ(CborEventReader::Result::done, sequence.read(top));
+  ASSERT_EQ("{a:1,}ms2500,", top.events);
+  ASSERT_TRUE(sequence.atEnd());
+
+  // a tag on a key is skipped, a tag with no item after it is malformed
+  const uint8_t taggedKey[] = {0xa1, 0xd8, 0x20, 0x61, 'k', 0x02};
+  Recorder key;
+  CborEventReader keys(taggedKey, sizeof(taggedKey));
+  ASSERT_EQ(CborEventReader::Result::done, keys.read(key));
+  ASSERT_EQ("{k:2,}", key.events);
+  const uint8_t danglingTag[] = {0xbf, 0xd8, 0x20, 0xff};
+  CborEventReader dangling(danglingTag, sizeof(danglingTag));
+  ASSERT_EQ(CborEventReader::Result::malformed, dangling.read(ignore));
+  CborEventReader tagOnly(tagged, 3);
+  ASSERT_EQ(CborEventReader::Result::malformed, tagOnly.read(ignore));
+}
+
 TEST(KArgMapCborTest, basic_s) {
   KArgMap map;
   map.set("s", "test");
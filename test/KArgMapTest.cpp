@@ -1,8 +1,18 @@
 // SPDX-License-Identifier: BSD-3-Clause
+#include <atomic>
 #include <chrono>
 #include <cstdio>
+#include <sstream>
+#include <stdexcept>
+#include <unordered_set>
 
 #include "kargmap/KArgMap.hpp"
+#include "kargmap/KArgObservableMap.hpp"
+#ifndef K_SINGLE_THREADED
+#include "kargmap/KArgConcurrentMap.hpp"
+#include "kargmap/KArgMapPublisher.hpp"
+#endif
+#include "AllocationCounter.hpp"
 #include "gtest/gtest.h"
 #include <thread>
 
@@ -21,6 +31,10 @@ protected:
   int64_t m_startEventTime;
   std::chrono::time_point<std::chrono::steady_clock> m_startTimestamp;
 
+  /// The storage behind a handle, to check what is shared.
+  static const void *storage(const KArgMap &m) { return m.m_map.get(); }
+  static const void *storage(const KArgList &l) { return l.m_list.get(); }
+
   // You can remove any or all of the following functions if its body
   // is empty.
 
@@ -149,6 +163,888 @@ TEST_F(KArgMapTest, containsKey) {
   ASSERT_TRUE(m.containsKey("hello"));
   ASSERT_TRUE(m.containsKey("i32"));
 }
+
+TEST_F(KArgMapTest, eraseAndIterate) {
+  KArgMap m;
+  for (int i = 0; i < 100; i++) {
+    m.set("key" + std::to_string(i), i);
+  }
+  ASSERT_EQ(100, m.size());
+  for (int i = 0; i < 100; i += 2) {
+    ASSERT_EQ(1, m.erase("key" + std::to_string(i)));
+  }
+  ASSERT_EQ(0, m.erase("key0"));
+  ASSERT_EQ(50, m.size());
+
+  int sum = 0;
+  size_t count = 0;
+  for (auto &item : m) {
+    ASSERT_EQ(item.first, "key" + std::to_string(item.second.get(-1)));
+    sum += item.second.get(0);
+    count++;
+  }
+  ASSERT_EQ(50, count);
+  ASSERT_EQ(2500, sum); // 1 + 3 + ... + 99
+  for (int i = 0; i < 100; i++) {
+    ASSERT_EQ(i % 2 == 1, m.containsKey("key" + std::to_string(i)));
+    ASSERT_EQ(i % 2 == 1 ? i : -1, m.get("key" + std::to_string(i), -1));
+  }
+}
+
+TEST_F(KArgMapTest, flatHashMap) {
+  KArgMapInternal::k_flat_hash_map<std::string, int> map{{"a", 1}, {"b", 2}};
+  ASSERT_EQ(2, map.size());
+  ASSERT_EQ(1, map.find("a")->second);
+  ASSERT_TRUE(map.find("c") == map.end());
+  ASSERT_FALSE(map.emplace("a", 3).second);
+  ASSERT_EQ(1, map["a"]);
+  map["c"] = 3;
+  ASSERT_EQ(3, map.size());
+
+  // erase while iterating
+  for (auto it = map.begin(); it != map.end();) {
+    if (it->second != 2) {
+      it = map.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  ASSERT_EQ(1, map.size());
+  ASSERT_EQ(2, map.find("b")->second);
+
+  // grow well past the initial bucket count and shrink again
+  for (int i = 0; i < 1000; i++) {
+    map[std::to_string(i)] = i;
+  }
+  for (int i = 0; i < 1000; i += 3) {
+    ASSERT_EQ(1, map.erase(std::to_string(i)));
+  }
+  for (int i = 0; i < 1000; i++) {
+    ASSERT_EQ(i % 3 == 0 ? 0 : 1, map.count(std::to_string(i)));
+  }
+  map.clear();
+  ASSERT_TRUE(map.empty());
+  ASSERT_TRUE(map.find("b") == map.end());
+
+  // keys sharing length, first and last byte cross the small map limit
+  for (int i = 0; i < 40; i++) {
+    map["k" + std::to_string(100 + i) + "k"] = i;
+    for (int j = 0; j <= i; j++) {
+      ASSERT_EQ(j, map.find("k" + std::to_string(100 + j) + "k")->second);
+    }
+  }
+  ASSERT_TRUE(map.find("k099k") == map.end());
+}
+
+TEST_F(KArgMapTest, smallMapErase) {
+  KArgMapInternal::k_flat_hash_map<std::string, int> map;
+  for (int i = 0; i < 6; i++) {
+    map["key" + std::to_string(i)] = i;
+  }
+  ASSERT_EQ(1, map.erase("key0"));
+  ASSERT_EQ(0, map.erase("key0"));
+  ASSERT_EQ(1, map.erase("key3"));
+  ASSERT_EQ(4, map.size());
+  for (int i = 0; i < 6; i++) {
+    ASSERT_EQ(i == 0 || i == 3 ? 0 : 1, map.count("key" + std::to_string(i)));
+  }
+  map[""] = 7;
+  ASSERT_EQ(7, map.find("")->second);
+}
+
+TEST_F(KArgMapTest, keys) {
+  constexpr KArgKey speed = "speed"_k;
+  static_assert(speed.size() == 5, "literal key length");
+  ASSERT_EQ(KArgMapInternal::k_hash("speed", 5), speed.hash());
+  ASSERT_EQ(KArgKey(std::string("speed")).hash(), speed.hash());
+  ASSERT_FALSE(speed.isPath());
+  ASSERT_TRUE("ship|name"_k.isPath());
+  ASSERT_TRUE(KArgKey("ship|name").isPath());
+
+  // long literals stay within the constexpr depth limit
+#define K_KEY_40 "a key of forty characters, ten times...."
+#define K_KEY_400                                                              \
+  K_KEY_40 K_KEY_40 K_KEY_40 K_KEY_40 K_KEY_40 K_KEY_40 K_KEY_40 K_KEY_40      \
+      K_KEY_40 K_KEY_40
+  constexpr KArgKey longKey =
+      K_KEY_400 K_KEY_400 K_KEY_400 K_KEY_400 K_KEY_400 "|tail"_k;
+  static_assert(longKey.size() == 2005, "long literal key length");
+  ASSERT_EQ(KArgMapInternal::k_hash(longKey.data(), 2005), longKey.hash());
+  ASSERT_TRUE(longKey.isPath());
+  ASSERT_FALSE(KArgKey(longKey.data(), 2000).isPath());
+  ASSERT_EQ(KArgMapInternal::k_hash(longKey.data(), 2000),
+            KArgKey(longKey.data(), 2000).hash());
+#undef K_KEY_400
+#undef K_KEY_40
+
+  KArgMap m;
+  m.set(speed, 1.5);
+  m.set("ship|name"_k, "enterprise");
+  m.set(std::string("crew"), 430);
+  ASSERT_TRUE(m.containsKey("speed"));
+  ASSERT_TRUE(m.containsKey("crew"_k));
+  ASSERT_EQ(1.5, m.get(speed, 0.0));
+  ASSERT_EQ(1.5, m["speed"_k].get(0.0));
+  ASSERT_EQ("enterprise", m.get("ship|name"_k, ""));
+  ASSERT_EQ(430, m.get("crew"_k, 0));
+  ASSERT_EQ(0, m.get("missing"_k, 0));
+  ASSERT_FALSE(m.containsKey("missing"_k));
+  ASSERT_EQ(1, m.erase("crew"_k));
+  ASSERT_EQ(0, m.erase("crew"_k));
+  ASSERT_EQ(2, m.size());
+}
+
+TEST_F(KArgMapTest, lookupsDoNotAllocate) {
+  KArgMap inner{{"an_inner_key_longer_than_sso", 2.5}};
+  KArgMap m{{"a_key_longer_than_sso", 42}, {"another_key_longer_than_sso", inner}};
+  const std::string key("a_key_longer_than_sso");
+  const KArgMap &c = m;
+
+  const KArgPath path("another_key_longer_than_sso|an_inner_key_longer_than_sso");
+
+  // the first lookup may size the per-thread key buffer of C++11 builds
+  ASSERT_FALSE(
+      c.containsKey("a_lookup_key_that_is_longer_than_any_key_or_path_in_this_test"));
+
+  size_t before = g_allocationCount;
+  int sum = c.get(key, 0);
+  sum += c.containsKey(key) ? 1 : 0;
+  auto d0 = c.get(path, 0.0);
+  ASSERT_EQ(before, g_allocationCount);
+  ASSERT_EQ(2.5, d0);
+
+  before = g_allocationCount;
+  sum += c.get("a_key_longer_than_sso", 0);
+  sum += c.get("a_key_longer_than_sso"_k, 0);
+  sum += c.get(k_string_view("a_key_longer_than_sso"), 0);
+  sum += c.containsKey("another_key_longer_than_sso") ? 1 : 0;
+  sum += c.containsKey("not_a_key_but_longer_than_sso") ? 1 : 0;
+  auto d = c.get("another_key_longer_than_sso|an_inner_key_longer_than_sso",
+                 0.0);
+  auto d2 = c.get("another_key_longer_than_sso|not_a_key_longer_than_sso",
+                  1.0);
+#if defined(K_ALLOCATION_FREE_LOOKUP) || !defined(K_THREAD_LOCAL_UNSUPPORTED)
+  ASSERT_EQ(before, g_allocationCount);
+#endif
+  ASSERT_EQ(42 * 4 + 2, sum);
+  ASSERT_EQ(2.5, d);
+  ASSERT_EQ(1.0, d2);
+  // reading a missing path does not create it
+  ASSERT_EQ(1, inner.size());
+  ASSERT_EQ(2, m.size());
+}
+
+TEST_F(KArgMapTest, compiledPath) {
+  KArgMap m;
+  m.set("ship|crew|0|name", "Kirk");
+  const KArgPath name("ship|crew|0|name");
+  const KArgPath cachedName("ship|crew|0|name", true);
+  ASSERT_EQ(4, name.size());
+  ASSERT_EQ("Kirk", m.get(name, ""));
+  ASSERT_EQ("Kirk", m.get(cachedName, ""));
+  ASSERT_EQ("Kirk", m.get(cachedName, ""));
+  ASSERT_TRUE(m.containsKey(name));
+  ASSERT_FALSE(m.containsKey(KArgPath("ship|crew|1|name")));
+  ASSERT_FALSE(m.containsKey(KArgPath("ship|captain")));
+  ASSERT_FALSE(m.containsKey("ship|captain"));
+
+  m.set(KArgPath("ship|crew|1|name"), "Spock");
+  ASSERT_EQ("Spock", m.get("ship|crew|1|name", ""));
+  m[KArgPath("ship|crew|1|rank")] = 2;
+  ASSERT_EQ(2, m.get(KArgPath("ship|crew|1|rank"), 0));
+  ASSERT_EQ(1, m.erase(KArgPath("ship|crew|1|rank")));
+  ASSERT_EQ(0, m.erase(KArgPath("ship|crew|1|rank")));
+  ASSERT_EQ(0, m.erase(KArgPath("ship|crew|5|rank")));
+
+  // a cached path notices entries moving between slots
+  KArgMap flat{{"a", 1}, {"b", 2}, {"c", 3}};
+  const KArgPath c("c", true);
+  ASSERT_EQ(3, flat.get(c, 0));
+  flat.erase("a");
+  flat.set("d", 4);
+  ASSERT_EQ(3, flat.get(c, 0));
+  flat.erase("c");
+  ASSERT_EQ(0, flat.get(c, 0));
+  ASSERT_FALSE(flat.containsKey(c));
+}
+
+TEST_F(KArgMapTest, moveSemantics) {
+  const std::string text(100, 'x');
+  KArgVariant v1 = text;
+  size_t before = g_allocationCount;
+  KArgVariant v2(std::move(v1));
+  KArgVariant v3;
+  v3 = std::move(v2);
+  ASSERT_EQ(before, g_allocationCount);
+  ASSERT_EQ(KArgTypes::null, v1.getType());
+  ASSERT_EQ(text, v3.get(""));
+
+  KArgMap m;
+  m.set("text", "short");
+  std::string moved(100, 'y');
+  before = g_allocationCount;
+  m.set("text", std::move(moved));
+  // a long std::string is copied into a string block, see k_arg_string
+  ASSERT_EQ(before + 1, g_allocationCount);
+  ASSERT_EQ(std::string(100, 'y'), m.get("text", ""));
+
+  // moving the value on does not allocate
+  KArgVariant movedValue = std::string(100, 'z');
+  before = g_allocationCount;
+  m["text"] = std::move(movedValue);
+  ASSERT_EQ(before, g_allocationCount);
+  ASSERT_EQ(std::string(100, 'z'), m.get("text", ""));
+
+  // moving a container into a list does not leave a second reference behind
+  KArgMap child{{"a", 1}};
+  KArgList list;
+  list.add(std::move(child));
+  KArgMap back(list[0]);
+  ASSERT_EQ(2, back.use_count());
+  ASSERT_EQ(1, back.get("a", 0));
+  list.push_back(std::move(v3));
+  ASSERT_EQ(text, list.get(1, ""));
+  ASSERT_EQ(3, list.emplace_back(3).get(0));
+  ASSERT_EQ(3, list.size());
+}
+
+TEST_F(KArgMapTest, compactVariant) {
+  // 16 byte payload plus type and vector flag
+  ASSERT_LE(sizeof(KArgVariant), 16 + sizeof(void *));
+
+  KArgList list{true,
+                std::complex<double>(1, 2),
+                std::string(40, 's'),
+                "",
+                KTimestamp(std::chrono::seconds(5)),
+                std::vector<bool>{true, false},
+                std::vector<KTimestamp>{KTimestamp(std::chrono::seconds(1))},
+                std::vector<KDuration>{KDuration(3)}};
+  KArgList copy = list.deepClone();
+  list.clear();
+  ASSERT_EQ(std::complex<double>(1, 2),
+            copy.get(1, std::complex<double>()));
+  ASSERT_EQ(std::string(40, 's'), copy.get(2, ""));
+  ASSERT_EQ("", copy.get(3, "x"));
+  ASSERT_EQ(2, copy[5].size());
+  ASSERT_EQ(1, copy[7].size());
+  KArgVariant v = copy[2];
+  v = copy[0];
+  ASSERT_TRUE(v.get(false));
+}
+
+TEST_F(KArgMapTest, inlineStrings) {
+  std::string fits(15, 'i');
+  std::string heap(16, 'h');
+
+  size_t before = g_allocationCount;
+  KArgVariant a = "";
+  KArgVariant b = "unit";
+  KArgVariant c = fits.c_str();
+  KArgVariant d = c;
+  KArgVariant e = std::move(b);
+  d = e;
+  ASSERT_EQ(before, g_allocationCount);
+
+  ASSERT_EQ("", a.get("x"));
+  ASSERT_EQ("unit", e.get(""));
+  ASSERT_EQ(fits, c.get(""));
+  ASSERT_EQ("unit", d.get(""));
+  ASSERT_EQ(fits.size(), c.m_value.string.size());
+  ASSERT_EQ('\0', c.m_value.string.c_str()[fits.size()]);
+  ASSERT_FALSE(c.m_value.string.isHeap());
+
+  KArgVariant f = heap;
+  ASSERT_TRUE(f.m_value.string.isHeap());
+  KArgVariant g = f;
+#ifdef K_UNSHARED_STRINGS
+  ASSERT_NE(f.m_value.string.data(), g.m_value.string.data());
+#else
+  ASSERT_EQ(f.m_value.string.data(), g.m_value.string.data());
+#endif
+  f = c;
+  ASSERT_EQ(fits, f.get(""));
+  ASSERT_EQ(heap, g.get(""));
+
+  std::string binary("a\0b", 3);
+  KArgVariant h = binary;
+  ASSERT_EQ(binary, h.get(""));
+
+  KArgList list;
+  for (int i = 0; i < 100; i++) {
+    list.add(std::to_string(i));
+  }
+  for (int i = 0; i < 100; i++) {
+    ASSERT_EQ(std::to_string(i), list.get(i, ""));
+  }
+}
+
+TEST_F(KArgMapTest, sharedStrings) {
+  std::string label(100, 'l');
+  KArgMap m;
+  m.set("label", label);
+  m.set("list", KArgList{label, "short"});
+
+  size_t before = g_allocationCount;
+  KArgVariant copy = m["label"];
+#ifndef K_UNSHARED_STRINGS
+  ASSERT_EQ(before, g_allocationCount);
+  ASSERT_EQ(2, copy.m_value.string.use_count());
+  ASSERT_EQ(m["label"].m_value.string.data(), copy.m_value.string.data());
+#else
+  // every copy has a block of its own
+  ASSERT_EQ(before + 1, g_allocationCount);
+#endif
+
+  KArgMap clone = m.deepClone();
+  m.set("label", "replaced");
+  ASSERT_EQ(label, clone.get("label", ""));
+  ASSERT_EQ(label, copy.get(""));
+  KArgList list = clone.get("list", KArgList());
+  ASSERT_EQ(label, list.get(0, ""));
+  ASSERT_EQ("short", list.get(1, ""));
+  ASSERT_EQ(0, list[1].m_value.string.use_count());
+#ifndef K_UNSHARED_STRINGS
+  ASSERT_EQ(2, clone["label"].m_value.string.use_count());
+#endif
+  copy = 1;
+  ASSERT_EQ(1, clone["label"].m_value.string.use_count());
+}
+
+TEST_F(KArgMapTest, borrowedViews) {
+  std::string label(40, 'l');
+  KArgMap m;
+  m.set("label", label);
+  m.set("unit", "kph");
+  m.set("count", 3);
+  m.set("samples", std::make_shared<std::vector<double>>(
+                       std::vector<double>{1.5, 2.5, 3.5}));
+  m.set("flags", std::make_shared<std::vector<bool>>(2, true));
+  m.set("nested|names", KArgList{"a", label});
+  const KArgMap &cm = m;
+
+  size_t before = g_allocationCount;
+  ASSERT_EQ(k_string_view(label), cm.view("label"));
+  ASSERT_EQ(cm["label"].m_value.string.data(), cm.view("label").data());
+  ASSERT_EQ(k_string_view("kph"), cm.view("unit"));
+  ASSERT_EQ(k_string_view("none"), cm.view("count", "none"));
+  ASSERT_EQ(k_string_view("none"), cm.view("missing", "none"));
+  ASSERT_TRUE(cm.view("missing").empty());
+
+  auto samples = cm.span<double>("samples");
+  ASSERT_EQ(3, samples.size());
+  double sum = 0;
+  for (auto d : samples) {
+    sum += d;
+  }
+  ASSERT_EQ(7.5, sum);
+  ASSERT_TRUE(cm.span<float>("samples").empty());
+  ASSERT_TRUE(cm.span<double>("count").empty());
+  ASSERT_TRUE(cm.span<double>("missing").empty());
+  ASSERT_EQ(before, g_allocationCount);
+
+  ASSERT_EQ(k_string_view(label), cm.view("nested|names|1"));
+  KArgList names = m.get("nested|names", KArgList());
+  ASSERT_EQ(k_string_view("a"), names.view(0));
+  ASSERT_EQ(k_string_view("x"), names.view(2, "x"));
+  ASSERT_TRUE(names.span<int32_t>(0).empty());
+  ASSERT_EQ(2.5, m["samples"].span<double>()[1]);
+}
+
+TEST_F(KArgMapTest, arena) {
+  // paths short enough that looking them up never allocates a std::string
+  char path[16];
+  size_t heapAllocations = g_allocationCount;
+  {
+    KArgMap m;
+    for (int i = 0; i < 20; i++) {
+      snprintf(path, sizeof(path), "ship|crew|%d|r", i);
+      m.set(path, i);
+    }
+  }
+  heapAllocations = g_allocationCount - heapAllocations;
+
+  KArgArena arena;
+  size_t arenaAllocations = g_allocationCount;
+  KArgMap m(arena);
+  for (int i = 0; i < 20; i++) {
+    snprintf(path, sizeof(path), "ship|crew|%d|r", i);
+    m.set(path, i);
+  }
+  arenaAllocations = g_allocationCount - arenaAllocations;
+  ASSERT_LT(arenaAllocations, 8);
+  ASSERT_GT(heapAllocations, 40);
+
+  ASSERT_EQ(19, m.get("ship|crew|19|r", -1));
+  ASSERT_EQ(&arena, m.arena());
+  ASSERT_EQ(&arena, m.get("ship", KArgMap()).arena());
+  ASSERT_EQ(&arena, m.get("ship|crew", KArgList()).arena());
+  ASSERT_EQ(&arena, m.get("ship|crew|3", KArgMap()).arena());
+
+  // a heap map stays on the heap when paths are created below it
+  KArgMap heap;
+  m.set("heap", heap);
+  m.set("heap|a|b", 1);
+  ASSERT_EQ(nullptr, heap.get("a", KArgMap()).arena());
+
+  KArgArena other;
+  KArgMap copy = m.deepClone(other);
+  ASSERT_EQ(&other, copy.get("ship|crew", KArgList()).arena());
+  ASSERT_EQ(7, copy.get("ship|crew|7|r", -1));
+  KArgMap onHeap = m.deepClone();
+  ASSERT_EQ(nullptr, onHeap.get("ship|crew|7", KArgMap()).arena());
+
+  KArgList list(arena);
+  list.add(KArgMap(arena));
+  ASSERT_EQ(&arena, list.deepClone(arena).arena());
+  ASSERT_EQ(nullptr, list.deepClone().arena());
+}
+
+TEST_F(KArgMapTest, sharedHandles) {
+#ifdef K_SINGLE_THREADED
+  // intrusive count, the handle is a single pointer
+  ASSERT_EQ(sizeof(void *), sizeof(KArgMap));
+#endif
+  // the copy-on-write mark is kept with the storage, not in the handle
+  ASSERT_EQ(sizeof(k_arg_map_ptr), sizeof(KArgMap));
+  ASSERT_EQ(sizeof(k_arg_list_ptr), sizeof(KArgList));
+  KArgMap m;
+  m.set("child|a", 1);
+  KArgMap child = m.get("child", KArgMap());
+  ASSERT_EQ(2, child.use_count());
+  {
+    KArgVariant v = child;
+    KArgMap again(v);
+    ASSERT_EQ(4, child.use_count());
+  }
+  ASSERT_EQ(2, child.use_count());
+  m.erase("child");
+  ASSERT_EQ(1, child.use_count());
+  ASSERT_EQ(1, child.get("a", 0));
+
+  // the storage of a map or list value can be shared in every build
+  KArgVariant held = child;
+  auto storage = held.get(std::shared_ptr<k_arg_map_type>());
+  ASSERT_NE(nullptr, storage);
+  ASSERT_EQ(1, storage->size());
+  ASSERT_EQ(3, child.use_count());
+  ASSERT_EQ(nullptr, held.get(std::shared_ptr<k_arg_list_type>()));
+  held = KArgVariant();
+  ASSERT_EQ(2, child.use_count());
+  storage.reset();
+  ASSERT_EQ(1, child.use_count());
+
+  KArgArena arena;
+  KArgList list(arena);
+  list.add(KArgMap(arena));
+  KArgList alias = list;
+  ASSERT_EQ(2, alias.use_count());
+}
+
+TEST_F(KArgMapTest, copyOnWrite) {
+  KArgMap m;
+  m.set("a|b", 1);
+  m.set("a|c", 2);
+  m.set("other|x", 3);
+  m.set("list", KArgList{1, 2});
+  KArgMap other = m.get("other", KArgMap());
+  KArgMap a = m.get("a", KArgMap());
+  ASSERT_EQ(2, other.use_count());
+
+  KArgMap snap = m.cowClone();
+  ASSERT_TRUE(m.isCopyOnWrite());
+  ASSERT_TRUE(snap.isCopyOnWrite());
+  ASSERT_EQ(2, snap.use_count());
+
+  // only the root and "a" are copied
+  snap.set("a|b", 10);
+  ASSERT_EQ(1, m.get("a|b", 0));
+  ASSERT_EQ(10, snap.get("a|b", 0));
+  ASSERT_EQ(2, snap.get("a|c", 0));
+  ASSERT_EQ(2, a.use_count());
+  ASSERT_EQ(3, other.use_count());
+
+  // writes to the original do not show in the clone either
+  m[KArgPath("other|x")] = 30;
+  m.set("new|y", 4);
+  ASSERT_EQ(30, m.get("other|x", 0));
+  ASSERT_EQ(3, snap.get("other|x", 0));
+  ASSERT_FALSE(snap.containsKey("new"));
+
+  ASSERT_EQ(1, snap.erase(KArgPath("a|c")));
+  ASSERT_EQ(2, m.get("a|c", 0));
+  ASSERT_FALSE(snap.containsKey(KArgPath("a|c")));
+
+  KArgList list = snap.get("list", KArgList());
+  ASSERT_TRUE(list.isCopyOnWrite());
+  list.add(3);
+  ASSERT_EQ(2, m.get("list", KArgList()).size());
+  snap.set("list|0", 5);
+  ASSERT_EQ(1, m.get("list|0", 0));
+  ASSERT_EQ(5, snap.get("list|0", 0));
+
+  snap.clear();
+  ASSERT_TRUE(snap.empty());
+  ASSERT_EQ(1, m.get("a|b", 0));
+
+  KArgList l{1, 2};
+  KArgList lsnap = l.cowClone();
+  l.removeAt(0);
+  ASSERT_EQ(1, l.size());
+  ASSERT_EQ(2, lsnap.size());
+
+  // the mark is on the storage, so every handle to it copies before writing
+  KArgMap plain;
+  plain.set("k|v", 1);
+  KArgMap alias = plain;
+  ASSERT_FALSE(alias.isCopyOnWrite());
+  KArgMap frozen = static_cast<const KArgMap &>(plain).cowClone();
+  ASSERT_TRUE(alias.isCopyOnWrite());
+  alias.set("k|v", 2);
+  ASSERT_EQ(1, frozen.get("k|v", 0));
+  ASSERT_EQ(1, plain.get("k|v", 0));
+  KArgMap k = plain.get("k", KArgMap());
+  ASSERT_TRUE(k.isCopyOnWrite());
+}
+
+TEST_F(KArgMapTest, persistentMap) {
+  KArgMap m;
+  for (int i = 0; i < 2000; i++) {
+    m.set("key" + std::to_string(i), i);
+  }
+  m.set("child|a", 1);
+  KArgPersistentMap v1(m);
+  ASSERT_EQ(2001, v1.size());
+  ASSERT_EQ(1234, v1.get("key1234", -1));
+
+  auto v2 = v1.with("key5", "five").with("new", 2.5);
+  ASSERT_EQ(2002, v2.size());
+  ASSERT_EQ(5, v1.get("key5", -1));
+  ASSERT_EQ("five", v2.get("key5", "fail"));
+  ASSERT_FALSE(v1.containsKey("new"));
+  ASSERT_EQ(2.5, v2.get("new", 0.0));
+
+  // removing every key visits each way a node can shrink
+  auto v3 = v2;
+  for (int i = 0; i < 2000; i++) {
+    v3 = v3.without("key" + std::to_string(i));
+    ASSERT_EQ(2001 - i, v3.size());
+  }
+  ASSERT_EQ(2.5, v3.get("new", 0.0));
+  ASSERT_EQ(2002, v2.size());
+  ASSERT_EQ(1999, v2.get("key1999", -1));
+  ASSERT_EQ(v3.size(), v3.without("missing").size());
+  ASSERT_TRUE(v3.without("new").without("child").empty());
+
+  // nested maps come back as copy-on-write handles
+  auto child = v1.get("child", KArgMap());
+  child.set("a", 2);
+  ASSERT_EQ(1, v1.get("child", KArgMap()).get("a", -1));
+
+  // nor does modifying the map a version was made from, or a value added
+  m.set("child|a", 3);
+  m.get("child", KArgMap()).set("b", 4);
+  ASSERT_EQ(3, m.get("child|a", -1));
+  ASSERT_EQ(1, v1.get("child", KArgMap()).get("a", -1));
+  ASSERT_FALSE(v1.get("child", KArgMap()).containsKey("b"));
+  KArgList added{1, 2};
+  auto v4 = v1.with("list", added);
+  added.add(KArgList{3});
+  ASSERT_EQ(2, v4.get("list", KArgList()).size());
+
+  auto back = v2.toArgMap();
+  ASSERT_EQ(2002, back.size());
+  ASSERT_EQ("five", back.get("key5", "fail"));
+  ASSERT_EQ(1, back.get("child|a", -1));
+
+  // keys with equal hashes share a collision node
+  ASSERT_EQ("k32728"_k.hash(), "k261234"_k.hash());
+  auto c = KArgPersistentMap().with("k32728", 1).with("k261234", 2);
+  ASSERT_EQ(1, c.get("k32728", -1));
+  ASSERT_EQ(2, c.get("k261234", -1));
+  c = c.with("k261234", 3).without("k32728");
+  ASSERT_EQ(1, c.size());
+  ASSERT_EQ(3, c.get("k261234", -1));
+  ASSERT_FALSE(c.containsKey("k32728"));
+
+  std::ostringstream os;
+  os << KArgPersistentMap().with("a", 1);
+  ASSERT_EQ("{\"a\":1}", os.str());
+}
+
+TEST_F(KArgMapTest, constLookupDoesNotInsert) {
+  KArgMap m;
+  m.set("a|b", 1);
+  const KArgMap &c = m;
+  ASSERT_EQ(KArgTypes::null, c["missing"].m_type);
+  ASSERT_EQ(KArgTypes::null, c["a|missing"].m_type);
+  ASSERT_EQ(KArgTypes::int32, c["a|b"].m_type);
+  ASSERT_EQ(1, m.size());
+}
+
+#ifndef K_SINGLE_THREADED
+TEST_F(KArgMapTest, publisherStress) {
+  KArgMap initial;
+  initial.set("x", 0);
+  initial.set("pair|y", 0);
+  KArgMapPublisher publisher(initial);
+  // the writer's handle is copy-on-write, changing it does not reach readers
+  initial.set("x", -1);
+
+  const int kUpdates = 2000;
+  std::atomic<bool> done{false};
+  std::atomic<int> failures{0};
+  std::vector<std::thread> readers;
+  for (int t = 0; t < 8; t++) {
+    readers.emplace_back([&]() {
+      KArgMapPublisher::Reader reader(publisher);
+      uint64_t lastVersion = 0;
+      while (!done.load()) {
+        auto snap = reader.read();
+        int x = snap->get("x", -2);
+        int y = snap->get("pair|y", -3);
+        if (x != y || x != int(snap.version()) ||
+            snap.version() < lastVersion) {
+          failures++;
+        }
+        lastVersion = snap.version();
+      }
+    });
+  }
+  for (int i = 1; i <= kUpdates; i++) {
+    if (i % 2) {
+      publisher.update([i](KArgMap &m) {
+        m.set("x", i);
+        m.set("pair|y", i);
+      });
+    } else {
+      KArgMap next = publisher.snapshot().deepClone();
+      next.set("x", i);
+      next.set("pair|y", i);
+      publisher.publish(next);
+    }
+  }
+  done = true;
+  for (auto &t : readers) {
+    t.join();
+  }
+  ASSERT_EQ(0, failures.load());
+
+  KArgMapPublisher::Reader reader(publisher);
+  ASSERT_EQ(kUpdates, reader.read()->get("x", 0));
+  ASSERT_EQ(kUpdates, int(reader.read().version()));
+  // with no reader inside a guard every replaced snapshot is freed
+  publisher.update([](KArgMap &m) { m.set("x", 0); });
+  ASSERT_EQ(0, publisher.retired());
+  {
+    auto held = reader.read();
+    publisher.update([](KArgMap &m) { m.set("x", 1); });
+    publisher.update([](KArgMap &m) { m.set("x", 2); });
+    ASSERT_EQ(2, publisher.retired());
+    ASSERT_EQ(0, held->get("x", -1));
+  }
+  publisher.update([](KArgMap &m) { m.set("x", 3); });
+  ASSERT_EQ(0, publisher.retired());
+}
+#endif
+
+#ifndef K_SINGLE_THREADED
+TEST_F(KArgMapTest, concurrentMap) {
+  KArgConcurrentMap m(6);
+  ASSERT_EQ(8, m.shards());
+  m.set("sensor|a", 1);
+  m.set(KArgPath("sensor|b"), 2.5);
+  ASSERT_EQ(1, m.get("sensor|a", 0));
+  ASSERT_EQ(2.5, m.get("sensor|b", 0.0));
+  ASSERT_EQ("fail", m.get("sensor|c", "fail"));
+  ASSERT_EQ(1, m.size());
+  KArgMap sensor = m.get("sensor", KArgMap());
+  m.set("sensor|a", 10);
+  ASSERT_EQ(1, sensor.get("a", 0));
+  // update follows paths as set does
+  auto increment = [](KArgVariant &v) { v = v.get(0) + 1; };
+  m.update("sensor|a", increment);
+  m.update(KArgPath("sensor|b|count"), increment);
+  m.update("sensor|a|0", increment); // not a list, nothing to update
+  ASSERT_EQ(11, m.get("sensor|a", 0));
+  ASSERT_EQ(1, m.get("sensor|b|count", 0));
+  ASSERT_EQ(2.5, m.get("sensor|b|value", 0.0));
+  ASSERT_EQ(1, m.snapshot().size());
+
+  const int kThreads = 8;
+  const int kKeys = 500;
+  std::atomic<bool> stop{false};
+  std::atomic<int> failures{0};
+  // a snapshot sees first|n before second|n because second is written last
+  std::thread exporter([&]() {
+    while (!stop.load()) {
+      auto snap = m.snapshot();
+      if (snap.get("order|second", 0) > snap.get("first", 0)) {
+        failures++;
+      }
+    }
+  });
+  std::vector<std::thread> writers;
+  for (int t = 0; t < kThreads; t++) {
+    writers.emplace_back([&m, t]() {
+      for (int i = 0; i < kKeys; i++) {
+        m.set("t" + std::to_string(t) + "|" + std::to_string(i), i);
+        m.update("count", [](KArgVariant &v) { v = v.get(0) + 1; });
+        if (t == 0) {
+          m.set("first", i);
+          m.set("order|second", i);
+        }
+      }
+    });
+  }
+  for (auto &t : writers) {
+    t.join();
+  }
+  stop = true;
+  exporter.join();
+  ASSERT_EQ(0, failures.load());
+  ASSERT_EQ(kThreads * kKeys, m.get("count", 0));
+  auto snap = m.snapshot();
+  ASSERT_EQ(kThreads + 4, snap.size());
+  ASSERT_EQ(kKeys - 1, snap.get("t3|" + std::to_string(kKeys - 1), -1));
+  ASSERT_EQ(1, m.erase("t3"));
+  ASSERT_FALSE(m.containsKey(KArgPath("t3|0")));
+  ASSERT_TRUE(snap.containsKey(KArgPath("t3|0")));
+  m.clear();
+  ASSERT_TRUE(m.empty());
+}
+#endif
+
+TEST_F(KArgMapTest, observableMap) {
+  KArgObservableMap m;
+  m.set("net|port", 80); // nobody is told
+  std::vector<std::vector<k_map_string_t>> net, port, all;
+  m.subscribe("net", [&](const std::vector<k_map_string_t> &p) {
+    net.push_back(p);
+  });
+  auto portId =
+      m.subscribe("net|port", [&](const std::vector<k_map_string_t> &p) {
+        port.push_back(p);
+      });
+  m.subscribe("", [&](const std::vector<k_map_string_t> &p) {
+    all.push_back(p);
+  });
+
+  {
+    KArgObservableMap::Transaction tx(m);
+    m.set("net|port", 81);
+    m.set("net|host", "a");
+    m["net|port"] = 82;
+    {
+      KArgObservableMap::Transaction inner(m);
+      m.set("disk|size", 1);
+    }
+    ASSERT_TRUE(net.empty());
+  }
+  ASSERT_EQ(1, net.size());
+  ASSERT_EQ((std::vector<k_map_string_t>{"net|host", "net|port"}), net[0]);
+  ASSERT_EQ((std::vector<k_map_string_t>{"net|port"}), port[0]);
+  ASSERT_EQ(3, all[0].size());
+  ASSERT_EQ(82, m.get("net|port", 0));
+
+  // erasing a parent reaches subscribers below it
+  m.erase("net");
+  ASSERT_EQ((std::vector<k_map_string_t>{"net"}), port[1]);
+  ASSERT_EQ(0, m.erase("missing"));
+  ASSERT_EQ(2, all.size());
+
+  // emplace reports a change only when it stores a value
+  ASSERT_TRUE(m.emplace("disk|free", 5).second);
+  ASSERT_FALSE(m.emplace("disk|size", 2).second);
+  ASSERT_EQ(3, all.size());
+  ASSERT_EQ((std::vector<k_map_string_t>{"disk|free"}), all[2]);
+  ASSERT_EQ(1, m.get("disk|size", 0));
+
+  m.unsubscribe(portId);
+  m.clear();
+  ASSERT_EQ(2, port.size());
+  ASSERT_EQ(3, net.size());
+
+  // changes made by a callback are delivered in the next batch
+  m.subscribe("trigger", [&](const std::vector<k_map_string_t> &) {
+    m.set("net|derived", true);
+  });
+  m.set("trigger", 1);
+  ASSERT_EQ((std::vector<k_map_string_t>{"net|derived"}), net.back());
+  ASSERT_TRUE(m.get("net|derived", false));
+
+  // operator[] is reported once the returned value has been written
+  int seen = 0;
+  m.subscribe("late", [&](const std::vector<k_map_string_t> &) {
+    seen = m.get("late", 0);
+  });
+  m["late"] = 5;
+  ASSERT_EQ(0, seen);
+  m.flush();
+  ASSERT_EQ(5, seen);
+  m["late"] = 6;
+  m.set("disk|size", 3);
+  ASSERT_EQ(6, seen);
+
+  // a throwing callback leaves changes outside transactions delivered at once
+  auto boomId = m.subscribe("boom", [](const std::vector<k_map_string_t> &) {
+    throw std::runtime_error("boom");
+  });
+  ASSERT_THROW(m.set("boom", 1), std::runtime_error);
+  m.unsubscribe(boomId);
+  m.set("late", 7);
+  ASSERT_EQ(7, seen);
+}
+
+TEST_F(KArgMapTest, emplace) {
+  KArgMap m;
+  auto added = m.emplace("a", 1);
+  ASSERT_TRUE(added.second);
+  ASSERT_EQ(1, added.first.get(0));
+  // an existing value is kept, as with std::unordered_map::emplace
+  auto kept = m.emplace("a", 2);
+  ASSERT_FALSE(kept.second);
+  ASSERT_EQ(1, kept.first.get(0));
+  ASSERT_EQ(&added.first, &kept.first);
+  m.set("a", 2);
+  ASSERT_FALSE(m.try_emplace("a", 3));
+  ASSERT_EQ(2, m.get("a", 0));
+  std::string text(40, 't');
+  ASSERT_FALSE(m.emplace("a", std::move(text)).second);
+  ASSERT_EQ(40, text.size());
+  ASSERT_FALSE(m.emplace("a|0", 4).second);
+  ASSERT_EQ(2, m.get("a", 0));
+  ASSERT_TRUE(m.try_emplace("b", std::string("bee")));
+  ASSERT_EQ("bee", m.get("b", ""));
+  ASSERT_TRUE(m.try_emplace("c|d", KArgVariant(4.5)));
+  ASSERT_EQ(4.5, m.get("c|d", 0.0));
+  KArgVariant v = KArgList{1, 2};
+  ASSERT_TRUE(m.emplace(KArgPath("c|e"), std::move(v)).second);
+  ASSERT_EQ(2, m.get(KArgPath("c|e|1"), 0));
+}
+
+TEST_F(KArgMapTest, setThroughScalar) {
+  KArgMap m;
+  m.set("a", 1);
+  // an index into a value that is not a list cannot be created
+  m.set("a|0", 2);
+  m.set(KArgPath("a|0"), 3);
+  m.set(KArgPath("a|0"), std::vector<int32_t>{4});
+  ASSERT_FALSE(m.emplace("a|0", 5).second);
+  ASSERT_EQ(1, m.get("a", 0));
+  // nothing was stored in the null value returned for missing keys
+  ASSERT_EQ(-1, NullKArgVariant::Instance().get(-1));
+  ASSERT_EQ(-1, m.get("missing", -1));
+
+#ifndef K_SINGLE_THREADED
+  KArgConcurrentMap c;
+  c.set("a", 1);
+  c.set("a|0", 2);
+  ASSERT_EQ(1, c.get("a", 0));
+  ASSERT_EQ(-1, NullKArgVariant::Instance().get(-1));
+#endif
+}
+
 TEST_F(KArgMapTest, listIteration) {
   KArgList list{0, 1, 2};
   int i = 0;
@@ -172,6 +1068,21 @@ TEST_F(KArgMapTest, listIteration) {
     break; // only first item is an arglist
   }
 }
+
+TEST_F(KArgMapTest, listGetPastEnd) {
+  KArgList l;
+  l.add(1);
+  l.add(2);
+  ASSERT_EQ(-1, l.get(l.size(), -1));
+  ASSERT_EQ("none", l.get(l.size(), "none"));
+  const KArgList &cl = l;
+  ASSERT_EQ(-1, cl.get(cl.size(), -1));
+  ASSERT_EQ("none", cl.get(cl.size(), "none"));
+#ifndef K_CUSTOM_TYPES_UNSUPPORTED
+  ASSERT_EQ(nullptr, l.getCustomType(l.size(), std::shared_ptr<int>()));
+  ASSERT_EQ(nullptr, cl.getCustomType(cl.size(), std::shared_ptr<int>()));
+#endif
+}
 TEST_F(KArgMapTest, constKArgGet) {
   KArgMap config{{"x", 123}};
   KArgList list{1.0};
@@ -1022,7 +1933,217 @@ TEST_F(KArgMapTest, deepClone) {
 
   ASSERT_EQ("xyz", m2copy.get("xyz", "error"));
   ASSERT_EQ("abc", list2copy.get(0, "error"));
+
+  // maps and lists in vectors are cloned too
+  KArgMap element{{"k", 1}};
+  KArgList listElement({1});
+  m.set("maps", std::vector<KArgMap>{element});
+  m.set("lists", std::vector<KArgList>{listElement});
+  mclone = m.deepClone();
+  element.set("k", 2);
+  listElement.add({2});
+  ASSERT_TRUE(mclone != m);
+  element.set("k", 1);
+  listElement.removeAt(1);
+  ASSERT_TRUE(mclone == m);
+}
+
+TEST_F(KArgMapTest, deepEquality) {
+  KArgMap a;
+  a.set("x", 1);
+  a.set("name", "a string too long for the inline buffer");
+  a.set("v", std::vector<int32_t>{1, 2, 3});
+  a.set("sub|list", KArgList({"abc", 1.5}));
+  a.set("sub|maps", std::vector<KArgMap>{KArgMap{{"k", 1}}});
+
+  // same contents, different insertion order and storage
+  KArgMap b;
+  b.set("sub|maps", std::vector<KArgMap>{KArgMap{{"k", 1}}});
+  b.set("sub|list", KArgList({"abc", 1.5}));
+  b.set("v", std::vector<int32_t>{1, 2, 3});
+  b.set("name", "a string too long for the inline buffer");
+  b.set("x", 1);
+
+  ASSERT_TRUE(a == b);
+  ASSERT_FALSE(a != b);
+  ASSERT_EQ(a.hash(), b.hash());
+  ASSERT_TRUE(a == a.deepClone());
+  ASSERT_TRUE(a["sub"] == b["sub"]);
+  ASSERT_EQ(a["sub"].hash(), b["sub"].hash());
+
+  b.set("sub|list", KArgList({"abc", 2.5}));
+  ASSERT_TRUE(a != b);
+  ASSERT_FALSE(a["sub"] == b["sub"]);
+  b.set("sub|list", KArgList({"abc", 1.5}));
+  ASSERT_TRUE(a == b);
+
+  // types must match exactly
+  ASSERT_TRUE(KArgVariant(int32_t(1)) != KArgVariant(int64_t(1)));
+  ASSERT_TRUE(KArgVariant(1) != KArgVariant(1.0));
+  ASSERT_TRUE(KArgVariant(0.0) == KArgVariant(-0.0));
+  ASSERT_EQ(KArgVariant(0.0).hash(), KArgVariant(-0.0).hash());
+
+  // NaN equals NaN, so a map holding one still equals its clone
+  KArgMap nan;
+  nan.set("d", std::numeric_limits<double>::quiet_NaN());
+  nan.set("f", -std::numeric_limits<float>::quiet_NaN());
+  nan.set("v", std::vector<double>{1, std::numeric_limits<double>::quiet_NaN()});
+  nan.set("c", std::complex<float>(std::numeric_limits<float>::quiet_NaN(), 1));
+  ASSERT_TRUE(nan == nan.deepClone());
+  ASSERT_EQ(nan.hash(), nan.deepClone().hash());
+  ASSERT_TRUE(KArgVariant(std::numeric_limits<double>::quiet_NaN()) ==
+              KArgVariant(-std::numeric_limits<double>::quiet_NaN()));
+  ASSERT_EQ(KArgVariant(std::numeric_limits<double>::quiet_NaN()).hash(),
+            KArgVariant(-std::numeric_limits<double>::quiet_NaN()).hash());
+  ASSERT_TRUE(KArgVariant(std::numeric_limits<double>::quiet_NaN()) !=
+              KArgVariant(0.0));
+
+  // a null entry is still an entry
+  b["n"];
+  ASSERT_TRUE(a != b);
+
+  KArgList l1({1, "two", KArgMap{{"three", 3}}});
+  KArgList l2({1, "two", KArgMap{{"three", 3}}});
+  KArgList l3({"two", 1, KArgMap{{"three", 3}}});
+  ASSERT_TRUE(l1 == l2);
+  ASSERT_EQ(l1.hash(), l2.hash());
+  ASSERT_TRUE(l1 != l3);
+
+  std::unordered_set<KArgMap> seen;
+  seen.insert(a);
+  seen.insert(a.deepClone());
+  seen.insert(b);
+  ASSERT_EQ(2u, seen.size());
+}
+
+TEST_F(KArgMapTest, internStore) {
+  auto device = [](int id) {
+    KArgMap m;
+    m.set("id", id);
+    m.set("meta|vendor", "a vendor name too long for the inline buffer");
+    m.set("meta|model", "X1");
+    m.set("calibration", std::vector<double>{1.0, 2.0, 3.0});
+    m.set("channels", KArgList({KArgMap{{"gain", 2}}, KArgMap{{"gain", 2}}}));
+    return m;
+  };
+
+  KArgInternStore store;
+  KArgMap a = store.intern(device(1));
+  KArgMap b = store.intern(device(2));
+  ASSERT_TRUE(a == device(1));
+  ASSERT_TRUE(b == device(2));
+  ASSERT_TRUE(a.isCopyOnWrite());
+
+  // identical subtrees share one instance
+  ASSERT_EQ(storage(a.get("meta", KArgMap())),
+            storage(b.get("meta", KArgMap())));
+  ASSERT_EQ(storage(a.get("channels", KArgList())),
+            storage(b.get("channels", KArgList())));
+  auto channels = a.get("channels", KArgList());
+  ASSERT_EQ(storage(channels.get(0, KArgMap())),
+            storage(channels.get(1, KArgMap())));
+  ASSERT_EQ(a.get("calibration", std::shared_ptr<std::vector<double>>()),
+            b.get("calibration", std::shared_ptr<std::vector<double>>()));
+  ASSERT_NE(storage(a), storage(b));
+
+  // meta, gain map, channels and calibration are shared; the roots are not
+  ASSERT_EQ(6u, store.size());
+  ASSERT_EQ(12u, store.stats().interned);
+  ASSERT_EQ(6u, store.stats().unique);
+  ASSERT_DOUBLE_EQ(2.0, store.stats().ratio());
+
+  // interning an interned map finds it
+  KArgMap again = store.intern(a);
+  ASSERT_EQ(storage(a), storage(again));
+
+  // writes copy instead of changing the shared instance
+  b.set("meta|model", "X2");
+  ASSERT_EQ("X1", a.get("meta|model", ""));
+  ASSERT_EQ("X2", b.get("meta|model", ""));
+
+  a = KArgMap();
+  again = KArgMap();
+  channels = KArgList();
+  // both roots and meta; b now holds copies of its root and meta
+  ASSERT_EQ(3u, store.collect());
+  ASSERT_EQ(3u, store.size());
+  b = KArgMap();
+  ASSERT_EQ(3u, store.collect());
+  ASSERT_EQ(0u, store.size());
+}
+
+#ifndef K_UNSHARED_STRINGS
+TEST_F(KArgMapTest, stringPool) {
+  KArgStringPool pool(2);
+  const char *model = "a model name longer than 15 characters";
+
+  KArgVariant a = pool.value(model);
+  KArgVariant b = pool.value(model);
+  ASSERT_EQ(model, a.get(std::string()));
+  ASSERT_TRUE(a == b);
+  ASSERT_EQ(3u, a.m_value.string.use_count()); // a, b and the pool
+  ASSERT_EQ(1u, pool.hits());
+  ASSERT_EQ(1u, pool.misses());
+
+  // short strings are stored inline and never pooled
+  KArgVariant unit = pool.value("dBm");
+  ASSERT_EQ("dBm", unit.get(std::string()));
+  ASSERT_EQ(1u, pool.size());
+
+  KArgMap m;
+  m.set("model", model);
+  m.set("sub|model", model);
+  m.set("list", KArgList({std::string(model), "x"}));
+  ASSERT_EQ(1u, m["model"].m_value.string.use_count());
+  pool.intern(m);
+  ASSERT_EQ(6u, a.m_value.string.use_count());
+  ASSERT_EQ(model, m.get("sub|model", ""));
+
+  // the least recently used string is evicted, values keep it alive
+  pool.value("another string longer than 15");
+  pool.value("a third string longer than 15");
+  ASSERT_EQ(2u, pool.size());
+  ASSERT_EQ(1u, pool.evictions());
+  ASSERT_EQ(5u, a.m_value.string.use_count());
+  ASSERT_EQ(model, a.get(std::string()));
+  KArgVariant c = pool.value(model);
+  ASSERT_EQ(2u, c.m_value.string.use_count()); // added again
+  ASSERT_TRUE(a == c);
+
+  pool.clear();
+  ASSERT_EQ(0u, pool.size());
+  ASSERT_EQ(0u, pool.hits());
+  ASSERT_EQ(0u, pool.misses());
+  ASSERT_EQ(0u, pool.evictions());
+  ASSERT_EQ(1u, c.m_value.string.use_count());
 }
+#else
+TEST_F(KArgMapTest, stringPool) {
+  KArgStringPool pool(2);
+  const char *model = "a model name longer than 15 characters";
+
+  // values are copies of the pooled string, which outlives them
+  ASSERT_EQ(model, pool.value(model).get(std::string()));
+  KArgVariant a = pool.value(model);
+  ASSERT_EQ(model, a.get(std::string()));
+  ASSERT_EQ(1u, pool.hits());
+  ASSERT_EQ(1u, pool.misses());
+
+  KArgMap m;
+  m.set("model", model);
+  m.set("sub|model", model);
+  pool.intern(m);
+  ASSERT_EQ(3u, pool.hits());
+  ASSERT_EQ(model, m.get("sub|model", ""));
+
+  pool.value("another string longer than 15");
+  pool.value("a third string longer than 15");
+  ASSERT_EQ(2u, pool.size());
+  ASSERT_EQ(1u, pool.evictions());
+  ASSERT_EQ(model, pool.value(model).get(std::string()));
+  ASSERT_EQ(model, a.get(std::string()));
+}
+#endif
 
 TEST_F(KArgMapTest, duplicate) {}
 